@@ -0,0 +1,167 @@
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "ambientocclusion.h"
+#include "model.h"
+#include "bvh.h"
+
+// Passes of filling uncovered texels from covered neighbours.
+static const int dilationPasses = 4;
+
+// Small, fast generator seeded per texel, so bakes don't depend on how
+// the rows were split between threads.
+struct XorShift
+{
+    uint32_t state;
+
+    explicit XorShift(uint32_t seed) : state(seed * 2654435761u + 1) { }
+
+    float next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+// Which face covers each texel centre, -1 for none.
+static std::vector<int> coverage(const Model &model, int width, int height)
+{
+    std::vector<int> faceOf(width * height, -1);
+    for (int f = 0; f < model.numFaces(); f++) {
+        Vec2f t[3];
+        for (int c = 0; c < 3; c++) {
+            Vec2f uv = model.getTextureVertex(f, c);
+            t[c] = Vec2f(uv.u * width, uv.v * height);
+        }
+        float area = (t[1].x - t[0].x) * (t[2].y - t[0].y) - (t[1].y - t[0].y) * (t[2].x - t[0].x);
+        if (area == 0.0f) {
+            continue;
+        }
+        int minX = std::max(0, int(std::floor(std::min({ t[0].x, t[1].x, t[2].x }))));
+        int minY = std::max(0, int(std::floor(std::min({ t[0].y, t[1].y, t[2].y }))));
+        int maxX = std::min(width - 1, int(std::ceil(std::max({ t[0].x, t[1].x, t[2].x }))));
+        int maxY = std::min(height - 1, int(std::ceil(std::max({ t[0].y, t[1].y, t[2].y }))));
+        for (int y = minY; y <= maxY; y++) {
+            for (int x = minX; x <= maxX; x++) {
+                Vec2f p(x + 0.5f, y + 0.5f);
+                float w1 = ((p.x - t[0].x) * (t[2].y - t[0].y) - (p.y - t[0].y) * (t[2].x - t[0].x)) / area;
+                float w2 = ((t[1].x - t[0].x) * (p.y - t[0].y) - (t[1].y - t[0].y) * (p.x - t[0].x)) / area;
+                if (w1 >= 0.0f && w2 >= 0.0f && w1 + w2 <= 1.0f) {
+                    faceOf[y*width + x] = f;
+                }
+            }
+        }
+    }
+    return faceOf;
+}
+
+// Fraction of cosine-distributed rays from the surface point that escape.
+static float occlusionAt(const Bvh &bvh, const Vec3f &point, const Vec3f &normal,
+                         int samples, float maxDistance, float offset, XorShift &random)
+{
+    // Any basis around the normal will do.
+    Vec3f helper = std::fabs(normal.x) < 0.9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0);
+    Vec3f tangent = (helper ^ normal).normalized();
+    Vec3f bitangent = normal ^ tangent;
+
+    Ray ray;
+    ray.origin = point + normal * offset;
+    ray.tMax = maxDistance;
+    int open = 0;
+    for (int s = 0; s < samples; s++) {
+        float r = std::sqrt(random.next());
+        float phi = 2.0f * float(M_PI) * random.next();
+        float z = std::sqrt(std::max(0.0f, 1.0f - r*r));
+        ray.direction = tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * z;
+        if (!bvh.occluded(ray)) {
+            open++;
+        }
+    }
+    return float(open) / samples;
+}
+
+TGAImage bakeAmbientOcclusion(const Model &model, const Bvh &bvh,
+                              const AmbientOcclusionSettings &settings)
+{
+    int width = settings.width;
+    int height = settings.height;
+    std::vector<int> faceOf = coverage(model, width, height);
+
+    Vec3f extent = model.getBoundsMax() - model.getBoundsMin();
+    float maxDistance = settings.maxDistance * extent.magnitude();
+    float offset = 1e-4f * extent.magnitude();
+
+    std::vector<float> ao(width * height, 0.0f);
+    parallelFor(0, height, [&](int y) {
+        for (int x = 0; x < width; x++) {
+            int f = faceOf[y*width + x];
+            if (f < 0) {
+                continue;
+            }
+            // Barycentrics of the texel centre, to find the surface point.
+            Vec2f t[3];
+            for (int c = 0; c < 3; c++) {
+                Vec2f uv = model.getTextureVertex(f, c);
+                t[c] = Vec2f(uv.u * width, uv.v * height);
+            }
+            Vec2f p(x + 0.5f, y + 0.5f);
+            float area = (t[1].x - t[0].x) * (t[2].y - t[0].y) - (t[1].y - t[0].y) * (t[2].x - t[0].x);
+            float w1 = ((p.x - t[0].x) * (t[2].y - t[0].y) - (p.y - t[0].y) * (t[2].x - t[0].x)) / area;
+            float w2 = ((t[1].x - t[0].x) * (p.y - t[0].y) - (t[1].y - t[0].y) * (p.x - t[0].x)) / area;
+            float w0 = 1.0f - w1 - w2;
+            Vec3f point = model.getVertex(f, 0) * w0 + model.getVertex(f, 1) * w1 + model.getVertex(f, 2) * w2;
+            Vec3f normal = (model.getVertexNormal(f, 0) * w0 + model.getVertexNormal(f, 1) * w1 +
+                            model.getVertexNormal(f, 2) * w2).normalized();
+
+            XorShift random(y*width + x);
+            ao[y*width + x] = occlusionAt(bvh, point, normal, settings.samples,
+                                          maxDistance, offset, random);
+        }
+    }, settings.threads);
+
+    // Grow the covered region a few texels, so lookups that land just
+    // outside a face (or get filtered across a seam) don't see black.
+    std::vector<char> covered(width * height);
+    for (int i = 0; i < width * height; i++) {
+        covered[i] = faceOf[i] >= 0;
+    }
+    for (int pass = 0; pass < dilationPasses; pass++) {
+        std::vector<char> grown = covered;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                if (covered[y*width + x]) {
+                    continue;
+                }
+                float sum = 0.0f;
+                int n = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < width && ny < height && covered[ny*width + nx]) {
+                            sum += ao[ny*width + nx];
+                            n++;
+                        }
+                    }
+                }
+                if (n > 0) {
+                    ao[y*width + x] = sum / n;
+                    grown[y*width + x] = 1;
+                }
+            }
+        }
+        covered.swap(grown);
+    }
+
+    TGAImage image(width, height, TGAImage::GRAYSCALE);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char value = covered[y*width + x] ? (unsigned char)std::lround(ao[y*width + x] * 255.0f) : 255;
+            image.set(x, y, TGAColor(value, 1));
+        }
+    }
+    image.flip_vertically();
+    return image;
+}
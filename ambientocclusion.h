@@ -0,0 +1,36 @@
+#ifndef __AMBIENTOCCLUSION_H__
+#define __AMBIENTOCCLUSION_H__
+
+#include "tgaimage.h"
+#include "parallel.h"
+
+class Model;
+class Bvh;
+
+struct AmbientOcclusionSettings
+{
+    int width = 512;
+    int height = 512;
+
+    // Rays per texel, cosine-distributed over the hemisphere around the
+    // surface normal.
+    int samples = 32;
+
+    // Occluders further away than this fraction of the model's bounding
+    // box diagonal don't count.
+    float maxDistance = 0.2f;
+
+    int threads = workerCount();
+};
+
+// Bakes ambient occlusion over the model's texture layout: for every texel
+// some face covers, the fraction of rays from the matching surface point
+// that escape the mesh (255 fully open, 0 fully occluded). bvh must be
+// built over the model's full mesh. Texels just outside the faces are
+// filled from their neighbours so filtering across seams stays clean. The
+// result is a grayscale map, oriented on disk like the model's other
+// maps, ready to write next to them as path_ao.tga.
+TGAImage bakeAmbientOcclusion(const Model &model, const Bvh &bvh,
+                              const AmbientOcclusionSettings &settings);
+
+#endif // __AMBIENTOCCLUSION_H__
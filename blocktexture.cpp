@@ -0,0 +1,260 @@
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+#include "blocktexture.h"
+
+static uint16_t to565(const float c[3])
+{
+    // c is blue, green, red, like TGAColor.
+    int b = std::min(std::max(int(std::lround(c[0] * 31 / 255)), 0), 31);
+    int g = std::min(std::max(int(std::lround(c[1] * 63 / 255)), 0), 63);
+    int r = std::min(std::max(int(std::lround(c[2] * 31 / 255)), 0), 31);
+    return uint16_t((r << 11) | (g << 5) | b);
+}
+
+static void from565(uint16_t c, int bgr[3])
+{
+    int r = (c >> 11) & 31;
+    int g = (c >> 5) & 63;
+    int b = c & 31;
+    bgr[0] = (b << 3) | (b >> 2);
+    bgr[1] = (g << 2) | (g >> 4);
+    bgr[2] = (r << 3) | (r >> 2);
+}
+
+// The four colours a BC1 block with endpoints c0 > c1 blends between.
+static void paletteBC1(uint16_t c0, uint16_t c1, int palette[4][3])
+{
+    from565(c0, palette[0]);
+    from565(c1, palette[1]);
+    for (int k = 0; k < 3; k++) {
+        palette[2][k] = (2*palette[0][k] + palette[1][k]) / 3;
+        palette[3][k] = (palette[0][k] + 2*palette[1][k]) / 3;
+    }
+}
+
+// The eight values a BC4 block with endpoints e0 and e1 blends between.
+// e0 > e1 interpolates six values between them; otherwise four, plus 0
+// and 255.
+static void paletteBC4(int e0, int e1, int palette[8])
+{
+    palette[0] = e0;
+    palette[1] = e1;
+    if (e0 > e1) {
+        for (int i = 2; i < 8; i++) {
+            palette[i] = ((8 - i)*e0 + (i - 1)*e1 + 3) / 7;
+        }
+    } else {
+        for (int i = 2; i < 6; i++) {
+            palette[i] = ((6 - i)*e0 + (i - 1)*e1 + 2) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+uint64_t BlockTexture::encodeBC1(const unsigned char texels[16][3])
+{
+    // Fit a line through the colours along their principal axis and take
+    // the extreme texels on it as endpoints.
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        for (int k = 0; k < 3; k++) {
+            mean[k] += texels[i][k] / 16.0f;
+        }
+    }
+    float covariance[3][3] = {};
+    for (int i = 0; i < 16; i++) {
+        float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) {
+                covariance[a][b] += d[a] * d[b];
+            }
+        }
+    }
+    float axis[3] = { 1, 1, 1 };
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[3];
+        for (int a = 0; a < 3; a++) {
+            next[a] = covariance[a][0]*axis[0] + covariance[a][1]*axis[1] + covariance[a][2]*axis[2];
+        }
+        float length = std::max({ std::fabs(next[0]), std::fabs(next[1]), std::fabs(next[2]) });
+        if (length == 0.0f) {
+            break;
+        }
+        for (int a = 0; a < 3; a++) {
+            axis[a] = next[a] / length;
+        }
+    }
+    int lo = 0, hi = 0;
+    float loProjection = INFINITY, hiProjection = -INFINITY;
+    for (int i = 0; i < 16; i++) {
+        float projection = texels[i][0]*axis[0] + texels[i][1]*axis[1] + texels[i][2]*axis[2];
+        if (projection < loProjection) {
+            loProjection = projection;
+            lo = i;
+        }
+        if (projection > hiProjection) {
+            hiProjection = projection;
+            hi = i;
+        }
+    }
+    float loColor[3] = { float(texels[lo][0]), float(texels[lo][1]), float(texels[lo][2]) };
+    float hiColor[3] = { float(texels[hi][0]), float(texels[hi][1]), float(texels[hi][2]) };
+    uint16_t c0 = to565(hiColor);
+    uint16_t c1 = to565(loColor);
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+    uint64_t block = uint64_t(c0) | (uint64_t(c1) << 16);
+    if (c0 == c1) {
+        return block; // every index 0
+    }
+
+    int palette[4][3];
+    paletteBC1(c0, c1, palette);
+    for (int i = 0; i < 16; i++) {
+        int best = 0;
+        int bestError = INT32_MAX;
+        for (int p = 0; p < 4; p++) {
+            int error = 0;
+            for (int k = 0; k < 3; k++) {
+                int d = texels[i][k] - palette[p][k];
+                error += d*d;
+            }
+            if (error < bestError) {
+                bestError = error;
+                best = p;
+            }
+        }
+        block |= uint64_t(best) << (32 + 2*i);
+    }
+    return block;
+}
+
+uint64_t BlockTexture::encodeBC4(const unsigned char texels[16])
+{
+    int e0 = *std::max_element(texels, texels + 16);
+    int e1 = *std::min_element(texels, texels + 16);
+    uint64_t block = uint64_t(e0) | (uint64_t(e1) << 8);
+    if (e0 == e1) {
+        return block;
+    }
+    int palette[8];
+    paletteBC4(e0, e1, palette);
+    for (int i = 0; i < 16; i++) {
+        int best = 0;
+        for (int p = 1; p < 8; p++) {
+            if (std::abs(texels[i] - palette[p]) < std::abs(texels[i] - palette[best])) {
+                best = p;
+            }
+        }
+        block |= uint64_t(best) << (16 + 3*i);
+    }
+    return block;
+}
+
+// The decoders work out only the palette entry the texel uses.
+
+void BlockTexture::decodeBC1(uint64_t block, int index, unsigned char bgr[3])
+{
+    int c0[3], c1[3];
+    from565(uint16_t(block), c0);
+    from565(uint16_t(block >> 16), c1);
+    int p = (block >> (32 + 2*index)) & 3;
+    for (int k = 0; k < 3; k++) {
+        switch (p) {
+        case 0: bgr[k] = c0[k]; break;
+        case 1: bgr[k] = c1[k]; break;
+        case 2: bgr[k] = (2*c0[k] + c1[k]) / 3; break;
+        case 3: bgr[k] = (c0[k] + 2*c1[k]) / 3; break;
+        }
+    }
+}
+
+unsigned char BlockTexture::decodeBC4(uint64_t block, int index)
+{
+    int e0 = block & 0xff;
+    int e1 = (block >> 8) & 0xff;
+    int p = (block >> (16 + 3*index)) & 7;
+    if (p < 2) {
+        return p ? e1 : e0;
+    }
+    if (e0 > e1) {
+        return ((8 - p)*e0 + (p - 1)*e1 + 3) / 7;
+    }
+    if (p < 6) {
+        return ((6 - p)*e0 + (p - 1)*e1 + 2) / 5;
+    }
+    return p == 6 ? 0 : 255;
+}
+
+BlockTexture::BlockTexture(const TGAImage &image, Format format)
+    : format(format), width(image.get_width()), height(image.get_height())
+{
+    assert(format != Format::BC5 || image.get_bytespp() >= 3);
+    blocksX = (width + 3) / 4;
+    int blocksY = (height + 3) / 4;
+    int perBlock = format == Format::BC5 ? 2 : 1;
+    blocks.resize(size_t(blocksX) * blocksY * perBlock);
+
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            // Blocks hanging off the edge repeat the last row and column.
+            TGAColor texels[16];
+            for (int i = 0; i < 16; i++) {
+                int x = std::min(bx*4 + i % 4, width - 1);
+                int y = std::min(by*4 + i / 4, height - 1);
+                texels[i] = image.get(x, y);
+            }
+            uint64_t *block = &blocks[(size_t(by) * blocksX + bx) * perBlock];
+            if (format == Format::BC1) {
+                unsigned char colors[16][3];
+                for (int i = 0; i < 16; i++) {
+                    bool grey = image.get_bytespp() == TGAImage::GRAYSCALE;
+                    for (int k = 0; k < 3; k++) {
+                        colors[i][k] = texels[i].raw[grey ? 0 : k];
+                    }
+                }
+                block[0] = encodeBC1(colors);
+            } else {
+                // BC4 takes the first channel, BC5 red then green.
+                int channels[2] = { format == Format::BC4 ? 0 : 2, 1 };
+                for (int c = 0; c < perBlock; c++) {
+                    unsigned char values[16];
+                    for (int i = 0; i < 16; i++) {
+                        values[i] = texels[i].raw[channels[c]];
+                    }
+                    block[c] = encodeBC4(values);
+                }
+            }
+        }
+    }
+}
+
+TGAColor BlockTexture::get(int x, int y) const
+{
+    if (blocks.empty() || x < 0 || y < 0 || x >= width || y >= height) {
+        return TGAColor();
+    }
+    size_t b = size_t(y >> 2) * blocksX + (x >> 2);
+    int index = (y & 3)*4 + (x & 3);
+    TGAColor color;
+    switch (format) {
+    case Format::BC1:
+        decodeBC1(blocks[b], index, color.raw);
+        color.bytespp = 3;
+        break;
+    case Format::BC4:
+        color.raw[0] = decodeBC4(blocks[b], index);
+        color.bytespp = 1;
+        break;
+    case Format::BC5:
+        color.raw[2] = decodeBC4(blocks[2*b], index);
+        color.raw[1] = decodeBC4(blocks[2*b + 1], index);
+        color.bytespp = 3;
+        break;
+    }
+    return color;
+}
@@ -0,0 +1,54 @@
+#ifndef __BLOCKTEXTURE_H__
+#define __BLOCKTEXTURE_H__
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "tgaimage.h"
+
+// A texture kept block-compressed in memory, laid out like the GPU BC
+// formats: 4x4 texel blocks of 8 or 16 bytes, each holding two endpoint
+// values and a small index per texel picking a blend of them. Texels are
+// decoded one at a time as they are fetched, so nothing is ever expanded
+// back into a full image.
+class BlockTexture
+{
+public:
+    enum class Format {
+        BC1, // colour (blue, green, red), 565 endpoints, 4 bits per texel
+        BC4, // one channel, the image's first, 8-bit endpoints, 4 bits per texel
+        BC5, // two channels, red and green, a BC4 block each, 8 bits per texel
+    };
+
+    BlockTexture() { }
+
+    // Compresses image, which keeps the texel addressing of TGAImage.
+    BlockTexture(const TGAImage &image, Format format);
+
+    bool empty() const { return blocks.empty(); }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    Format getFormat() const { return format; }
+    size_t bytes() const { return blocks.size() * sizeof(uint64_t); }
+
+    // Texel (x, y), decoded into the channels it was compressed from: a
+    // 3-byte colour for BC1 and BC5 (blue left at 0 for BC5) and a 1-byte
+    // one for BC4. Like TGAImage::get(), TGAColor() outside the texture.
+    TGAColor get(int x, int y) const;
+
+private:
+    static uint64_t encodeBC1(const unsigned char texels[16][3]);
+    static uint64_t encodeBC4(const unsigned char texels[16]);
+    static void decodeBC1(uint64_t block, int index, unsigned char bgr[3]);
+    static unsigned char decodeBC4(uint64_t block, int index);
+
+    Format format = Format::BC1;
+    int width = 0;
+    int height = 0;
+    int blocksX = 0;
+    // Row after row of blocks; a BC5 block is two consecutive BC4 ones.
+    std::vector<uint64_t> blocks;
+};
+
+#endif // __BLOCKTEXTURE_H__
@@ -0,0 +1,435 @@
+#include <memory>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "bvh.h"
+#include "model.h"
+#include "parallel.h"
+
+namespace {
+
+// Leaves hold at most this many triangles, and the tree is never deeper
+// than the traversal stack.
+const int maxLeafSize = 8;
+const int maxDepth = 60;
+
+// Candidate split planes per axis for the surface area heuristic.
+const int sahBins = 16;
+
+// Cost of visiting a node relative to intersecting one triangle.
+const float traversalCost = 1.0f;
+
+// Subtrees smaller than this aren't worth another thread.
+const int parallelMinFaces = 1024;
+
+const char bvhMagic[4] = { 'B', 'V', 'H', '1' };
+
+struct Bounds
+{
+    Vec3f lo = Vec3f(INFINITY, INFINITY, INFINITY);
+    Vec3f hi = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+
+    void grow(const Vec3f &p) {
+        for (int i = 0; i < 3; i++) {
+            lo.raw[i] = std::min(lo.raw[i], p.raw[i]);
+            hi.raw[i] = std::max(hi.raw[i], p.raw[i]);
+        }
+    }
+
+    void grow(const Bounds &b) {
+        grow(b.lo);
+        grow(b.hi);
+    }
+
+    float area() const {
+        Vec3f d = hi - lo;
+        if (d.x < 0.0f) {
+            return 0.0f;
+        }
+        return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+struct Primitive
+{
+    Bounds bounds;
+    Vec3f centroid;
+};
+
+// FNV-1a over the triangles' vertex positions, to tell whether a saved
+// hierarchy still matches the model.
+uint64_t fingerprintOf(const Model &model, int lod)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int f = 0; f < model.numFaces(lod); f++) {
+        for (int c = 0; c < 3; c++) {
+            Vec3f v = model.getVertex(f, c, lod);
+            unsigned char bytes[sizeof(float) * 3];
+            memcpy(bytes, v.raw, sizeof(bytes));
+            for (unsigned char byte : bytes) {
+                hash = (hash ^ byte) * 1099511628211ull;
+            }
+        }
+    }
+    return hash;
+}
+
+} // namespace
+
+class BvhBuilder
+{
+public:
+    BvhBuilder(const Model &model, int lod) : model(model), lod(lod) {
+        int numFaces = model.numFaces(lod);
+        primitives.resize(numFaces);
+        order.resize(numFaces);
+        for (int f = 0; f < numFaces; f++) {
+            Primitive &p = primitives[f];
+            for (int c = 0; c < 3; c++) {
+                p.bounds.grow(model.getVertex(f, c, lod));
+            }
+            p.centroid = (p.bounds.lo + p.bounds.hi) * 0.5f;
+            order[f] = f;
+        }
+    }
+
+    void build(Bvh &bvh, int threads) {
+        bvh.nodes.clear();
+        bvh.triangles.clear();
+        if (order.empty()) {
+            return;
+        }
+        std::unique_ptr<Node> root = buildRange(0, order.size(), 0, std::max(threads, 1));
+        bvh.nodes.reserve(nodeCount(*root));
+        bvh.triangles.reserve(order.size());
+        flatten(*root, bvh);
+    }
+
+private:
+    struct Node
+    {
+        Bounds bounds;
+        int start, count, axis;
+        std::unique_ptr<Node> children[2];
+    };
+
+    static int nodeCount(const Node &node) {
+        if (!node.children[0]) {
+            return 1;
+        }
+        return 1 + nodeCount(*node.children[0]) + nodeCount(*node.children[1]);
+    }
+
+    int binOf(const Primitive &p, int axis, const Bounds &centroids) const {
+        float extent = centroids.hi.raw[axis] - centroids.lo.raw[axis];
+        int bin = int(sahBins * (p.centroid.raw[axis] - centroids.lo.raw[axis]) / extent);
+        return std::min(std::max(bin, 0), sahBins - 1);
+    }
+
+    // Builds the subtree over order[start, start + count). Separate
+    // subtrees only touch their own part of order, so halves can be built
+    // on different threads.
+    std::unique_ptr<Node> buildRange(int start, int count, int depth, int threads) {
+        std::unique_ptr<Node> node(new Node());
+        node->start = start;
+        node->count = count;
+        node->axis = 0;
+        Bounds centroids;
+        for (int i = start; i < start + count; i++) {
+            node->bounds.grow(primitives[order[i]].bounds);
+            centroids.grow(primitives[order[i]].centroid);
+        }
+        if (count == 1 || depth >= maxDepth) {
+            return node;
+        }
+
+        // Binned SAH: sweep the bins of each axis from both ends and keep
+        // the cheapest plane.
+        float bestCost = INFINITY;
+        int bestAxis = -1, bestSplit = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (centroids.hi.raw[axis] <= centroids.lo.raw[axis]) {
+                continue;
+            }
+            Bounds bins[sahBins];
+            int counts[sahBins] = { };
+            for (int i = start; i < start + count; i++) {
+                const Primitive &p = primitives[order[i]];
+                int bin = binOf(p, axis, centroids);
+                bins[bin].grow(p.bounds);
+                counts[bin]++;
+            }
+            float rightArea[sahBins];
+            int rightCount[sahBins];
+            Bounds right;
+            int n = 0;
+            for (int b = sahBins - 1; b > 0; b--) {
+                right.grow(bins[b]);
+                n += counts[b];
+                rightArea[b] = right.area();
+                rightCount[b] = n;
+            }
+            Bounds left;
+            n = 0;
+            for (int b = 1; b < sahBins; b++) {
+                left.grow(bins[b - 1]);
+                n += counts[b - 1];
+                if (n == 0 || rightCount[b] == 0) {
+                    continue;
+                }
+                float cost = left.area() * n + rightArea[b] * rightCount[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        float leafCost = float(count);
+        float splitCost = traversalCost + bestCost / node->bounds.area();
+        if (count <= maxLeafSize && (bestAxis < 0 || leafCost <= splitCost)) {
+            return node;
+        }
+
+        int leftCount;
+        if (bestAxis >= 0) {
+            int *first = &order[start];
+            int *middle = std::partition(first, first + count, [&](int f) {
+                return binOf(primitives[f], bestAxis, centroids) < bestSplit;
+            });
+            leftCount = middle - first;
+            node->axis = bestAxis;
+        } else {
+            // Every centroid in the same place: no plane separates them,
+            // so just halve the leaf.
+            leftCount = count / 2;
+        }
+
+        if (threads > 1 && count >= parallelMinFaces) {
+            parallelFor(0, 2, [&](int side) {
+                node->children[side] = side == 0
+                    ? buildRange(start, leftCount, depth + 1, threads / 2)
+                    : buildRange(start + leftCount, count - leftCount, depth + 1, threads - threads / 2);
+            }, 2);
+        } else {
+            node->children[0] = buildRange(start, leftCount, depth + 1, 1);
+            node->children[1] = buildRange(start + leftCount, count - leftCount, depth + 1, 1);
+        }
+        return node;
+    }
+
+    // Appends the subtree depth first, so every interior node's first
+    // child comes right after it. Returns the subtree's index.
+    int flatten(const Node &node, Bvh &bvh) const {
+        int index = bvh.nodes.size();
+        bvh.nodes.emplace_back();
+        Bvh::Node &flat = bvh.nodes.back();
+        flat.boundsMin = node.bounds.lo;
+        flat.boundsMax = node.bounds.hi;
+        flat.axis = node.axis;
+        if (!node.children[0]) {
+            flat.offset = bvh.triangles.size();
+            flat.count = node.count;
+            for (int i = node.start; i < node.start + node.count; i++) {
+                int f = order[i];
+                Vec3f v0 = model.getVertex(f, 0, lod);
+                bvh.triangles.push_back({ v0, model.getVertex(f, 1, lod) - v0,
+                                          model.getVertex(f, 2, lod) - v0, f });
+            }
+            return index;
+        }
+        flatten(*node.children[0], bvh);
+        int second = flatten(*node.children[1], bvh);
+        bvh.nodes[index].count = 0;
+        bvh.nodes[index].offset = second;
+        return index;
+    }
+
+    const Model &model;
+    int lod;
+    std::vector<Primitive> primitives;
+    std::vector<int> order;
+};
+
+void Bvh::build(const Model &model, int lod, int threads)
+{
+    BvhBuilder(model, lod).build(*this, threads);
+    fingerprint = fingerprintOf(model, lod);
+}
+
+bool Bvh::buildCached(const Model &model, const std::string &filename, int lod, int threads)
+{
+    if (load(filename) && fingerprint == fingerprintOf(model, lod)) {
+        return true;
+    }
+    build(model, lod, threads);
+    save(filename);
+    return false;
+}
+
+bool Bvh::save(const std::string &filename) const
+{
+    std::ofstream out(filename, std::ios::binary);
+    int32_t numNodes = nodes.size();
+    int32_t numTriangles = triangles.size();
+    out.write(bvhMagic, sizeof(bvhMagic));
+    out.write((const char *)&fingerprint, sizeof(fingerprint));
+    out.write((const char *)&numNodes, sizeof(numNodes));
+    out.write((const char *)&numTriangles, sizeof(numTriangles));
+    out.write((const char *)nodes.data(), nodes.size() * sizeof(Node));
+    out.write((const char *)triangles.data(), triangles.size() * sizeof(Triangle));
+    if (!out) {
+        std::cerr << "can't write BVH cache " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool Bvh::load(const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    char magic[4];
+    int32_t numNodes, numTriangles;
+    if (!in ||
+        !in.read(magic, sizeof(magic)) ||
+        !in.read((char *)&fingerprint, sizeof(fingerprint)) ||
+        !in.read((char *)&numNodes, sizeof(numNodes)) ||
+        !in.read((char *)&numTriangles, sizeof(numTriangles)) ||
+        memcmp(magic, bvhMagic, sizeof(magic)) != 0 ||
+        numNodes < 0 || numTriangles < 0) {
+        nodes.clear();
+        triangles.clear();
+        return false;
+    }
+    nodes.resize(numNodes);
+    triangles.resize(numTriangles);
+    bool ok = in.read((char *)nodes.data(), nodes.size() * sizeof(Node)) &&
+              in.read((char *)triangles.data(), triangles.size() * sizeof(Triangle));
+
+    // Check every index, so a damaged file can't send traversal astray.
+    // Children always come after their parent, so walking the nodes in
+    // order also gives each its depth: every node but the root must be
+    // the child of exactly one earlier node, and no deeper than traverse()
+    // has stack for.
+    std::vector<int> depths(numNodes, -1);
+    if (numNodes > 0) {
+        depths[0] = 0;
+    }
+    for (int i = 0; ok && i < numNodes; i++) {
+        const Node &node = nodes[i];
+        if (depths[i] < 0 || depths[i] > maxDepth) {
+            ok = false;
+        } else if (node.count > 0) {
+            ok = node.offset >= 0 && node.offset + node.count <= numTriangles;
+        } else {
+            ok = node.offset > i + 1 && node.offset < numNodes && node.axis < 3 &&
+                 depths[i + 1] < 0 && depths[node.offset] < 0;
+            if (ok) {
+                depths[i + 1] = depths[i] + 1;
+                depths[node.offset] = depths[i] + 1;
+            }
+        }
+    }
+    if (!ok) {
+        nodes.clear();
+        triangles.clear();
+    }
+    return ok;
+}
+
+bool Bvh::intersect(const Ray &ray, RayHit &hit) const
+{
+    return traverse<false>(ray, &hit);
+}
+
+bool Bvh::occluded(const Ray &ray) const
+{
+    return traverse<true>(ray, nullptr);
+}
+
+template <bool anyHit>
+bool Bvh::traverse(const Ray &ray, RayHit *hit) const
+{
+    if (nodes.empty()) {
+        return false;
+    }
+    Vec3f inverse(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tMax = ray.tMax;
+    bool found = false;
+
+    int stack[maxDepth + 4];
+    int top = 0;
+    int index = 0;
+    while (true) {
+        const Node &node = nodes[index];
+
+        // Slab test against the node's box.
+        float tNear = ray.tMin, tFar = tMax;
+        for (int i = 0; i < 3; i++) {
+            float t0 = (node.boundsMin.raw[i] - ray.origin.raw[i]) * inverse.raw[i];
+            float t1 = (node.boundsMax.raw[i] - ray.origin.raw[i]) * inverse.raw[i];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            tNear = std::max(tNear, t0);
+            tFar = std::min(tFar, t1);
+        }
+
+        if (tNear <= tFar) {
+            if (node.count == 0) {
+                // Visit the child on the ray's near side first, so the
+                // far one is more often culled by a hit in the near one.
+                int first = index + 1;
+                int second = node.offset;
+                if (inverse.raw[node.axis] < 0.0f) {
+                    std::swap(first, second);
+                }
+                stack[top++] = second;
+                index = first;
+                continue;
+            }
+
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                const Triangle &tri = triangles[i];
+                Vec3f p = ray.direction ^ tri.edge2;
+                float det = tri.edge1 * p;
+                if (det == 0.0f) {
+                    continue;
+                }
+                float invDet = 1.0f / det;
+                Vec3f s = ray.origin - tri.v0;
+                float u = (s * p) * invDet;
+                if (u < 0.0f || u > 1.0f) {
+                    continue;
+                }
+                Vec3f q = s ^ tri.edge1;
+                float v = (ray.direction * q) * invDet;
+                if (v < 0.0f || u + v > 1.0f) {
+                    continue;
+                }
+                float t = (tri.edge2 * q) * invDet;
+                if (t < ray.tMin || t > tMax) {
+                    continue;
+                }
+                if (anyHit) {
+                    return true;
+                }
+                found = true;
+                tMax = t;
+                hit->face = tri.face;
+                hit->t = t;
+                hit->u = u;
+                hit->v = v;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        index = stack[--top];
+    }
+    return found;
+}
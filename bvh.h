@@ -0,0 +1,92 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <limits>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "geometry.h"
+
+class Model;
+
+struct Ray
+{
+    Vec3f origin;
+    Vec3f direction; // needn't be normalized; t is in multiples of it
+    float tMin = 0.0f;
+    float tMax = std::numeric_limits<float>::infinity();
+};
+
+struct RayHit
+{
+    int face = -1;  // face index at the level of detail the BVH was built for
+    float t = 0.0f;
+    float u = 0.0f; // barycentric weights of the face's second and third
+    float v = 0.0f; // corners; the first gets 1 - u - v
+};
+
+// Bounding volume hierarchy over a Model's triangles, in object space, for
+// ray queries such as picking and baking. Built top down with binned
+// surface area heuristic splits and stored as one depth-first array of
+// nodes, each interior node followed directly by its first child, with
+// the leaves' triangles precomputed for intersection and packed in the
+// same order.
+class Bvh
+{
+public:
+    Bvh() { }
+
+    // Builds over the faces of the model's level of detail lod, splitting
+    // the work across up to `threads` threads.
+    void build(const Model &model, int lod = 0, int threads = 1);
+
+    // Loads the hierarchy from filename if it was saved for the same
+    // triangles, otherwise builds it and saves it there. Returns whether
+    // it came from the file.
+    bool buildCached(const Model &model, const std::string &filename,
+                     int lod = 0, int threads = 1);
+
+    bool save(const std::string &filename) const;
+    bool load(const std::string &filename);
+
+    bool empty() const { return nodes.empty(); }
+    int numNodes() const { return nodes.size(); }
+
+    // The nearest hit within [ray.tMin, ray.tMax]. False if there is none.
+    bool intersect(const Ray &ray, RayHit &hit) const;
+
+    // Whether anything lies within [ray.tMin, ray.tMax]; stops at the
+    // first hit found, so it's cheaper than intersect() for shadow and
+    // occlusion rays.
+    bool occluded(const Ray &ray) const;
+
+private:
+    // 32 bytes, two to a cache line.
+    struct Node
+    {
+        Vec3f boundsMin;
+        int offset;             // leaf: first triangle; interior: second child
+        Vec3f boundsMax;
+        unsigned short count;   // triangles in a leaf, 0 for interior nodes
+        unsigned short axis;    // split axis of an interior node
+    };
+
+    // A vertex and two edges, for Moller-Trumbore intersection.
+    struct Triangle
+    {
+        Vec3f v0, edge1, edge2;
+        int face;
+    };
+
+    friend class BvhBuilder;
+
+    template <bool anyHit>
+    bool traverse(const Ray &ray, RayHit *hit) const;
+
+    std::vector<Node> nodes;
+    std::vector<Triangle> triangles;
+    uint64_t fingerprint = 0;
+};
+
+#endif // __BVH_H__
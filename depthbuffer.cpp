@@ -0,0 +1,91 @@
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+#include "depthbuffer.h"
+
+DepthBuffer::DepthBuffer(int width, int height, Format format, Layout layout)
+    : width(width), height(height), format(format), layout(layout)
+{
+    // Tiled buffers are padded out to whole tiles.
+    size_t samples = size_t(width)*height;
+    tilesPerRow = (width + tileMask) >> tileShift;
+    if (layout == Layout::Tiled) {
+        int tileRows = (height + tileMask) >> tileShift;
+        samples = (size_t(tilesPerRow)*tileRows) << (2*tileShift);
+    }
+
+    switch (format) {
+    case Format::Float32: f32.resize(samples); break;
+    case Format::Unorm24: u32.resize(samples); break;
+    case Format::Unorm16: u16.resize(samples); break;
+    }
+    clear();
+}
+
+size_t DepthBuffer::bytes() const
+{
+    return f32.size()*sizeof(float) + u32.size()*sizeof(uint32_t) + u16.size()*sizeof(uint16_t);
+}
+
+void DepthBuffer::clear()
+{
+    std::fill(f32.begin(), f32.end(), std::numeric_limits<float>::lowest());
+    std::fill(u32.begin(), u32.end(), 0);
+    std::fill(u16.begin(), u16.end(), 0);
+}
+
+float DepthBuffer::get(int x, int y) const
+{
+    size_t i = index(x, y);
+    uint32_t stored = 0;
+    switch (format) {
+    case Format::Float32:
+        return f32[i];
+    case Format::Unorm24:
+        stored = u32[i];
+        return stored ? decode(stored, unorm24Max) : std::numeric_limits<float>::lowest();
+    case Format::Unorm16:
+        stored = u16[i];
+        return stored ? decode(stored, unorm16Max) : std::numeric_limits<float>::lowest();
+    }
+    return std::numeric_limits<float>::lowest();
+}
+
+void DepthBuffer::encodePfm(std::vector<unsigned char> &bytes) const
+{
+    // A negative scale marks the floats as little-endian.
+    const uint16_t probe = 1;
+    bool littleEndian = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+    char header[64];
+    int length = snprintf(header, sizeof(header), "Pf\n%d %d\n%s\n",
+                          width, height, littleEndian ? "-1.0" : "1.0");
+    bytes.resize(length + size_t(width)*height*sizeof(float));
+    memcpy(bytes.data(), header, length);
+    unsigned char *out = bytes.data() + length;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float z = std::max(get(x, y), 0.0f);
+            memcpy(out, &z, sizeof(z));
+            out += sizeof(z);
+        }
+    }
+}
+
+bool DepthBuffer::writePfm(const char *filename) const
+{
+    std::vector<unsigned char> bytes;
+    encodePfm(bytes);
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    out.close();
+    if (out.fail()) {
+        std::cerr << "can't write file " << filename << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,123 @@
+#ifndef __DEPTHBUFFER_H__
+#define __DEPTHBUFFER_H__
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+// Depth values produced by view(), which maps depth onto [0, depthRange].
+constexpr float depthRange = 255.0f;
+
+// A z-buffer with a selectable storage format and memory layout.
+//
+// Depths are always passed in and out in view()'s [0, depthRange] range,
+// where larger values are nearer the eye. The unorm formats store that
+// reversed-Z style (near = all ones, cleared = 0 = nothing drawn), which
+// keeps the depth test a plain integer comparison on the stored bits.
+class DepthBuffer
+{
+public:
+    enum class Format {
+        Float32, // 4 bytes per sample, unquantized
+        Unorm24, // 4 bytes per sample, 24 bits used
+        Unorm16, // 2 bytes per sample
+    };
+
+    enum class Layout {
+        Linear, // row after row
+        Tiled,  // 8x8 blocks stored contiguously, so a triangle's footprint
+                // touches far fewer cache lines and pages
+    };
+
+    DepthBuffer(int width, int height,
+                Format format=Format::Float32,
+                Layout layout=Layout::Linear);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    Format getFormat() const { return format; }
+    Layout getLayout() const { return layout; }
+    size_t bytes() const;
+
+    void clear();
+
+    // True if z is nearer than what is stored at (x, y).
+    inline bool test(int x, int y, float z) const {
+        size_t i = index(x, y);
+        switch (format) {
+        case Format::Float32: return z > f32[i];
+        case Format::Unorm24: return encode(z, unorm24Max) > u32[i];
+        case Format::Unorm16: return encode(z, unorm16Max) > u16[i];
+        }
+        return false;
+    }
+
+    // True if z quantizes to exactly what is stored at (x, y).
+    inline bool equal(int x, int y, float z) const {
+        size_t i = index(x, y);
+        switch (format) {
+        case Format::Float32: return z == f32[i];
+        case Format::Unorm24: return encode(z, unorm24Max) == u32[i];
+        case Format::Unorm16: return encode(z, unorm16Max) == u16[i];
+        }
+        return false;
+    }
+
+    inline void set(int x, int y, float z) {
+        size_t i = index(x, y);
+        switch (format) {
+        case Format::Float32: f32[i] = z; break;
+        case Format::Unorm24: u32[i] = encode(z, unorm24Max); break;
+        case Format::Unorm16: u16[i] = uint16_t(encode(z, unorm16Max)); break;
+        }
+    }
+
+    // Stored depth at (x, y), or lowest float if nothing was drawn there.
+    float get(int x, int y) const;
+
+    // The depths as a greyscale PFM file, in view()'s range with 0 where
+    // nothing was drawn. Rows go bottom (y = 0) to top, as PFM orders them.
+    void encodePfm(std::vector<unsigned char> &bytes) const;
+    bool writePfm(const char *filename) const;
+
+private:
+    static constexpr int tileShift = 3;
+    static constexpr int tileSize = 1 << tileShift;
+    static constexpr int tileMask = tileSize - 1;
+    static constexpr uint32_t unorm24Max = (1u << 24) - 1;
+    static constexpr uint32_t unorm16Max = (1u << 16) - 1;
+
+    inline size_t index(int x, int y) const {
+        assert(x >= 0 && x < width && y >= 0 && y < height);
+        if (layout == Layout::Linear) {
+            return size_t(y)*width + x;
+        }
+        size_t tile = size_t(y >> tileShift)*tilesPerRow + (x >> tileShift);
+        return (tile << (2*tileShift)) + ((y & tileMask) << tileShift) + (x & tileMask);
+    }
+
+    // Maps [0, depthRange] onto [1, max], leaving 0 for cleared samples.
+    static inline uint32_t encode(float z, uint32_t max) {
+        float t = z * (1.0f / depthRange);
+        t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+        return 1 + uint32_t(t * float(max - 1) + 0.5f);
+    }
+
+    static inline float decode(uint32_t stored, uint32_t max) {
+        return float(stored - 1) / float(max - 1) * depthRange;
+    }
+
+    int width;
+    int height;
+    Format format;
+    Layout layout;
+    int tilesPerRow;
+
+    // Only the vector matching the format is allocated.
+    std::vector<float> f32;
+    std::vector<uint32_t> u32;
+    std::vector<uint16_t> u16;
+};
+
+#endif // __DEPTHBUFFER_H__
@@ -0,0 +1,194 @@
+#include <random>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+
+#include "geometry.h"
+
+namespace {
+
+// Largest absolute entry, the norm the inverse errors are measured in.
+float maxAbs(const Matrix4x4 &m)
+{
+    float result = 0.0f;
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            result = std::max(result, std::abs(m[row][col]));
+        }
+    }
+    return result;
+}
+
+// Infinity norm, largest absolute row sum.
+float rowNorm(const Matrix4x4 &m)
+{
+    float result = 0.0f;
+    for (int row = 0; row < 4; row++) {
+        float sum = 0.0f;
+        for (int col = 0; col < 4; col++) {
+            sum += std::abs(m[row][col]);
+        }
+        result = std::max(result, sum);
+    }
+    return result;
+}
+
+Matrix4x4 randomMatrix(std::mt19937 &random)
+{
+    std::uniform_real_distribution<float> entry(-1.0f, 1.0f);
+    Matrix4x4 m;
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            m[row][col] = entry(random);
+        }
+    }
+    return m;
+}
+
+// A random rotation or reflection, by Gram-Schmidt in double precision.
+Matrix4x4 randomOrthonormal(std::mt19937 &random)
+{
+    std::normal_distribution<double> entry;
+    double q[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (;;) {
+            for (int col = 0; col < 4; col++) {
+                q[row][col] = entry(random);
+            }
+            for (int prev = 0; prev < row; prev++) {
+                double dot = 0.0;
+                for (int col = 0; col < 4; col++) {
+                    dot += q[row][col] * q[prev][col];
+                }
+                for (int col = 0; col < 4; col++) {
+                    q[row][col] -= dot * q[prev][col];
+                }
+            }
+            double length = 0.0;
+            for (int col = 0; col < 4; col++) {
+                length += q[row][col] * q[row][col];
+            }
+            if (length > 1e-6) {
+                for (int col = 0; col < 4; col++) {
+                    q[row][col] /= std::sqrt(length);
+                }
+                break;
+            }
+        }
+    }
+    Matrix4x4 m;
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            m[row][col] = q[row][col];
+        }
+    }
+    return m;
+}
+
+// U diag(1, 1, 1, 1/condition) V, nearly singular along one direction.
+Matrix4x4 illConditionedMatrix(std::mt19937 &random, float condition)
+{
+    Matrix4x4 scale = Matrix4x4::identity();
+    scale[3][3] = 1.0f / condition;
+    return randomOrthonormal(random).multiplyScalar(scale).multiplyScalar(randomOrthonormal(random));
+}
+
+struct InverseCheck
+{
+    static constexpr float maxCondition = 1e6f;
+
+    float worstRelative = 0.0f;    // max |simd - scalar| / max |scalar|
+    float worstScaled = 0.0f;      // the same over condition * FLT_EPSILON
+    int failures = 0;
+    int skipped = 0;
+
+    void check(const Matrix4x4 &m) {
+        // Nearer singular than this the inverse is mostly rounding error
+        // whichever way it is computed, and a determinant below rounding
+        // level can come out as exactly zero.
+        float size = maxAbs(m);
+        if (std::abs(m.determinant()) < FLT_EPSILON * size*size*size*size) {
+            skipped++;
+            return;
+        }
+        Matrix4x4 scalar = m.inverseScalar();
+        float condition = rowNorm(m) * rowNorm(scalar);
+        if (condition > maxCondition) {
+            skipped++;
+            return;
+        }
+        Matrix4x4 fast = m.inverse();
+        float difference = 0.0f;
+        for (int row = 0; row < 4; row++) {
+            for (int col = 0; col < 4; col++) {
+                difference = std::max(difference, std::abs(fast[row][col] - scalar[row][col]));
+            }
+        }
+        float relative = difference / maxAbs(scalar);
+        float scaled = relative / (condition * FLT_EPSILON);
+        worstRelative = std::max(worstRelative, relative);
+        worstScaled = std::max(worstScaled, scaled);
+        if (!(scaled <= simdInverseTolerance)) {
+            failures++;
+        }
+    }
+};
+
+} // namespace
+
+bool checkSimd(std::ostream &report)
+{
+#ifndef GEOMETRY_SIMD
+    report << "built without SIMD, nothing to check\n";
+    return true;
+#endif
+    std::mt19937 random(1);
+    const int trials = 100000;
+
+    int productFailures = 0;
+    for (int trial = 0; trial < trials; trial++) {
+        Matrix4x4 a = randomMatrix(random);
+        Matrix4x4 b = randomMatrix(random);
+        Vec4f v(a[0][0], b[1][1], a[2][2], b[3][3]);
+        Vec3f p(b[0][0], a[1][1], b[2][2]);
+        if (a * b != a.multiplyScalar(b)) {
+            productFailures++;
+        }
+        Vec4f transformed = a * v;
+        Vec4f transformedScalar = a.transformScalar(v);
+        if (transformed.a != transformedScalar.a || transformed.b != transformedScalar.b ||
+            transformed.c != transformedScalar.c || transformed.d != transformedScalar.d) {
+            productFailures++;
+        }
+        Vec3f projected = a * p;
+        Vec3f projectedScalar = a.transformScalar(p);
+        if (projected.x != projectedScalar.x || projected.y != projectedScalar.y ||
+            projected.z != projectedScalar.z) {
+            productFailures++;
+        }
+    }
+    report << "products and transforms: " << productFailures << " of " << trials * 3
+           << " differ\n";
+
+    InverseCheck randomInverses;
+    for (int trial = 0; trial < trials; trial++) {
+        randomInverses.check(randomMatrix(random));
+    }
+    report << "random inverses: worst relative difference " << randomInverses.worstRelative
+           << ", " << randomInverses.worstScaled << " of condition * epsilon, "
+           << randomInverses.failures << " of " << trials << " past the tolerance, "
+           << randomInverses.skipped << " too near singular to compare\n";
+
+    InverseCheck illConditionedInverses;
+    for (int trial = 0; trial < trials; trial++) {
+        float condition = std::pow(10.0f, 1.0f + 5.0f * trial / trials);
+        illConditionedInverses.check(illConditionedMatrix(random, condition));
+    }
+    report << "ill-conditioned inverses (condition 10 to 1e6): worst relative difference "
+           << illConditionedInverses.worstRelative << ", "
+           << illConditionedInverses.worstScaled << " of condition * epsilon, "
+           << illConditionedInverses.failures << " of " << trials << " past the tolerance, "
+           << illConditionedInverses.skipped << " too near singular to compare\n";
+
+    return !productFailures && !randomInverses.failures && !illConditionedInverses.failures;
+}
@@ -4,6 +4,21 @@
 #include <cmath>
 #include <cassert>
 #include <array>
+#include <algorithm>
+#include <type_traits>
+#include <iosfwd>
+
+// Matrix4x4's products, transforms and inverse, and the batch transforms,
+// use SSE where the target has it. Build with -DGEOMETRY_NO_SIMD for the
+// plain scalar code; the *Scalar() versions are always there to check the
+// SIMD ones against (see checkSimd()). Constant expressions always take the scalar code,
+// which needs the compiler to say when it is evaluating one.
+#if defined(__SSE__) && !defined(GEOMETRY_NO_SIMD) && defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define GEOMETRY_SIMD 1
+#include <xmmintrin.h>
+#endif
+#endif
 
 template <typename T> struct Vec2;
 template <typename T> struct Vec3;
@@ -17,24 +32,24 @@ struct Vec2
         T raw[2];
     };
 
-    Vec2() : x(0), y(0) { }
-    Vec2(T _x, T _y) : x(_x), y(_y) { }
+    constexpr Vec2() : x(0), y(0) { }
+    constexpr Vec2(T _x, T _y) : x(_x), y(_y) { }
 
     inline T& operator [] (int row) { return raw[row]; }
-    inline bool operator ==(const Vec2<T> &v) const { return x==v.x && y==v.y; }
-    inline bool operator !=(const Vec2<T> &v) const { return !(*this == v); }
-    inline Vec2<T> operator +(const Vec2<T> &v) const { return { x+v.x, y+v.y }; }
-    inline Vec2<T> operator -(const Vec2<T> &v) const { return { x-v.x, y-v.y }; }
-    inline Vec2<T> operator -() const { return { -x, -y }; }
-    inline Vec2<T> operator *(int scalar) const { return { scalar*x, scalar*y }; }
-    inline Vec2<float> operator *(float scalar) const { return { scalar*x, scalar*y }; }
-    inline T operator *(const Vec2<T> &v) const { return x*v.x + y*v.y; }
-    inline Vec3<T> operator ^(const Vec2<T> &v) const {
+    constexpr bool operator ==(const Vec2<T> &v) const { return x==v.x && y==v.y; }
+    constexpr bool operator !=(const Vec2<T> &v) const { return !(*this == v); }
+    constexpr Vec2<T> operator +(const Vec2<T> &v) const { return { x+v.x, y+v.y }; }
+    constexpr Vec2<T> operator -(const Vec2<T> &v) const { return { x-v.x, y-v.y }; }
+    constexpr Vec2<T> operator -() const { return { -x, -y }; }
+    constexpr Vec2<T> operator *(int scalar) const { return { scalar*x, scalar*y }; }
+    constexpr Vec2<float> operator *(float scalar) const { return { scalar*x, scalar*y }; }
+    constexpr T operator *(const Vec2<T> &v) const { return x*v.x + y*v.y; }
+    constexpr Vec3<T> operator ^(const Vec2<T> &v) const {
         return { y - v.y, v.x - x, x*v.y - y*v.x };
     }
 
     float magnitude() const { return std::sqrt(x*x + y*y); }
-    Vec2<T> perpendicular() const { return { -y, x }; }
+    constexpr Vec2<T> perpendicular() const { return { -y, x }; }
     Vec2<float> normalized() const { return (*this) * float(1.0 / magnitude()); }
 };
 
@@ -47,19 +62,19 @@ struct Vec3
         T raw[3];
     };
 
-    Vec3() : x(0), y(0), z(0) { }
-    Vec3(T _x, T _y, T _z) : x(_x), y(_y), z(_z) { }
+    constexpr Vec3() : x(0), y(0), z(0) { }
+    constexpr Vec3(T _x, T _y, T _z) : x(_x), y(_y), z(_z) { }
 
     inline T& operator [] (int row) { return raw[row]; }
-    inline bool operator ==(const Vec3<T> &v) const { return x==v.x && y==v.y && z==v.z; }
-    inline bool operator !=(const Vec3<T> &v) const { return !(*this == v); }
-    inline Vec3<T> operator +(const Vec3<T> &v) const { return { x+v.x, y+v.y, z+v.z }; }
-    inline Vec3<T> operator -(const Vec3<T> &v) const { return { x-v.x, y-v.y, z-v.z }; }
-    inline Vec3<T> operator -() const { return { -x, -y, -z }; }
-    inline Vec3<T> operator *(int scalar) const { return { scalar*x, scalar*y, scalar*z }; }
-    inline Vec3<float> operator *(float scalar) const { return { scalar*x, scalar*y, scalar*z }; }
-    inline T operator *(const Vec3<T> &v) const { return x*v.x + y*v.y + z*v.z; }
-    inline Vec3<T> operator ^(const Vec3<T> &v) const {
+    constexpr bool operator ==(const Vec3<T> &v) const { return x==v.x && y==v.y && z==v.z; }
+    constexpr bool operator !=(const Vec3<T> &v) const { return !(*this == v); }
+    constexpr Vec3<T> operator +(const Vec3<T> &v) const { return { x+v.x, y+v.y, z+v.z }; }
+    constexpr Vec3<T> operator -(const Vec3<T> &v) const { return { x-v.x, y-v.y, z-v.z }; }
+    constexpr Vec3<T> operator -() const { return { -x, -y, -z }; }
+    constexpr Vec3<T> operator *(int scalar) const { return { scalar*x, scalar*y, scalar*z }; }
+    constexpr Vec3<float> operator *(float scalar) const { return { scalar*x, scalar*y, scalar*z }; }
+    constexpr T operator *(const Vec3<T> &v) const { return x*v.x + y*v.y + z*v.z; }
+    constexpr Vec3<T> operator ^(const Vec3<T> &v) const {
         return { y*v.z - z*v.y, z*v.x - x*v.z, x*v.y - y*v.x };
     }
 
@@ -75,40 +90,40 @@ struct Vec4
         T raw[4];
     };
 
-    Vec4() : a(0), b(0), c(0), d(0) { }
-    Vec4(T _a, T _b, T _c, T _d) : a(_a), b(_b), c(_c), d(_d) { }
-    Vec4(Vec3<T> v, int _d) : a(v.x), b(v.y), c(v.z), d(_d) { }
+    constexpr Vec4() : a(0), b(0), c(0), d(0) { }
+    constexpr Vec4(T _a, T _b, T _c, T _d) : a(_a), b(_b), c(_c), d(_d) { }
+    constexpr Vec4(Vec3<T> v, int _d) : a(v.x), b(v.y), c(v.z), d(_d) { }
 
     inline T& operator [] (int row) { return raw[row]; }
 
-    inline bool operator ==(const Vec4<T> &v) const {
+    constexpr bool operator ==(const Vec4<T> &v) const {
         return a==v.a && b==v.b && c==v.c && d==v.d;
     }
-    inline bool operator !=(const Vec4<T> &v) const {
+    constexpr bool operator !=(const Vec4<T> &v) const {
         return !(*this == v);
     }
-    inline Vec4<T> operator +(const Vec4<T> &v) const {
+    constexpr Vec4<T> operator +(const Vec4<T> &v) const {
         return { a+v.a, b+v.b, c+v.c, d+v.d };
     }
-    inline Vec4<T> operator -(const Vec4<T> &v) const {
+    constexpr Vec4<T> operator -(const Vec4<T> &v) const {
         return { a-v.a, b-v.b, c-v.c, d-v.d };
     }
-    inline Vec4<T> operator -() const {
+    constexpr Vec4<T> operator -() const {
         return { -a, -b, -c, -d };
     }
-    inline Vec4<T> operator *(int scalar) const {
+    constexpr Vec4<T> operator *(int scalar) const {
         return { scalar*a, scalar*b, scalar*c, scalar*d };
     }
-    inline Vec4<float> operator *(float scalar) const {
+    constexpr Vec4<float> operator *(float scalar) const {
         return { scalar*a, scalar*b, scalar*c, scalar*d };
     }
-    inline T operator *(const Vec4<T> &v) const {
+    constexpr T operator *(const Vec4<T> &v) const {
         return a*v.a + b*v.b + c*v.c + d*v.d;
     }
 
     float magnitude() const { return std::sqrt(a*a + b*b + c*c + d*d); }
     Vec4<float> normalized() const { return (*this) * float(1.0 / magnitude()); }
-    Vec3<float> homogenized() const {
+    constexpr Vec3<float> homogenized() const {
         return Vec3<float>(a/d, b/d, c/d);
     }
 };
@@ -153,317 +168,572 @@ void clampVec3(Vec3<T> &v, const Vec3<T> &low, const Vec3<T> &high)
     clamp(v.z, low.z, high.z);
 }
 
-struct Matrix4x4;
-struct Matrix3x3;
-struct Matrix2x3;
-struct Matrix2x2;
+template <int R, int C, typename T = float> struct Matrix;
 
-struct Matrix2x2
+using Matrix2x2 = Matrix<2, 2>;
+using Matrix2x3 = Matrix<2, 3>;
+using Matrix3x3 = Matrix<3, 3>;
+using Matrix4x4 = Matrix<4, 4>;
+
+// The vector type with N components, for a matrix's rows and columns, and
+// constexpr access to its components (raw[] can't be used there).
+template <int N, typename T> struct VecN;
+
+template <typename T>
+struct VecN<2, T>
 {
-    std::array<std::array<float, 2>, 2> m;
+    using type = Vec2<T>;
+    static constexpr T get(const type &v, int i) { return i == 0 ? v.x : v.y; }
+    static constexpr type make(const T (&e)[2]) { return type(e[0], e[1]); }
+};
 
-    static Matrix2x2 identity() {
-        Matrix2x2 result;
-        for (int row = 0; row < 2; row++) {
-            for (int col = 0; col < 2; col++) {
-                result[row][col] = float(row == col);
-            }
-        }
-        return result;
-    }
+template <typename T>
+struct VecN<3, T>
+{
+    using type = Vec3<T>;
+    static constexpr T get(const type &v, int i) { return i == 0 ? v.x : i == 1 ? v.y : v.z; }
+    static constexpr type make(const T (&e)[3]) { return type(e[0], e[1], e[2]); }
+};
 
-    inline std::array<float, 2>& operator [] (int row) { return m[row]; }
+template <typename T>
+struct VecN<4, T>
+{
+    using type = Vec4<T>;
+    static constexpr T get(const type &v, int i) {
+        return i == 0 ? v.a : i == 1 ? v.b : i == 2 ? v.c : v.d;
+    }
+    static constexpr type make(const T (&e)[4]) { return type(e[0], e[1], e[2], e[3]); }
 };
 
-struct Matrix2x3
+// The SIMD versions of Matrix's operations. Each returns false for the
+// matrices it has no version for, and the caller falls back to the
+// portable code; the Matrix4x4 overloads are defined further down.
+namespace simd {
+
+// True outside constant expressions when SIMD is enabled.
+constexpr bool enabled()
 {
-    std::array<std::array<float, 3>, 2> m;
+#ifdef GEOMETRY_SIMD
+    return !__builtin_is_constant_evaluated();
+#else
+    return false;
+#endif
+}
 
-    Matrix2x3() : m{0} { }
+template <int R, int C, int K, typename T>
+inline bool multiply(const Matrix<R, C, T> &, const Matrix<C, K, T> &, Matrix<R, K, T> &) { return false; }
+template <int R, int C, typename T>
+inline bool transform(const Matrix<R, C, T> &, const typename VecN<C, T>::type &,
+                      typename VecN<R, T>::type &) { return false; }
+template <typename T>
+inline bool project(const Matrix<4, 4, T> &, const Vec3<T> &, Vec3<T> &) { return false; }
+template <int N, typename T>
+inline bool inverse(const Matrix<N, N, T> &, Matrix<N, N, T> &) { return false; }
 
-    inline void setCol(int columnIndex, const Vec2f& v) {
-        assert(columnIndex >= 0 && columnIndex <= 3);
-        m[0][columnIndex] = v.x;
-        m[1][columnIndex] = v.y;
-    }
+#ifdef GEOMETRY_SIMD
+inline bool multiply(const Matrix4x4 &lhs, const Matrix4x4 &rhs, Matrix4x4 &result);
+inline bool transform(const Matrix4x4 &m, const Vec4f &v, Vec4f &result);
+inline bool project(const Matrix4x4 &m, const Vec3f &v, Vec3f &result);
+inline bool inverse(const Matrix4x4 &m, Matrix4x4 &result);
+#endif
 
-    inline void setRow(int rowIndex, const Vec3f& v) {
-        assert(rowIndex >= 0 && rowIndex <= 2);
-        m[rowIndex][0] = v.x;
-        m[rowIndex][1] = v.y;
-        m[rowIndex][1] = v.z;
-    }
+} // namespace simd
 
-    inline Vec2f getCol(int columnIndex) {
-        assert(columnIndex >= 0 && columnIndex <= 3);
-        return Vec2f(m[0][columnIndex], m[1][columnIndex]);
-    }
+template <int N, typename T> struct Determinant;
 
-    inline std::array<float, 3>& operator [] (int row) { return m[row]; }
+// An R by C matrix, stored by rows. Everything but the SIMD paths can be
+// evaluated at compile time.
+template <int R, int C, typename T>
+struct Matrix
+{
+    using RowVec = typename VecN<C, T>::type;
+    using ColVec = typename VecN<R, T>::type;
+
+    T m[R][C];
 
-    inline Vec2f operator *(const Vec3f &v) const {
-        Vec2f result = { v.x*m[0][0] + v.y*m[0][1] + v.z*m[0][2],
-                         v.x*m[1][0] + v.y*m[1][1] + v.z*m[1][2] };
+    constexpr Matrix() : m{} { }
+
+    static constexpr Matrix identity() {
+        static_assert(R == C, "only square matrices have an identity");
+        Matrix result;
+        for (int i = 0; i < R; i++) {
+            result.m[i][i] = T(1);
+        }
         return result;
     }
 
-    inline Matrix2x3 operator *(const float &scalar) const {
-        Matrix2x3 result;
-        for (int row = 0; row < 2; row++) {
-            for (int col = 0; col < 3; col++) {
-                result.m[row][col] = m[row][col] * scalar;
+    constexpr T* operator [] (int row) { return m[row]; }
+    constexpr const T* operator [] (int row) const { return m[row]; }
+
+    constexpr bool operator ==(const Matrix &rhs) const {
+        for (int row = 0; row < R; row++) {
+            for (int col = 0; col < C; col++) {
+                if (m[row][col] != rhs.m[row][col]) {
+                    return false;
+                }
             }
         }
-        return result;
+        return true;
     }
-};
+    constexpr bool operator !=(const Matrix &rhs) const { return !(*this == rhs); }
 
-struct Matrix3x3
-{
-    std::array<std::array<float, 3>, 3> m;
+    constexpr void setCol(int columnIndex, const ColVec &v) {
+        assert(columnIndex >= 0 && columnIndex < C);
+        for (int row = 0; row < R; row++) {
+            m[row][columnIndex] = VecN<R, T>::get(v, row);
+        }
+    }
 
-    static Matrix3x3 identity() {
-        Matrix3x3 result;
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                result[row][col] = float(row == col);
-            }
+    constexpr void setRow(int rowIndex, const RowVec &v) {
+        assert(rowIndex >= 0 && rowIndex < R);
+        for (int col = 0; col < C; col++) {
+            m[rowIndex][col] = VecN<C, T>::get(v, col);
         }
-        return result;
     }
 
-    inline void setCol(int columnIndex, const Vec3f& v) {
-        assert(columnIndex >= 0 && columnIndex <= 3);
-        m[0][columnIndex] = v.x;
-        m[1][columnIndex] = v.y;
-        m[2][columnIndex] = v.z;
+    constexpr ColVec getCol(int columnIndex) const {
+        assert(columnIndex >= 0 && columnIndex < C);
+        T e[R] = {};
+        for (int row = 0; row < R; row++) {
+            e[row] = m[row][columnIndex];
+        }
+        return VecN<R, T>::make(e);
     }
 
-    inline void setRow(int rowIndex, const Vec3f& v) {
-        assert(rowIndex >= 0 && rowIndex <= 3);
-        m[rowIndex][0] = v.x;
-        m[rowIndex][1] = v.y;
-        m[rowIndex][2] = v.z;
+    constexpr RowVec getRow(int rowIndex) const {
+        assert(rowIndex >= 0 && rowIndex < R);
+        T e[C] = {};
+        for (int col = 0; col < C; col++) {
+            e[col] = m[rowIndex][col];
+        }
+        return VecN<C, T>::make(e);
     }
 
-    inline Vec3f getCol(int columnIndex) {
-        assert(columnIndex >= 0 && columnIndex <= 3);
-        return Vec3f(m[0][columnIndex], m[1][columnIndex], m[2][columnIndex]);
+    constexpr ColVec operator *(const RowVec &v) const {
+        ColVec result;
+        if (simd::enabled() && simd::transform(*this, v, result)) {
+            return result;
+        }
+        return transformScalar(v);
     }
 
-    inline std::array<float, 3>& operator [] (int row) { return m[row]; }
+    // The point v, projected back from homogeneous coordinates.
+    template <int N = R, typename = typename std::enable_if<N == 4 && C == 4>::type>
+    constexpr Vec3<T> operator *(const Vec3<T> &v) const {
+        Vec3<T> result;
+        if (simd::enabled() && simd::project(*this, v, result)) {
+            return result;
+        }
+        return transformScalar(v);
+    }
 
-    inline Vec3f operator *(const Vec3f &v) const {
-        Vec3f result = { v.x*m[0][0] + v.y*m[0][1] + v.z*m[0][2],
-                         v.x*m[1][0] + v.y*m[1][1] + v.z*m[1][2],
-                         v.x*m[2][0] + v.y*m[2][1] + v.z*m[2][2] };
-        return result;
+    template <int K>
+    constexpr Matrix<R, K, T> operator *(const Matrix<C, K, T> &rhs) const {
+        Matrix<R, K, T> result;
+        if (simd::enabled() && simd::multiply(*this, rhs, result)) {
+            return result;
+        }
+        return multiplyScalar(rhs);
     }
 
-    inline Matrix3x3 operator *(const Matrix3x3 &rhs) const {
-        Matrix3x3 result;
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                result.m[row][col] = 0.0f;
-                for (int i = 0; i < 3; i++) {
-                    result.m[row][col] += m[row][i] * rhs.m[i][col];
-                }
+    constexpr Matrix operator *(const T &scalar) const {
+        Matrix result;
+        for (int row = 0; row < R; row++) {
+            for (int col = 0; col < C; col++) {
+                result.m[row][col] = m[row][col] * scalar;
             }
         }
         return result;
     }
 
-    inline Matrix3x3 operator *(const float &scalar) const {
-        Matrix3x3 result;
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                result[row][col] = m[row][col] * scalar;
+    // The portable versions of the products above, which the SIMD ones
+    // are checked against.
+    constexpr ColVec transformScalar(const RowVec &v) const {
+        T e[R] = {};
+        for (int row = 0; row < R; row++) {
+            e[row] = VecN<C, T>::get(v, 0) * m[row][0];
+            for (int col = 1; col < C; col++) {
+                e[row] += VecN<C, T>::get(v, col) * m[row][col];
             }
         }
-        return result;
+        return VecN<R, T>::make(e);
     }
 
-    inline float determinant() {
-        return
-            m[0][0] * (m[1][1] * m[2][2] - m[2][1] * m[1][2]) -
-            m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
-            m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    template <int N = R, typename = typename std::enable_if<N == 4 && C == 4>::type>
+    constexpr Vec3<T> transformScalar(const Vec3<T> &v) const {
+        Vec3<T> result = { v.x*m[0][0] + v.y*m[0][1] + v.z*m[0][2] + m[0][3],
+                           v.x*m[1][0] + v.y*m[1][1] + v.z*m[1][2] + m[1][3],
+                           v.x*m[2][0] + v.y*m[2][1] + v.z*m[2][2] + m[2][3] };
+        return result * (T(1) / (v.x*m[3][0] + v.y*m[3][1] + v.z*m[3][2] + m[3][3]));
     }
 
-    inline Matrix2x2 minor(int row, int col) {
-        Matrix2x2 result;
-        for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                result[i][j] = m[i<row ? i : i+1][j<col ? j : j+1];
+    template <int K>
+    constexpr Matrix<R, K, T> multiplyScalar(const Matrix<C, K, T> &rhs) const {
+        Matrix<R, K, T> result;
+        for (int row = 0; row < R; row++) {
+            for (int col = 0; col < K; col++) {
+                result.m[row][col] = T(0);
+                for (int i = 0; i < C; i++) {
+                    result.m[row][col] += m[row][i] * rhs.m[i][col];
+                }
             }
         }
         return result;
     }
 
-    inline float cofactor(int row, int col) {
-        Matrix2x2 min = minor(row, col);
-
-        float ad = min[0][0]*min[1][1];
-        float bc = min[0][1]*min[1][0];
-        float det = ad-bc;
-
-        return det * ((row + col) % 2 ? -1 : 1);
+    constexpr Matrix<C, R, T> transpose() const {
+        Matrix<C, R, T> result;
+        for (int row = 0; row < C; row++) {
+            for (int col = 0; col < R; col++) {
+                result.m[row][col] = m[col][row];
+            }
+        }
+        return result;
     }
 
-    inline Matrix3x3 adjugate() {
-        Matrix3x3 result;
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                result[row][col] = cofactor(row, col);
+    constexpr Matrix<R-1, C-1, T> minor(int row, int col) const {
+        Matrix<R-1, C-1, T> result;
+        for (int i = 0; i < R-1; i++) {
+            for (int j = 0; j < C-1; j++) {
+                result.m[i][j] = m[i<row ? i : i+1][j<col ? j : j+1];
             }
         }
         return result;
     }
 
-    inline Matrix3x3 inverseTranspose() {
-        float det = determinant();
-        assert(det != 0.0f);
-        return adjugate() * (1 / det);
+    constexpr T determinant() const {
+        return Determinant<R, T>::of(*this);
+    }
+
+    constexpr T cofactor(int row, int col) const {
+        return minor(row, col).determinant() * ((row + col) % 2 ? -1 : 1);
     }
 
-    inline Matrix3x3 transpose() {
-        Matrix3x3 result;
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                result[row][col] = m[col][row];
+    constexpr Matrix adjugate() const {
+        Matrix result;
+        for (int row = 0; row < R; row++) {
+            for (int col = 0; col < C; col++) {
+                result.m[row][col] = cofactor(row, col);
             }
         }
         return result;
     }
 
-    inline Matrix3x3 inverse() {
-        return inverseTranspose().transpose();
+    constexpr Matrix inverseTranspose() const {
+        return inverse().transpose();
     }
-};
-
-struct Matrix4x4
-{
-    std::array<std::array<float, 4>, 4> m;
 
-    static Matrix4x4 identity() {
-        Matrix4x4 result;
-        for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 4; col++) {
-                result[row][col] = float(row == col);
-            }
+    constexpr Matrix inverse() const {
+        Matrix result;
+        if (simd::enabled() && simd::inverse(*this, result)) {
+            return result;
         }
-        return result;
+        return inverseScalar();
     }
 
-    inline std::array<float, 4>& operator [] (int row) { return m[row]; }
+    constexpr Matrix inverseScalar() const {
+        T det = determinant();
+        assert(det != T(0));
+        return (adjugate() * (T(1) / det)).transpose();
+    }
 
-    inline Vec3f operator *(const Vec3f &v) const {
-        Vec3f result = { v.x*m[0][0] + v.y*m[0][1] + v.z*m[0][2] + m[0][3],
-                         v.x*m[1][0] + v.y*m[1][1] + v.z*m[1][2] + m[1][3],
-                         v.x*m[2][0] + v.y*m[2][1] + v.z*m[2][2] + m[2][3] };
-        return result * (1.0f / (v.x*m[3][0] + v.y*m[3][1] + v.z*m[3][2] + m[3][3]));
+    // Inverses of transforms whose last row is (0, ..., 0, 1), which only
+    // need the inverse of the linear part in the upper left. The
+    // orthonormal one is for rotations and reflections with translation,
+    // whose linear part inverts by transposing.
+    constexpr Matrix affineInverse() const {
+        return withLinearInverse(linearPart().inverse());
     }
 
-    inline Vec4f operator *(const Vec4f &v) const {
-        Vec4f result = { v.a*m[0][0] + v.b*m[0][1] + v.c*m[0][2] + v.d*m[0][3],
-                         v.a*m[1][0] + v.b*m[1][1] + v.c*m[1][2] + v.d*m[1][3],
-                         v.a*m[2][0] + v.b*m[2][1] + v.c*m[2][2] + v.d*m[2][3],
-                         v.a*m[3][0] + v.b*m[3][1] + v.c*m[3][2] + v.d*m[3][3]};
-        return result;
+    constexpr Matrix orthonormalInverse() const {
+        return withLinearInverse(linearPart().transpose());
     }
 
-    inline Matrix4x4 operator *(const Matrix4x4 &rhs) const {
-        Matrix4x4 result;
-        for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 4; col++) {
-                result.m[row][col] = 0.0f;
-                for (int i = 0; i < 4; i++) {
-                    result.m[row][col] += m[row][i] * rhs.m[i][col];
-                }
+private:
+    constexpr Matrix<R-1, C-1, T> linearPart() const {
+        static_assert(R == C, "only square matrices are affine transforms");
+        for (int col = 0; col < C-1; col++) {
+            assert(m[R-1][col] == T(0));
+        }
+        assert(m[R-1][C-1] == T(1));
+        return minor(R-1, C-1);
+    }
+
+    // [L t; 0 1]^-1 = [L^-1 -L^-1 t; 0 1].
+    constexpr Matrix withLinearInverse(const Matrix<R-1, C-1, T> &linearInverse) const {
+        Matrix result = identity();
+        for (int row = 0; row < R-1; row++) {
+            T translation = T(0);
+            for (int col = 0; col < C-1; col++) {
+                result.m[row][col] = linearInverse.m[row][col];
+                translation -= linearInverse.m[row][col] * m[col][C-1];
             }
+            result.m[row][C-1] = translation;
         }
         return result;
     }
+};
 
-    inline Matrix4x4 operator *(const float &scalar) const {
-        Matrix4x4 result;
-        for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 4; col++) {
-                result[row][col] = m[row][col] * scalar;
-            }
+// Cofactor expansion along the first row, with the small cases written
+// out.
+template <int N, typename T>
+struct Determinant
+{
+    static constexpr T of(const Matrix<N, N, T> &a) {
+        T det = T(0);
+        for (int col = 0; col < N; col++) {
+            det += T(col % 2 ? -1 : 1) * a.m[0][col] * a.minor(0, col).determinant();
         }
-        return result;
+        return det;
     }
+};
 
-    inline float determinant() {
-        return
-            m[0][3]*m[1][2]*m[2][1]*m[3][0] - m[0][2]*m[1][3]*m[2][1]*m[3][0] -
-            m[0][3]*m[1][1]*m[2][2]*m[3][0] + m[0][1]*m[1][3]*m[2][2]*m[3][0] +
-            m[0][2]*m[1][1]*m[2][3]*m[3][0] - m[0][1]*m[1][2]*m[2][3]*m[3][0] -
-            m[0][3]*m[1][2]*m[2][0]*m[3][1] + m[0][2]*m[1][3]*m[2][0]*m[3][1] +
-            m[0][3]*m[1][0]*m[2][2]*m[3][1] - m[0][0]*m[1][3]*m[2][2]*m[3][1] -
-            m[0][2]*m[1][0]*m[2][3]*m[3][1] + m[0][0]*m[1][2]*m[2][3]*m[3][1] +
-            m[0][3]*m[1][1]*m[2][0]*m[3][2] - m[0][1]*m[1][3]*m[2][0]*m[3][2] -
-            m[0][3]*m[1][0]*m[2][1]*m[3][2] + m[0][0]*m[1][3]*m[2][1]*m[3][2] +
-            m[0][1]*m[1][0]*m[2][3]*m[3][2] - m[0][0]*m[1][1]*m[2][3]*m[3][2] -
-            m[0][2]*m[1][1]*m[2][0]*m[3][3] + m[0][1]*m[1][2]*m[2][0]*m[3][3] +
-            m[0][2]*m[1][0]*m[2][1]*m[3][3] - m[0][0]*m[1][2]*m[2][1]*m[3][3] -
-            m[0][1]*m[1][0]*m[2][2]*m[3][3] + m[0][0]*m[1][1]*m[2][2]*m[3][3];
-    }
-
-    inline Matrix3x3 minor(int row, int col) {
-        Matrix3x3 result;
-        for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < 3; j++) {
-                result[i][j] = m[i<row ? i : i+1][j<col ? j : j+1];
-            }
-        }
-        return result;
+template <typename T>
+struct Determinant<2, T>
+{
+    static constexpr T of(const Matrix<2, 2, T> &a) {
+        return a.m[0][0]*a.m[1][1] - a.m[0][1]*a.m[1][0];
     }
+};
 
-    inline float cofactor(int row, int col) {
-        Matrix3x3 min = minor(row, col);
+template <typename T>
+struct Determinant<1, T>
+{
+    static constexpr T of(const Matrix<1, 1, T> &a) { return a.m[0][0]; }
+};
 
-        float aei = min[0][0]*min[1][1]*min[2][2];
-	float afh = min[0][0]*min[1][2]*min[2][1];
-	float bfg = min[0][1]*min[1][2]*min[2][0];
-	float bdi = min[0][1]*min[1][0]*min[2][2];
-	float cdh = min[0][2]*min[1][0]*min[2][1];
-	float ceg = min[0][2]*min[1][1]*min[2][0];
-	float det = (aei - afh) + (bfg - bdi) + (cdh - ceg);
+#ifdef GEOMETRY_SIMD
+namespace simd {
 
-        return det * ((row + col) % 2 ? -1 : 1);
-    }
+// The columns of m, for combining with a vector's components.
+inline void columns(const Matrix4x4 &m, __m128 &c0, __m128 &c1, __m128 &c2, __m128 &c3)
+{
+    c0 = _mm_loadu_ps(m.m[0]);
+    c1 = _mm_loadu_ps(m.m[1]);
+    c2 = _mm_loadu_ps(m.m[2]);
+    c3 = _mm_loadu_ps(m.m[3]);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+}
 
-    inline Matrix4x4 adjugate() {
-        Matrix4x4 result;
+inline bool transform(const Matrix4x4 &m, const Vec4f &v, Vec4f &result)
+{
+    __m128 c0, c1, c2, c3;
+    columns(m, c0, c1, c2, c3);
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(v.a)),
+                                                _mm_mul_ps(c1, _mm_set1_ps(v.b))),
+                                     _mm_mul_ps(c2, _mm_set1_ps(v.c))),
+                          _mm_mul_ps(c3, _mm_set1_ps(v.d)));
+    alignas(16) float out[4];
+    _mm_store_ps(out, r);
+    result = Vec4f(out[0], out[1], out[2], out[3]);
+    return true;
+}
+
+inline bool project(const Matrix4x4 &m, const Vec3f &v, Vec3f &result)
+{
+    __m128 c0, c1, c2, c3;
+    columns(m, c0, c1, c2, c3);
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(v.x)),
+                                                _mm_mul_ps(c1, _mm_set1_ps(v.y))),
+                                     _mm_mul_ps(c2, _mm_set1_ps(v.z))),
+                          c3);
+    alignas(16) float out[4];
+    _mm_store_ps(out, r);
+    result = Vec3f(out[0], out[1], out[2]) * (1.0f / out[3]);
+    return true;
+}
+
+// Each row of the product is a combination of rhs's rows, summed in the
+// same order as the portable loop so the results match it exactly.
+inline bool multiply(const Matrix4x4 &lhs, const Matrix4x4 &rhs, Matrix4x4 &result)
+{
+    __m128 b0 = _mm_loadu_ps(rhs.m[0]);
+    __m128 b1 = _mm_loadu_ps(rhs.m[1]);
+    __m128 b2 = _mm_loadu_ps(rhs.m[2]);
+    __m128 b3 = _mm_loadu_ps(rhs.m[3]);
+    for (int row = 0; row < 4; row++) {
+        __m128 r = _mm_setzero_ps();
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs.m[row][0]), b0));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs.m[row][1]), b1));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs.m[row][2]), b2));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(lhs.m[row][3]), b3));
+        _mm_storeu_ps(result.m[row], r);
+    }
+    return true;
+}
+
+// 2x2 matrices packed row-major into one register: a*b, adj(a)*b and
+// a*adj(b).
+inline __m128 mul2x2(__m128 a, __m128 b)
+{
+    return _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 0, 0)), b),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 1, 1)),
+                                 _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+inline __m128 adjMul2x2(__m128 a, __m128 b)
+{
+    return _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 3, 3)), b),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 1, 1)),
+                                 _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+inline __m128 mulAdj2x2(__m128 a, __m128 b)
+{
+    return _mm_sub_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 3, 0, 3))),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)),
+                                 _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 2, 1, 2))));
+}
+
+// Inverse by 2x2 blocks: with M = [A B; C D],
+//   M^-1 = 1/|M| [adj(X) adj(Y); adj(Z) adj(W)], where
+//   X = |D|A - B adj(D) C,   Y = |B|C - D adj(adj(A) B),
+//   Z = |C|B - A adj(adj(D) C),   W = |A|D - C adj(A) B.
+inline bool inverse(const Matrix4x4 &m, Matrix4x4 &result)
+{
+    __m128 r0 = _mm_loadu_ps(m.m[0]);
+    __m128 r1 = _mm_loadu_ps(m.m[1]);
+    __m128 r2 = _mm_loadu_ps(m.m[2]);
+    __m128 r3 = _mm_loadu_ps(m.m[3]);
+
+    __m128 A = _mm_movelh_ps(r0, r1);
+    __m128 B = _mm_movehl_ps(r1, r0);
+    __m128 C = _mm_movelh_ps(r2, r3);
+    __m128 D = _mm_movehl_ps(r3, r2);
+
+    // |A|, |B|, |C|, |D|.
+    __m128 dets = _mm_sub_ps(
+        _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(2, 0, 2, 0)),
+                   _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(3, 1, 3, 1))),
+        _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(3, 1, 3, 1)),
+                   _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(2, 0, 2, 0))));
+    __m128 detA = _mm_shuffle_ps(dets, dets, _MM_SHUFFLE(0, 0, 0, 0));
+    __m128 detB = _mm_shuffle_ps(dets, dets, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 detC = _mm_shuffle_ps(dets, dets, _MM_SHUFFLE(2, 2, 2, 2));
+    __m128 detD = _mm_shuffle_ps(dets, dets, _MM_SHUFFLE(3, 3, 3, 3));
+
+    __m128 adjDC = adjMul2x2(D, C);
+    __m128 adjAB = adjMul2x2(A, B);
+    __m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), mul2x2(B, adjDC));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), mul2x2(C, adjAB));
+    __m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), mulAdj2x2(D, adjAB));
+    __m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), mulAdj2x2(A, adjDC));
+
+    // |M| = |A||D| + |B||C| - tr(adj(A) B adj(D) C).
+    __m128 trace = _mm_mul_ps(adjAB, _mm_shuffle_ps(adjDC, adjDC, _MM_SHUFFLE(3, 1, 2, 0)));
+    alignas(16) float t[4];
+    _mm_store_ps(t, trace);
+    alignas(16) float d[4];
+    _mm_store_ps(d, dets);
+    float det = d[0]*d[3] + d[1]*d[2] - ((t[0] + t[2]) + (t[1] + t[3]));
+    assert(det != 0.0f);
+
+    // adj([x0 x1; x2 x3]) = [x3 -x1; -x2 x0], scattered into rows.
+    __m128 even = _mm_setr_ps(1.0f / det, -1.0f / det, 1.0f / det, -1.0f / det);
+    __m128 odd = _mm_setr_ps(-1.0f / det, 1.0f / det, -1.0f / det, 1.0f / det);
+    _mm_storeu_ps(result.m[0], _mm_mul_ps(_mm_shuffle_ps(X, Y, _MM_SHUFFLE(1, 3, 1, 3)), even));
+    _mm_storeu_ps(result.m[1], _mm_mul_ps(_mm_shuffle_ps(X, Y, _MM_SHUFFLE(0, 2, 0, 2)), odd));
+    _mm_storeu_ps(result.m[2], _mm_mul_ps(_mm_shuffle_ps(Z, W, _MM_SHUFFLE(1, 3, 1, 3)), even));
+    _mm_storeu_ps(result.m[3], _mm_mul_ps(_mm_shuffle_ps(Z, W, _MM_SHUFFLE(0, 2, 0, 2)), odd));
+    return true;
+}
+
+} // namespace simd
+#endif
+
+// Batch transforms over points stored as separate x, y and z arrays, four
+// at a time where SIMD is available. transformPoints() leaves the results
+// homogeneous, with w in outW, and projectPoints() divides through by it.
+// Results match Matrix4x4 * Vec4f(x, y, z, 1) exactly either way.
+inline void transformPoints(const Matrix4x4 &m, const float *x, const float *y, const float *z,
+                            float *outX, float *outY, float *outZ, float *outW, int count)
+{
+    int i = 0;
+#ifdef GEOMETRY_SIMD
+    __m128 e[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            e[row][col] = _mm_set1_ps(m.m[row][col]);
+        }
+    }
+    float *out[4] = { outX, outY, outZ, outW };
+    for (; i + 4 <= count; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 pz = _mm_loadu_ps(z + i);
         for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 4; col++) {
-                result[row][col] = cofactor(row, col);
-            }
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e[row][0]),
+                                                        _mm_mul_ps(py, e[row][1])),
+                                             _mm_mul_ps(pz, e[row][2])),
+                                  e[row][3]);
+            _mm_storeu_ps(out[row] + i, r);
         }
-        return result;
     }
+#endif
+    for (; i < count; i++) {
+        outX[i] = x[i]*m.m[0][0] + y[i]*m.m[0][1] + z[i]*m.m[0][2] + m.m[0][3];
+        outY[i] = x[i]*m.m[1][0] + y[i]*m.m[1][1] + z[i]*m.m[1][2] + m.m[1][3];
+        outZ[i] = x[i]*m.m[2][0] + y[i]*m.m[2][1] + z[i]*m.m[2][2] + m.m[2][3];
+        outW[i] = x[i]*m.m[3][0] + y[i]*m.m[3][1] + z[i]*m.m[3][2] + m.m[3][3];
+    }
+}
 
-    inline Matrix4x4 inverseTranspose() {
-        float det = determinant();
-        assert(det != 0.0f);
-        return adjugate() * (1 / det);
+inline void projectPoints(const Matrix4x4 &m, const float *x, const float *y, const float *z,
+                          float *outX, float *outY, float *outZ, float *outW, int count)
+{
+    transformPoints(m, x, y, z, outX, outY, outZ, outW, count);
+    int i = 0;
+#ifdef GEOMETRY_SIMD
+    for (; i + 4 <= count; i += 4) {
+        __m128 w = _mm_loadu_ps(outW + i);
+        _mm_storeu_ps(outX + i, _mm_div_ps(_mm_loadu_ps(outX + i), w));
+        _mm_storeu_ps(outY + i, _mm_div_ps(_mm_loadu_ps(outY + i), w));
+        _mm_storeu_ps(outZ + i, _mm_div_ps(_mm_loadu_ps(outZ + i), w));
+    }
+#endif
+    for (; i < count; i++) {
+        outX[i] /= outW[i];
+        outY[i] /= outW[i];
+        outZ[i] /= outW[i];
     }
+}
 
-    inline Matrix4x4 transpose() {
-        Matrix4x4 result;
-        for (int row = 0; row < 4; row++) {
-            for (int col = 0; col < 4; col++) {
-                result[row][col] = m[col][row];
-            }
+// Screen-space bounds of the box [lo, hi] under objectToScreen. False if
+// any corner is at or behind the eye, where the projection can't bound it.
+inline bool projectBox(const Matrix4x4 &objectToScreen, const Vec3f &lo, const Vec3f &hi,
+                       Vec2f &boundsMin, Vec2f &boundsMax)
+{
+    float x[8], y[8], z[8], sx[8], sy[8], sz[8], sw[8];
+    for (int corner = 0; corner < 8; corner++) {
+        x[corner] = corner & 1 ? hi.x : lo.x;
+        y[corner] = corner & 2 ? hi.y : lo.y;
+        z[corner] = corner & 4 ? hi.z : lo.z;
+    }
+    transformPoints(objectToScreen, x, y, z, sx, sy, sz, sw, 8);
+    boundsMin = Vec2f(INFINITY, INFINITY);
+    boundsMax = Vec2f(-INFINITY, -INFINITY);
+    for (int corner = 0; corner < 8; corner++) {
+        if (sw[corner] <= 0.0f) {
+            return false;
         }
-        return result;
+        float px = sx[corner] / sw[corner];
+        float py = sy[corner] / sw[corner];
+        boundsMin = Vec2f(std::min(boundsMin.x, px), std::min(boundsMin.y, py));
+        boundsMax = Vec2f(std::max(boundsMax.x, px), std::max(boundsMax.y, py));
     }
+    return true;
+}
 
-    inline Matrix4x4 inverse() {
-        return inverseTranspose().transpose();
-    }
-};
+// The SIMD and scalar inverses round differently. Relative to the largest
+// entry of the inverse, they may differ by this many times FLT_EPSILON
+// times the matrix's condition number (infinity norm): about 5e-7 for a
+// well conditioned transform, up to a few percent for one near 1e6.
+const float simdInverseTolerance = 4.0f;
+
+// Checks the SIMD paths against the scalar ones on random matrices and on
+// nearly singular ones, writing the worst differences to report (see
+// main's --check-simd). Products and transforms must match exactly,
+// inverses to within simdInverseTolerance.
+bool checkSimd(std::ostream &report);
 
 #endif // __GEOMETRY_H__
@@ -1,13 +1,17 @@
 #include <vector>
+#include <iostream>
 #include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "tgaimage.h"
 #include "geometry.h"
 #include "gl.h"
-
-Matrix4x4 viewport = Matrix4x4::identity();
-Matrix4x4 projection = Matrix4x4::identity();
-Matrix4x4 modelview = Matrix4x4::identity();
+#include "model.h"
+#include "meshstream.h"
+#include "parallel.h"
 
 const TGAColor white = TGAColor(255, 255, 255, 255);
 const TGAColor black = TGAColor(  0,   0,   0, 255);
@@ -15,23 +19,26 @@ const TGAColor red   = TGAColor(255,   0,   0, 255);
 const TGAColor green = TGAColor(  0, 255,   0, 255);
 const TGAColor blue  = TGAColor(  0,   0, 255, 255);
 
-void view(int minX, int minY, int width, int height)
+void view(RenderContext &ctx, int minX, int minY, int width, int height)
 {
-    constexpr float depth = 255.0;
+    Matrix4x4 &viewport = ctx.viewport;
     viewport[0][0] = width/2;
     viewport[1][1] = height/2;
-    viewport[2][2] = depth/2;
+    viewport[2][2] = depthRange/2;
     viewport[0][3] = minX + width/2;
     viewport[1][3] = minY + height/2;
-    viewport[2][3] = depth/2;
+    viewport[2][3] = depthRange/2;
 }
 
-void project(const float coeff)
+void project(RenderContext &ctx, const float coeff)
 {
-    projection[3][2] = coeff;
+    // The rest of the projection is the identity, so its inverse just
+    // undoes the depth term.
+    ctx.projection[3][2] = coeff;
+    ctx.projectionInverse[3][2] = -coeff;
 }
 
-static Matrix4x4 translate(const float xOffset, const float yOffset, const float zOffset)
+Matrix4x4 translate(const float xOffset, const float yOffset, const float zOffset)
 {
     Matrix4x4 result = Matrix4x4::identity();
     result[0][3] = xOffset;
@@ -40,7 +47,7 @@ static Matrix4x4 translate(const float xOffset, const float yOffset, const float
     return result;
 }
 
-static Matrix4x4 scale(const float xFactor, const float yFactor, const float zFactor)
+Matrix4x4 scale(const float xFactor, const float yFactor, const float zFactor)
 {
     Matrix4x4 result = Matrix4x4::identity();
     result[0][0] = xFactor;
@@ -49,6 +56,27 @@ static Matrix4x4 scale(const float xFactor, const float yFactor, const float zFa
     return result;
 }
 
+Matrix4x4 rotate(Vec3f axis, const float degrees)
+{
+    // Rodrigues' rotation formula.
+    Vec3f k = axis.normalized();
+    float radians = degrees * float(M_PI) / 180.0f;
+    float c = std::cos(radians);
+    float s = std::sin(radians);
+    float t = 1.0f - c;
+    Matrix4x4 result = Matrix4x4::identity();
+    result[0][0] = t*k.x*k.x + c;
+    result[0][1] = t*k.x*k.y - s*k.z;
+    result[0][2] = t*k.x*k.z + s*k.y;
+    result[1][0] = t*k.x*k.y + s*k.z;
+    result[1][1] = t*k.y*k.y + c;
+    result[1][2] = t*k.y*k.z - s*k.x;
+    result[2][0] = t*k.x*k.z - s*k.y;
+    result[2][1] = t*k.y*k.z + s*k.x;
+    result[2][2] = t*k.z*k.z + c;
+    return result;
+}
+
 static Matrix4x4 basis(const Vec3f &col0, const Vec3f &col1, const Vec3f &col2)
 {
     Matrix4x4 result = Matrix4x4::identity();
@@ -60,7 +88,7 @@ static Matrix4x4 basis(const Vec3f &col0, const Vec3f &col1, const Vec3f &col2)
     return result;
 }
 
-void lookAt(Vec3f eye, Vec3f point, Vec3f up)
+void lookAt(RenderContext &ctx, Vec3f eye, Vec3f point, Vec3f up)
 {
     Vec3f zPrime = (eye - point).normalized();
     assert((up ^ zPrime) != Vec3f(0,0,0)); // up and gaze direction can't be parallel
@@ -68,13 +96,429 @@ void lookAt(Vec3f eye, Vec3f point, Vec3f up)
     Vec3f yPrime = (zPrime ^ xPrime).normalized();
     Matrix4x4 translatePointToOrigin = translate(-point.x, -point.y, -point.z);
     Matrix4x4 inverseAxesTransform = basis(xPrime, yPrime, zPrime);
-    modelview = inverseAxesTransform * translatePointToOrigin;
+    ctx.modelview = inverseAxesTransform * translatePointToOrigin;
+    ctx.modelviewInverse = ctx.modelview.orthonormalInverse();
+}
+
+Vec3f RenderContext::getVertex(int faceIndex, int vertexIndex) const
+{
+    if (chunk) {
+        return chunk->vertices[faceIndex*3 + vertexIndex];
+    }
+    return model->getVertex(faceIndex, vertexIndex, lod);
+}
+
+Vec2f RenderContext::getTextureVertex(int faceIndex, int vertexIndex) const
+{
+    if (chunk) {
+        return chunk->textureVertices[faceIndex*3 + vertexIndex];
+    }
+    return model->getTextureVertex(faceIndex, vertexIndex, lod);
+}
+
+Vec3f RenderContext::getVertexNormal(int faceIndex, int vertexIndex) const
+{
+    if (chunk) {
+        return chunk->normals[faceIndex*3 + vertexIndex];
+    }
+    return model->getVertexNormal(faceIndex, vertexIndex, lod);
+}
+
+// Rasterizes faces [0, numFaces) of whatever ctx has bound.
+static void drawFaces(RenderContext &ctx, int numFaces, IShader &shader, DepthPass pass)
+{
+    for (int faceIndex = 0; faceIndex < numFaces; faceIndex++) {
+        std::array<Vec3f, 3> screenCoords;
+        for (int vertexIndex = 0; vertexIndex < 3; vertexIndex++) {
+            screenCoords[vertexIndex] = shader.vertex(faceIndex, vertexIndex);
+        }
+        if (ctx.msaaTarget) {
+            drawTriangle(screenCoords, shader, *ctx.msaaTarget, pass, ctx.scissor,
+                         ctx.rasterization);
+        } else {
+            drawTriangle(screenCoords, shader, *ctx.image, *ctx.zBuffer, pass, ctx.scissor,
+                         ctx.rasterization);
+        }
+    }
+}
+
+void drawModel(RenderContext &ctx, const Model &model, IShader &shader, DepthPass pass)
+{
+    assert(ctx.msaaTarget || (ctx.image && ctx.zBuffer));
+    ctx.model = &model;
+    ctx.chunk = nullptr;
+    drawFaces(ctx, model.numFaces(ctx.lod), shader, pass);
+}
+
+// Screen rectangle covered by the bounding box [boxMin, boxMax] under
+// objectToScreen, with a pixel of slack for multisampling. False if it
+// can't be bounded because part of the box is behind the eye.
+static bool screenBounds(const Vec3f &boxMin, const Vec3f &boxMax,
+                         const Matrix4x4 &objectToScreen, Rect &bounds)
+{
+    Vec2f lo, hi;
+    if (!projectBox(objectToScreen, boxMin, boxMax, lo, hi)) {
+        return false;
+    }
+    bounds = { int(std::floor(lo.x)) - 1, int(std::floor(lo.y)) - 1,
+               int(std::ceil(hi.x)) + 2, int(std::ceil(hi.y)) + 2 };
+    return true;
+}
+
+void drawModelInstanced(RenderContext &ctx, const Model &model, IShader &shader,
+                        const std::vector<Matrix4x4> &instances,
+                        DepthPass pass, int threads)
+{
+    assert(ctx.msaaTarget || (ctx.image && ctx.zBuffer));
+    int width = ctx.msaaTarget ? ctx.msaaTarget->getWidth() : ctx.image->get_width();
+    int height = ctx.msaaTarget ? ctx.msaaTarget->getHeight() : ctx.image->get_height();
+    Rect target = { std::max(ctx.scissor.minX, 0), std::max(ctx.scissor.minY, 0),
+                    std::min(ctx.scissor.maxX, width), std::min(ctx.scissor.maxY, height) };
+    if (target.minX >= target.maxX || target.minY >= target.maxY) {
+        return;
+    }
+
+    // Cull, and note the rows each surviving instance spans.
+    Matrix4x4 worldToScreen = ctx.viewport * ctx.projection * ctx.modelview;
+    std::vector<int> visible;
+    std::vector<Rect> visibleBounds;
+    std::vector<int> visibleLods;
+    for (int i = 0; i < (int)instances.size(); i++) {
+        Rect bounds = target;
+        int lod = 0;
+        if (screenBounds(model.getBoundsMin(), model.getBoundsMax(),
+                         worldToScreen * instances[i], bounds)) {
+            if (bounds.maxX <= target.minX || bounds.minX >= target.maxX ||
+                bounds.maxY <= target.minY || bounds.minY >= target.maxY) {
+                continue;
+            }
+            float area = float(bounds.maxX - bounds.minX) * (bounds.maxY - bounds.minY);
+            lod = model.selectLod(area, ctx.lodPixelsPerFace);
+        }
+        visible.push_back(i);
+        visibleBounds.push_back(bounds);
+        visibleLods.push_back(lod);
+    }
+
+    threads = std::max(1, std::min(threads, target.maxY - target.minY));
+    int lod = ctx.lod;
+    if (threads == 1) {
+        for (size_t v = 0; v < visible.size(); v++) {
+            shader.setTransform(instances[visible[v]]);
+            ctx.lod = visibleLods[v];
+            drawModel(ctx, model, shader, pass);
+        }
+        ctx.lod = lod;
+        return;
+    }
+
+    int bandHeight = (target.maxY - target.minY + threads - 1) / threads;
+    parallelFor(0, threads, [&](int band) {
+        RenderContext bandCtx = ctx;
+        bandCtx.scissor = target;
+        bandCtx.scissor.minY = target.minY + band*bandHeight;
+        bandCtx.scissor.maxY = std::min(bandCtx.scissor.minY + bandHeight, target.maxY);
+        std::unique_ptr<IShader> bandShader = shader.clone(bandCtx);
+        for (size_t v = 0; v < visible.size(); v++) {
+            if (visibleBounds[v].maxY <= bandCtx.scissor.minY ||
+                visibleBounds[v].minY >= bandCtx.scissor.maxY) {
+                continue;
+            }
+            bandShader->setTransform(instances[visible[v]]);
+            bandCtx.lod = visibleLods[v];
+            drawModel(bandCtx, model, *bandShader, pass);
+        }
+    }, threads);
+    ctx.model = &model;
+}
+
+FaceBins binFaces(const RenderContext &ctx, const Model &model,
+                  const Matrix4x4 &objectToWorld, int height, int bandHeight)
+{
+    FaceBins bins;
+    bins.bandHeight = bandHeight;
+    int numBands = (height + bandHeight - 1) / bandHeight;
+    bins.bands.resize(numBands);
+
+    Matrix4x4 objectToScreen = ctx.viewport * ctx.projection * ctx.modelview * objectToWorld;
+    Rect bounds;
+    if (screenBounds(model.getBoundsMin(), model.getBoundsMax(), objectToScreen, bounds)) {
+        if (bounds.maxY <= 0 || bounds.minY >= height) {
+            return bins;
+        }
+        float area = float(bounds.maxX - bounds.minX) * (bounds.maxY - bounds.minY);
+        bins.lod = model.selectLod(area, ctx.lodPixelsPerFace);
+    }
+
+    for (int f = 0; f < model.numFaces(bins.lod); f++) {
+        int firstBand = 0;
+        int lastBand = numBands - 1;
+        Vec4f corners[3];
+        bool bounded = true;
+        for (int v = 0; v < 3; v++) {
+            corners[v] = objectToScreen * Vec4f(model.getVertex(f, v, bins.lod), 1);
+            bounded = bounded && corners[v].d > 0;
+        }
+        if (bounded) {
+            float minY = corners[0].b / corners[0].d;
+            float maxY = minY;
+            for (int v = 1; v < 3; v++) {
+                float y = corners[v].b / corners[v].d;
+                minY = std::min(minY, y);
+                maxY = std::max(maxY, y);
+            }
+            // A pixel of slack, as for the multisample offsets.
+            int rowMin = int(std::floor(minY)) - 1;
+            int rowMax = int(std::ceil(maxY)) + 1;
+            if (rowMax < 0 || rowMin >= height) {
+                continue;
+            }
+            firstBand = std::max(rowMin, 0) / bandHeight;
+            lastBand = std::min(rowMax, height - 1) / bandHeight;
+        }
+        for (int b = firstBand; b <= lastBand; b++) {
+            bins.bands[b].push_back(f);
+        }
+    }
+    return bins;
+}
+
+void drawModelFaces(RenderContext &ctx, const Model &model, IShader &shader,
+                    const Matrix4x4 &objectToWorld, const std::vector<int> &faces,
+                    DepthPass pass, int threads)
+{
+    assert(ctx.msaaTarget || (ctx.image && ctx.zBuffer));
+    int width = ctx.msaaTarget ? ctx.msaaTarget->getWidth() : ctx.image->get_width();
+    int height = ctx.msaaTarget ? ctx.msaaTarget->getHeight() : ctx.image->get_height();
+    Rect target = { std::max(ctx.scissor.minX, 0), std::max(ctx.scissor.minY, 0),
+                    std::min(ctx.scissor.maxX, width), std::min(ctx.scissor.maxY, height) };
+    if (faces.empty() || target.minX >= target.maxX || target.minY >= target.maxY) {
+        return;
+    }
+    ctx.model = &model;
+    ctx.chunk = nullptr;
+
+    threads = std::max(1, std::min(threads, target.maxY - target.minY));
+    int bandHeight = (target.maxY - target.minY + threads - 1) / threads;
+    parallelFor(0, threads, [&](int band) {
+        RenderContext bandCtx = ctx;
+        bandCtx.scissor = target;
+        bandCtx.scissor.minY = target.minY + band*bandHeight;
+        bandCtx.scissor.maxY = std::min(bandCtx.scissor.minY + bandHeight, target.maxY);
+        std::unique_ptr<IShader> bandShader = shader.clone(bandCtx);
+        bandShader->setTransform(objectToWorld);
+        for (int faceIndex : faces) {
+            std::array<Vec3f, 3> screenCoords;
+            for (int vertexIndex = 0; vertexIndex < 3; vertexIndex++) {
+                screenCoords[vertexIndex] = bandShader->vertex(faceIndex, vertexIndex);
+            }
+            if (bandCtx.msaaTarget) {
+                drawTriangle(screenCoords, *bandShader, *bandCtx.msaaTarget, pass,
+                             bandCtx.scissor, bandCtx.rasterization);
+            } else {
+                drawTriangle(screenCoords, *bandShader, *bandCtx.image, *bandCtx.zBuffer, pass,
+                             bandCtx.scissor, bandCtx.rasterization);
+            }
+        }
+    }, threads);
 }
 
+// drawStream() reads this many faces at a time, into a ring of this many
+// chunks.
+static const int streamChunkFaces = 16384;
+static const int streamChunks = 4;
+
+void drawStream(RenderContext &ctx, const MeshStream &stream, const Model &model,
+                IShader &shader, const Matrix4x4 &objectToWorld,
+                DepthPass pass, int threads)
+{
+    assert(ctx.msaaTarget || (ctx.image && ctx.zBuffer));
+    int width = ctx.msaaTarget ? ctx.msaaTarget->getWidth() : ctx.image->get_width();
+    int height = ctx.msaaTarget ? ctx.msaaTarget->getHeight() : ctx.image->get_height();
+    Rect target = { std::max(ctx.scissor.minX, 0), std::max(ctx.scissor.minY, 0),
+                    std::min(ctx.scissor.maxX, width), std::min(ctx.scissor.maxY, height) };
+    Rect bounds;
+    Matrix4x4 objectToScreen = ctx.viewport * ctx.projection * ctx.modelview * objectToWorld;
+    if (screenBounds(stream.getBoundsMin(), stream.getBoundsMax(), objectToScreen, bounds)) {
+        target = { std::max(target.minX, bounds.minX), std::max(target.minY, bounds.minY),
+                   std::min(target.maxX, bounds.maxX), std::min(target.maxY, bounds.maxY) };
+    }
+    if (target.minX >= target.maxX || target.minY >= target.maxY) {
+        return;
+    }
+    threads = std::max(1, std::min(threads, target.maxY - target.minY));
+    int bandHeight = (target.maxY - target.minY + threads - 1) / threads;
+
+    // Chunk n goes in ring[n % streamChunks], and is only overwritten by
+    // chunk n + streamChunks once every band has drawn it.
+    std::vector<FaceChunk> ring(streamChunks);
+    std::mutex mutex;
+    std::condition_variable chunkRead;
+    std::condition_variable chunkDrawn;
+    size_t chunksRead = 0;
+    bool endOfStream = false;
+    bool damaged = false;
+    std::vector<size_t> chunksDrawn(threads, 0);
+
+    std::thread reader([&]() {
+        MeshCursor cursor;
+        for (size_t n = 0; ; n++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                chunkDrawn.wait(lock, [&]() {
+                    return *std::min_element(chunksDrawn.begin(), chunksDrawn.end()) + streamChunks > n;
+                });
+            }
+            bool more = stream.read(cursor, ring[n % streamChunks], streamChunkFaces);
+            // A damaged face ends the read early, possibly partway through
+            // a chunk, which is still drawn.
+            bool stopped = cursor.damaged;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (more) {
+                    chunksRead++;
+                }
+                if (!more || stopped) {
+                    endOfStream = true;
+                    damaged = stopped;
+                }
+            }
+            chunkRead.notify_all();
+            if (!more || stopped) {
+                return;
+            }
+        }
+    });
+
+    parallelFor(0, threads, [&](int band) {
+        RenderContext bandCtx = ctx;
+        bandCtx.model = &model;
+        bandCtx.scissor = target;
+        bandCtx.scissor.minY = target.minY + band*bandHeight;
+        bandCtx.scissor.maxY = std::min(bandCtx.scissor.minY + bandHeight, target.maxY);
+        std::unique_ptr<IShader> bandShader = shader.clone(bandCtx);
+        bandShader->setTransform(objectToWorld);
+        for (size_t n = 0; ; n++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                chunkRead.wait(lock, [&]() { return chunksRead > n || endOfStream; });
+                if (chunksRead <= n) {
+                    return;
+                }
+            }
+            const FaceChunk &chunk = ring[n % streamChunks];
+            bandCtx.chunk = &chunk;
+            drawFaces(bandCtx, chunk.numFaces, *bandShader, pass);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                chunksDrawn[band]++;
+            }
+            chunkDrawn.notify_one();
+        }
+    }, threads);
+    reader.join();
+    ctx.model = &model;
+    ctx.chunk = nullptr;
+    if (damaged) {
+        std::cerr << "streamed mesh is damaged, only drew the faces before the damage\n";
+    }
+}
+
+// A triangle snapped to 28.4 fixed point, for Rasterization::FixedPoint.
+// Positions are in subpixels, 1/16 of a pixel, and pixel (x, y) is
+// sampled at its centre, (16x + 8, 16y + 8). Edge function i is the one
+// opposite vertex i, edge[i](p) = A[i]*p.x + B[i]*p.y + C[i]; it is twice
+// the area of the triangle p makes with that edge, so dividing by twice
+// the whole triangle's area gives p's barycentric coordinates exactly.
+struct FixedTriangle
+{
+    static const int subpixelBits = 4;
+    static const int subpixels = 1 << subpixelBits;
+
+    int64_t A[3], B[3], C[3];
+    // 1 for edges a point on which isn't covered (the fill rule), else 0.
+    int64_t bias[3];
+    int64_t area; // twice the triangle's area, in subpixels squared
+    int64_t minX, minY, maxX, maxY; // bounds of the snapped vertices
+
+    // Snaps the vertices. False if they are too far out to snap without
+    // the edge functions overflowing.
+    bool setup(const std::array<Vec3f, 3> &vertices) {
+        const float limit = float(1 << 25);
+        int64_t x[3], y[3];
+        for (int i = 0; i < 3; i++) {
+            if (!(std::fabs(vertices[i].x) < limit && std::fabs(vertices[i].y) < limit)) {
+                return false;
+            }
+            x[i] = std::lround(vertices[i].x * subpixels);
+            y[i] = std::lround(vertices[i].y * subpixels);
+        }
+        for (int i = 0; i < 3; i++) {
+            int from = (i + 1) % 3;
+            int to = (i + 2) % 3;
+            int64_t dx = x[to] - x[from];
+            int64_t dy = y[to] - y[from];
+            A[i] = -dy;
+            B[i] = dx;
+            C[i] = x[from]*y[to] - x[to]*y[from];
+            // Front faces wind counter-clockwise with y up, which puts the
+            // inside on the left of each edge: left edges run down, and the
+            // top edge runs in -x.
+            bool topLeft = dy < 0 || (dy == 0 && dx < 0);
+            bias[i] = topLeft ? 0 : 1;
+        }
+        area = edge(2, x[2], y[2]);
+        minX = std::min({ x[0], x[1], x[2] });
+        minY = std::min({ y[0], y[1], y[2] });
+        maxX = std::max({ x[0], x[1], x[2] });
+        maxY = std::max({ y[0], y[1], y[2] });
+        return true;
+    }
+
+    inline int64_t edge(int i, int64_t px, int64_t py) const {
+        return A[i]*px + B[i]*py + C[i];
+    }
+
+    // The pixels whose centres lie within the snapped bounds widened by
+    // margin subpixels, clipped to clip.
+    Rect pixels(int margin, const Rect &clip) const {
+        Rect r = { int(floorDiv(minX - margin - subpixels/2 + subpixels - 1)),
+                   int(floorDiv(minY - margin - subpixels/2 + subpixels - 1)),
+                   int(floorDiv(maxX + margin - subpixels/2)) + 1,
+                   int(floorDiv(maxY + margin - subpixels/2)) + 1 };
+        r.minX = std::max(r.minX, clip.minX);
+        r.minY = std::max(r.minY, clip.minY);
+        r.maxX = std::min(r.maxX, clip.maxX);
+        r.maxY = std::min(r.maxY, clip.maxY);
+        return r;
+    }
+
+    // Whether the point (px, py), in subpixels, is covered, and if so its
+    // barycentric coordinates.
+    inline bool covers(int64_t px, int64_t py, Vec3f &bary) const {
+        int64_t e0 = edge(0, px, py);
+        int64_t e1 = edge(1, px, py);
+        int64_t e2 = edge(2, px, py);
+        if (e0 < bias[0] || e1 < bias[1] || e2 < bias[2]) {
+            return false;
+        }
+        double invArea = 1.0 / double(area);
+        bary = Vec3f(float(e0 * invArea), float(e1 * invArea), float(e2 * invArea));
+        return true;
+    }
+
+    static inline int64_t floorDiv(int64_t v) {
+        return v >= 0 ? v / subpixels : -((-v + subpixels - 1) / subpixels);
+    }
+};
+
 void drawTriangle(const std::array<Vec3f, 3> &vertices,
                   IShader &shader,
                   TGAImage &image,
-                  std::vector<float> &zBuffer)
+                  DepthBuffer &zBuffer,
+                  DepthPass pass,
+                  Rect scissor,
+                  Rasterization rasterization)
 {
     const Vec3f &a = vertices[0];
     const Vec3f &b = vertices[1];
@@ -83,45 +527,303 @@ void drawTriangle(const std::array<Vec3f, 3> &vertices,
     Vec3f ab(b - a);
     Vec3f ac(c - a);
 
+    FixedTriangle fixed;
+    bool fixedPoint = rasterization == Rasterization::FixedPoint && fixed.setup(vertices);
+
     // Backface culling.
-    if ((ab ^ ac).z <= 0.0f) {
+    if (fixedPoint ? fixed.area <= 0 : (ab ^ ac).z <= 0.0f) {
         return;
     }
 
     // Get the bounding box of the triangle.
     int width = image.get_width();
     int height = image.get_height();
-    Vec2i imageMin = { 0, 0 };
-    Vec2i imageMax = { width, height };
+    Vec2i imageMin = { std::max(scissor.minX, 0), std::max(scissor.minY, 0) };
+    Vec2i imageMax = { std::min(scissor.maxX, width), std::min(scissor.maxY, height) };
+    if (imageMin.x >= imageMax.x || imageMin.y >= imageMax.y) {
+        return;
+    }
     Vec2i lowBound(int(std::min({ a.x, b.x, c.x })),
                    int(std::min({ a.y, b.y, c.y })));
     Vec2i highBound(int(std::ceil(std::max({ a.x, b.x, c.x }))),
                     int(std::ceil(std::max({ a.y, b.y, c.y }))));
+    if (fixedPoint) {
+        Rect r = fixed.pixels(0, { imageMin.x, imageMin.y, imageMax.x, imageMax.y });
+        lowBound = Vec2i(r.minX, r.minY);
+        highBound = Vec2i(r.maxX, r.maxY);
+    }
     clampVec2(lowBound, imageMin, imageMax);
     clampVec2(highBound, imageMin, imageMax);
 
+    const bool lateZ = shader.canDiscard();
+    if (lowBound.x >= highBound.x || lowBound.y >= highBound.y) {
+        return;
+    }
+    if (lateZ || pass != DepthPass::DepthOnly) {
+        shader.setupTriangle();
+    }
+
     Vec3f p;
     for (p.y = lowBound.y; p.y < highBound.y; p.y++) {
         for (p.x = lowBound.x; p.x < highBound.x; p.x++) {
-            Vec3f ap(p - a);
-            Vec3f bary = barycentricCoords(ab, ac, ap);
-            if (bary.u < 0 ||
-                bary.v < 0 ||
-                bary.w < 0) {
-                continue;
+            Vec3f bary;
+            if (fixedPoint) {
+                int64_t px = int64_t(p.x)*FixedTriangle::subpixels + FixedTriangle::subpixels/2;
+                int64_t py = int64_t(p.y)*FixedTriangle::subpixels + FixedTriangle::subpixels/2;
+                if (!fixed.covers(px, py, bary)) {
+                    continue;
+                }
+            } else {
+                Vec3f ap(p - a);
+                bary = barycentricCoords(ab, ac, ap);
+                if (bary.u < 0 ||
+                    bary.v < 0 ||
+                    bary.w < 0) {
+                    continue;
+                }
             }
             p.z = a.z*bary.u + b.z*bary.v + c.z*bary.w;
             Vec3i pInt(p.x, p.y, p.z);
-            int zBufIdx = pInt.y*width + pInt.x;
-            if (zBuffer[zBufIdx] >= p.z) {
+            TGAColor color;
+            if (pass == DepthPass::ShadeVisible) {
+                // The prepass already resolved visibility (and discards), so
+                // only the surviving fragment at this depth gets shaded.
+                if (!zBuffer.equal(pInt.x, pInt.y, p.z)) {
+                    continue;
+                }
+                if (!shader.fragment(bary, color)) {
+                    image.set(pInt.x, pInt.y, color);
+                }
                 continue;
             }
-            zBuffer[zBufIdx] = p.z;
-            TGAColor color;
-            bool discard = shader.fragment(bary, color);
-            if (!discard) {
+            if (!zBuffer.test(pInt.x, pInt.y, p.z)) {
+                continue;
+            }
+            if (!lateZ) {
+                zBuffer.set(pInt.x, pInt.y, p.z);
+            }
+            if (lateZ || pass == DepthPass::Combined) {
+                bool discard = shader.fragment(bary, color);
+                if (discard) {
+                    continue;
+                }
+            }
+            if (lateZ) {
+                // Late-Z: only fragments that survived shading occlude.
+                zBuffer.set(pInt.x, pInt.y, p.z);
+            }
+            if (pass == DepthPass::Combined) {
                 image.set(pInt.x, pInt.y, color);
             }
         }
     }
 }
+
+// Standard 2x, 4x (rotated grid) and 8x sample patterns, in 1/16ths of a
+// pixel around the sampling point.
+static const int samplePattern2[2][2] = { { 4, 4 }, { -4, -4 } };
+static const int samplePattern4[4][2] = {
+    { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 }
+};
+static const int samplePattern8[8][2] = {
+    { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 },
+    { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 }
+};
+
+MultisampleTarget::MultisampleTarget(int width, int height, int samples,
+                                     DepthBuffer::Format format,
+                                     DepthBuffer::Layout layout)
+    : width(width), height(height), samples(samples),
+      depth(width*samples, height, format, layout),
+      color(size_t(width)*height*samples)
+{
+    assert(samples == 1 || samples == 2 || samples == 4 || samples == 8);
+}
+
+Vec2f MultisampleTarget::getSampleOffset(int sample) const
+{
+    assert(sample >= 0 && sample < samples);
+    const int *offset;
+    switch (samples) {
+    case 2: offset = samplePattern2[sample]; break;
+    case 4: offset = samplePattern4[sample]; break;
+    case 8: offset = samplePattern8[sample]; break;
+    default: return Vec2f(0, 0);
+    }
+    return Vec2f(offset[0] / 16.0f, offset[1] / 16.0f);
+}
+
+void MultisampleTarget::clear()
+{
+    depth.clear();
+    std::fill(color.begin(), color.end(), 0);
+}
+
+void MultisampleTarget::resolve(TGAImage &image) const
+{
+    assert(image.get_width() == width && image.get_height() == height);
+    const unsigned int *pixel = color.data();
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++, pixel += samples) {
+            // Interior pixels are fully covered by one triangle, so every
+            // sample holds the same colour and there is nothing to average.
+            bool uniform = true;
+            for (int s = 1; s < samples && uniform; s++) {
+                uniform = pixel[s] == pixel[0];
+            }
+            TGAColor c(pixel[0], 4);
+            if (!uniform) {
+                unsigned int sum[4] = { 0, 0, 0, 0 };
+                for (int s = 0; s < samples; s++) {
+                    TGAColor sampleColor(pixel[s], 4);
+                    for (int i = 0; i < 4; i++) {
+                        sum[i] += sampleColor.raw[i];
+                    }
+                }
+                for (int i = 0; i < 4; i++) {
+                    c.raw[i] = (sum[i] + samples/2) / samples;
+                }
+            }
+            image.set(x, y, c);
+        }
+    }
+}
+
+void drawTriangle(const std::array<Vec3f, 3> &vertices,
+                  IShader &shader,
+                  MultisampleTarget &target,
+                  DepthPass pass,
+                  Rect scissor,
+                  Rasterization rasterization)
+{
+    const Vec3f &a = vertices[0];
+    const Vec3f &b = vertices[1];
+    const Vec3f &c = vertices[2];
+
+    Vec3f ab(b - a);
+    Vec3f ac(c - a);
+
+    FixedTriangle fixed;
+    bool fixedPoint = rasterization == Rasterization::FixedPoint && fixed.setup(vertices);
+
+    // Backface culling.
+    if (fixedPoint ? fixed.area <= 0 : (ab ^ ac).z <= 0.0f) {
+        return;
+    }
+
+    // Get the bounding box of the triangle, widened by the sample spread.
+    int width = target.getWidth();
+    int height = target.getHeight();
+    int samples = target.getSamples();
+    Vec2i imageMin = { std::max(scissor.minX, 0), std::max(scissor.minY, 0) };
+    Vec2i imageMax = { std::min(scissor.maxX, width), std::min(scissor.maxY, height) };
+    if (imageMin.x >= imageMax.x || imageMin.y >= imageMax.y) {
+        return;
+    }
+    Vec2i lowBound(int(std::floor(std::min({ a.x, b.x, c.x }) - 0.5f)),
+                   int(std::floor(std::min({ a.y, b.y, c.y }) - 0.5f)));
+    Vec2i highBound(int(std::ceil(std::max({ a.x, b.x, c.x }) + 0.5f)),
+                    int(std::ceil(std::max({ a.y, b.y, c.y }) + 0.5f)));
+    if (fixedPoint) {
+        // Sample offsets stay within half a pixel of the centre.
+        Rect r = fixed.pixels(FixedTriangle::subpixels/2,
+                              { imageMin.x, imageMin.y, imageMax.x, imageMax.y });
+        lowBound = Vec2i(r.minX, r.minY);
+        highBound = Vec2i(r.maxX, r.maxY);
+    }
+    clampVec2(lowBound, imageMin, imageMax);
+    clampVec2(highBound, imageMin, imageMax);
+
+    // The sample offsets, also in subpixels from the pixel centre for the
+    // fixed point rasterizer. The standard patterns are all on that grid.
+    std::array<Vec2f, 8> offsets;
+    std::array<Vec2i, 8> fixedOffsets;
+    for (int s = 0; s < samples; s++) {
+        offsets[s] = target.getSampleOffset(s);
+        fixedOffsets[s] = Vec2i(int(std::lround(offsets[s].x * FixedTriangle::subpixels)) +
+                                    FixedTriangle::subpixels/2,
+                                int(std::lround(offsets[s].y * FixedTriangle::subpixels)) +
+                                    FixedTriangle::subpixels/2);
+    }
+
+    const bool lateZ = shader.canDiscard();
+    DepthBuffer &zBuffer = target.depthBuffer();
+    if (lowBound.x >= highBound.x || lowBound.y >= highBound.y) {
+        return;
+    }
+    if (lateZ || pass != DepthPass::DepthOnly) {
+        shader.setupTriangle();
+    }
+
+    Vec3f p;
+    for (p.y = lowBound.y; p.y < highBound.y; p.y++) {
+        for (p.x = lowBound.x; p.x < highBound.x; p.x++) {
+            // Coverage and depth per sample.
+            std::array<float, 8> sampleZ;
+            unsigned int mask = 0;
+            int covered = 0;
+            Vec3f centroid;
+            for (int s = 0; s < samples; s++) {
+                Vec3f bary;
+                if (fixedPoint) {
+                    int64_t px = int64_t(p.x)*FixedTriangle::subpixels + fixedOffsets[s].x;
+                    int64_t py = int64_t(p.y)*FixedTriangle::subpixels + fixedOffsets[s].y;
+                    if (!fixed.covers(px, py, bary)) {
+                        continue;
+                    }
+                } else {
+                    Vec3f ap(Vec3f(p.x + offsets[s].x, p.y + offsets[s].y, 0) - a);
+                    bary = barycentricCoords(ab, ac, ap);
+                    if (bary.u < 0 ||
+                        bary.v < 0 ||
+                        bary.w < 0) {
+                        continue;
+                    }
+                }
+                sampleZ[s] = a.z*bary.u + b.z*bary.v + c.z*bary.w;
+                int sx = int(p.x)*samples + s;
+                bool visible = pass == DepthPass::ShadeVisible
+                    ? zBuffer.equal(sx, int(p.y), sampleZ[s])
+                    : zBuffer.test(sx, int(p.y), sampleZ[s]);
+                if (visible) {
+                    mask |= 1u << s;
+                    covered++;
+                    centroid = centroid + bary;
+                }
+            }
+            if (!mask) {
+                continue;
+            }
+
+            // Shade once, at the centroid of the visible samples. Unlike the
+            // pixel centre it always lies inside the triangle, so attributes
+            // such as UVs never get extrapolated.
+            Vec3f bary = centroid * (1.0f / covered);
+            TGAColor color;
+            if (!lateZ && pass != DepthPass::ShadeVisible) {
+                for (int s = 0; s < samples; s++) {
+                    if (mask & (1u << s)) {
+                        zBuffer.set(int(p.x)*samples + s, int(p.y), sampleZ[s]);
+                    }
+                }
+            }
+            if (lateZ || pass != DepthPass::DepthOnly) {
+                bool discard = shader.fragment(bary, color);
+                if (discard) {
+                    continue;
+                }
+            }
+            for (int s = 0; s < samples; s++) {
+                if (!(mask & (1u << s))) {
+                    continue;
+                }
+                if (lateZ && pass != DepthPass::ShadeVisible) {
+                    zBuffer.set(int(p.x)*samples + s, int(p.y), sampleZ[s]);
+                }
+                if (pass != DepthPass::DepthOnly) {
+                    target.setColor(int(p.x), int(p.y), s, color);
+                }
+            }
+        }
+    }
+}
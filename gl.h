@@ -3,29 +3,241 @@
 
 #include "tgaimage.h"
 #include "geometry.h"
+#include "depthbuffer.h"
 
-// Globals defined in gl.cpp
-extern Matrix4x4 viewport;
-extern Matrix4x4 projection;
-extern Matrix4x4 modelview;
+#include <memory>
+#include <vector>
+#include <climits>
 
-// These modify the viewport, projection, and modelView matrices respectively,
-// and are useful for implementing the vertex shader.
-void view(int minX, int minY, int width, int height);
-void project(float coeff=0.f); // coeff = -1/c
-void lookAt(Vec3f eye, Vec3f center, Vec3f up);
+class Model;
+class MeshStream;
+struct FaceChunk;
+struct RenderContext;
+
+// A pixel rectangle, [minX, maxX) x [minY, maxY).
+struct Rect
+{
+    int minX, minY, maxX, maxY;
+
+    static Rect unbounded() { return { 0, 0, INT_MAX, INT_MAX }; }
+};
 
 // Shader operations which we provide to the triangle rasterizer.
 struct IShader {
     virtual ~IShader() { }
     virtual Vec3f vertex(int iface, int nthvert) = 0;
     virtual bool fragment(const Vec3f &baryCoords, TGAColor &color) = 0;
+
+    // Per-triangle setup. The rasterizer calls this once for each triangle
+    // that survives culling and may get shaded, after vertex() has run for
+    // all three of its corners and before any of its fragments, so work
+    // that only depends on the triangle can be hoisted out of fragment().
+    virtual void setupTriangle() { }
+
+    // A copy of the shader and its settings, reading from another context;
+    // concurrent draws each need their own.
+    virtual std::unique_ptr<IShader> clone(const RenderContext &ctx) const = 0;
+
+    // Called with the object-to-world matrix of each object before it is
+    // drawn, for shaders that place objects in the world.
+    virtual void setTransform(const Matrix4x4 &) { }
+
+    // Shaders that may return true from fragment() must say so here. Their
+    // depth is only written once the fragment survives (late-Z); everyone
+    // else gets their depth written before shading (early-Z).
+    virtual bool canDiscard() const { return false; }
 };
 
-// The triangle rasterizer
+// Which part of the depth/shading work a draw performs. A depth prepass
+// (DepthOnly) over the whole scene followed by a ShadeVisible pass runs the
+// fragment shader exactly once per visible pixel.
+enum class DepthPass {
+    Combined,     // depth test, depth write and shading in one go
+    DepthOnly,    // depth test and write, no colour output
+    ShadeVisible, // shade only fragments matching the stored depth, no write
+};
+
+// How drawTriangle() decides which pixels a triangle covers.
+enum class Rasterization {
+    // Floating point edge tests at pixel corners. Pixels exactly on an
+    // edge shared by two triangles go to both of them.
+    Float,
+    // Vertices snapped to 28.4 fixed point and exact integer edge tests
+    // at pixel centres, with a top-left fill rule: a pixel centre on an
+    // edge belongs to the triangle only if the edge is a top or left one,
+    // so pixels on shared edges are drawn exactly once. Triangles reaching
+    // beyond 2^25 pixels, which can't be snapped, fall back to Float.
+    FixedPoint,
+};
+
+// The triangle rasterizer. Only pixels inside scissor are touched.
 void drawTriangle(const std::array<Vec3f, 3> &vertices,
                   IShader &shader,
                   TGAImage &image,
-                  std::vector<float> &zBuffer);
+                  DepthBuffer &zBuffer,
+                  DepthPass pass=DepthPass::Combined,
+                  Rect scissor=Rect::unbounded(),
+                  Rasterization rasterization=Rasterization::Float);
+
+// Colour and depth storage for multisampled rendering. Every pixel keeps
+// `samples` depth and colour values; coverage and depth are tested per
+// sample, but the fragment shader runs once per pixel and its colour is
+// copied to every sample it covers. resolve() averages them into an image.
+class MultisampleTarget
+{
+public:
+    MultisampleTarget(int width, int height, int samples,
+                      DepthBuffer::Format format=DepthBuffer::Format::Float32,
+                      DepthBuffer::Layout layout=DepthBuffer::Layout::Linear);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getSamples() const { return samples; }
+
+    // Sample offsets from the pixel's sampling point, in pixels.
+    Vec2f getSampleOffset(int sample) const;
+
+    // Sample s of pixel (x, y) lives at (x*samples + s, y) in here.
+    DepthBuffer &depthBuffer() { return depth; }
+    const DepthBuffer &depthBuffer() const { return depth; }
+
+    inline void setColor(int x, int y, int sample, const TGAColor &c) {
+        color[(size_t(y)*width + x)*samples + sample] = c.val;
+    }
+
+    void clear();
+    void resolve(TGAImage &image) const;
+
+private:
+    int width;
+    int height;
+    int samples;
+    DepthBuffer depth;
+    std::vector<unsigned int> color; // TGAColor::val of each sample
+};
+
+// The triangle rasterizer
+void drawTriangle(const std::array<Vec3f, 3> &vertices,
+                  IShader &shader,
+                  MultisampleTarget &target,
+                  DepthPass pass=DepthPass::Combined,
+                  Rect scissor=Rect::unbounded(),
+                  Rasterization rasterization=Rasterization::Float);
+
+// Everything one render needs: its transforms, the model being drawn and
+// where the output goes. Nothing in here is global, so independent renders
+// can run concurrently as long as each has its own context and shaders.
+struct RenderContext
+{
+    Matrix4x4 viewport = Matrix4x4::identity();
+    Matrix4x4 projection = Matrix4x4::identity();
+    Matrix4x4 modelview = Matrix4x4::identity();
+
+    // Inverses of the last two. project() and lookAt() keep these up to
+    // date from the shape of the transforms they build, which is cheaper
+    // and more precise than a general inverse.
+    Matrix4x4 projectionInverse = Matrix4x4::identity();
+    Matrix4x4 modelviewInverse = Matrix4x4::identity();
+
+    // The model being drawn and the level of detail of it drawModel()
+    // draws, bound for the shaders to read.
+    const Model *model = nullptr;
+    int lod = 0;
+
+    // While drawStream() draws a chunk of a streamed mesh, the chunk, whose
+    // faces then take the place of the model's. The model still supplies
+    // the textures.
+    const FaceChunk *chunk = nullptr;
+
+    // Attributes of corner vertexIndex of face faceIndex of whatever is
+    // being drawn, for the vertex shaders.
+    Vec3f getVertex(int faceIndex, int vertexIndex) const;
+    Vec2f getTextureVertex(int faceIndex, int vertexIndex) const;
+    Vec3f getVertexNormal(int faceIndex, int vertexIndex) const;
+
+    // drawModelInstanced() draws each instance at the coarsest level of
+    // detail that leaves at most this many pixels of its projected bounds
+    // per face. 0 always draws the full mesh.
+    float lodPixelsPerFace = 0.0f;
+
+    // Render targets. Draws go to msaaTarget when it is set, and to
+    // image/zBuffer otherwise.
+    TGAImage *image = nullptr;
+    DepthBuffer *zBuffer = nullptr;
+    MultisampleTarget *msaaTarget = nullptr;
+
+    // Draws only touch pixels inside this rectangle.
+    Rect scissor = Rect::unbounded();
+
+    Rasterization rasterization = Rasterization::Float;
+};
+
+// These modify the viewport, projection, and modelView matrices respectively,
+// and are useful for implementing the vertex shader. view() maps depth onto
+// [0, depthRange], the range DepthBuffer expects.
+void view(RenderContext &ctx, int minX, int minY, int width, int height);
+void project(RenderContext &ctx, float coeff=0.f); // coeff = -1/c
+void lookAt(RenderContext &ctx, Vec3f eye, Vec3f center, Vec3f up);
+
+// Affine transforms for placing objects in the world.
+Matrix4x4 translate(float xOffset, float yOffset, float zOffset);
+Matrix4x4 scale(float xFactor, float yFactor, float zFactor);
+Matrix4x4 rotate(Vec3f axis, float degrees);
+
+// Binds the model to the context and rasterizes all of its faces, at level
+// of detail ctx.lod, into the context's targets.
+void drawModel(RenderContext &ctx, const Model &model, IShader &shader,
+               DepthPass pass=DepthPass::Combined);
+
+// Draws the model once per object-to-world matrix in instances, handing
+// each to shader.setTransform() first. Instances whose bounding box lands
+// outside the target are skipped, and the rest drawn at the level of detail
+// ctx.lodPixelsPerFace picks for their size on screen. They are split across threads by
+// horizontal bands of the target: each thread draws the instances that
+// overlap its band, clipped to it, with its own clone of the shader.
+void drawModelInstanced(RenderContext &ctx, const Model &model, IShader &shader,
+                        const std::vector<Matrix4x4> &instances,
+                        DepthPass pass=DepthPass::Combined,
+                        int threads=1);
+
+// The faces of one instance of a model that land in each horizontal band
+// of the target, for drawing a frame a band at a time.
+struct FaceBins
+{
+    int lod = 0;     // the level of detail the faces index
+    int bandHeight;
+    // bands[b] lists the faces overlapping rows [b, b + 1) * bandHeight.
+    std::vector<std::vector<int>> bands;
+};
+
+// Sorts the faces of the model under objectToWorld into bands of
+// bandHeight rows of a frame `height` rows high, by the rows ctx's
+// transforms project them onto. The level of detail is picked as
+// drawModelInstanced() would. Faces reaching behind the eye, whose rows
+// can't be bounded, go in every band.
+FaceBins binFaces(const RenderContext &ctx, const Model &model,
+                  const Matrix4x4 &objectToWorld, int height, int bandHeight);
+
+// Draws the given faces of the model, at level of detail ctx.lod, under
+// objectToWorld, split across threads by horizontal bands of the target
+// like drawModelInstanced().
+void drawModelFaces(RenderContext &ctx, const Model &model, IShader &shader,
+                    const Matrix4x4 &objectToWorld, const std::vector<int> &faces,
+                    DepthPass pass=DepthPass::Combined, int threads=1);
+
+// Draws a mesh too large to load, under objectToWorld, with textures from
+// model, reading it a chunk of faces at a time as it draws. One thread
+// reads chunks ahead into a small ring of buffers while `threads` others
+// rasterize them, split into horizontal bands of the target like
+// drawModelInstanced(). Only a few chunks of faces are held at once; a
+// .mesh file's attributes stay in the mapping too, so its memory use is
+// bounded however large it is, but a .obj file's vertex, texture vertex
+// and normal lists are held in memory (see MeshStream). Skipped if the
+// mesh's bounding box lands outside the target.
+// A damaged face stops the read there, leaving the faces after it
+// undrawn; MeshStream::failed() then reports it.
+void drawStream(RenderContext &ctx, const MeshStream &stream, const Model &model,
+                IShader &shader, const Matrix4x4 &objectToWorld,
+                DepthPass pass=DepthPass::Combined, int threads=1);
 
 #endif // __GL_H__
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cmath>
+
+#include "lights.h"
+
+LightTiles::LightTiles(int width, int height)
+    : tilesX(std::max(1, (width + tileSize - 1) / tileSize)),
+      tilesY(std::max(1, (height + tileSize - 1) / tileSize)),
+      offsets(tilesX*tilesY + 1, 0),
+      indices(1, 0)
+{
+}
+
+void LightTiles::build(const std::vector<Light> &lights, const Matrix4x4 &worldToScreen)
+{
+    // Tile rectangle each light reaches, inclusive.
+    struct Span { int minX, minY, maxX, maxY; };
+    std::vector<Span> spans;
+    spans.reserve(lights.size());
+    for (const Light &light : lights) {
+        Span all = { 0, 0, tilesX - 1, tilesY - 1 };
+        if (light.type == Light::Type::Directional) {
+            spans.push_back(all);
+            continue;
+        }
+
+        Vec3f extent(light.range, light.range, light.range);
+        Vec2f lo, hi;
+        if (!projectBox(worldToScreen, light.position - extent, light.position + extent, lo, hi)) {
+            spans.push_back(all);
+            continue;
+        }
+        Span span = { std::max(0, int(std::floor(lo.x)) / tileSize),
+                      std::max(0, int(std::floor(lo.y)) / tileSize),
+                      std::min(tilesX - 1, int(std::ceil(hi.x)) / tileSize),
+                      std::min(tilesY - 1, int(std::ceil(hi.y)) / tileSize) };
+        if (hi.x < 0.0f || hi.y < 0.0f) {
+            span.maxX = span.maxY = -1;
+        }
+        spans.push_back(span);
+    }
+
+    // Count, then fill, so each tile's list is contiguous.
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for (const Span &span : spans) {
+        for (int y = span.minY; y <= span.maxY; y++) {
+            for (int x = span.minX; x <= span.maxX; x++) {
+                offsets[y*tilesX + x + 1]++;
+            }
+        }
+    }
+    for (int tile = 0; tile < tilesX*tilesY; tile++) {
+        offsets[tile + 1] += offsets[tile];
+    }
+    indices.assign(offsets.back() + 1, 0);
+    std::vector<int> filled(offsets.begin(), offsets.end() - 1);
+    for (int l = 0; l < (int)spans.size(); l++) {
+        for (int y = spans[l].minY; y <= spans[l].maxY; y++) {
+            for (int x = spans[l].minX; x <= spans[l].maxX; x++) {
+                indices[filled[y*tilesX + x]++] = l;
+            }
+        }
+    }
+}
+
+SpecularTable::SpecularTable(float maxError)
+    : maxError(maxError)
+{
+    if (maxError <= 0.0f) {
+        return;
+    }
+    // Spacing and cut off that each keep their part of the error within
+    // maxError.
+    double step = std::sqrt(8.0 * maxError);
+    double end = std::log(1.0 / std::min(maxError, 1.0f));
+    samplesPerUnit = 1.0 / step;
+    samplesPerRow = int(std::ceil(end * samplesPerUnit)) + 2;
+    values.resize(size_t(maxPower - minPower + 1) * samplesPerRow);
+    for (int power = minPower; power <= maxPower; power++) {
+        float *row = &values[(power - minPower)*samplesPerRow];
+        for (int i = 0; i < samplesPerRow; i++) {
+            double x = std::max(1.0 - i * step / power, 0.0);
+            row[i] = float(std::pow(x, power));
+        }
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "geometry.h"
+#include "shadowmap.h"
+
+// A light source in world space.
+struct Light
+{
+    enum class Type {
+        Directional, // from infinitely far away along direction
+        Point,       // from position, fading out to nothing at range
+    };
+
+    Type type = Type::Directional;
+    Vec3f direction = Vec3f(1, 1, 1); // towards the light
+    Vec3f position = Vec3f(0, 0, 0);
+    float range = 10.0f;
+    Vec3f color = Vec3f(1, 1, 1);
+
+    // Shadow map, if any. It is aimed at center: orthographic along the
+    // direction for directional lights, and a perspective frustum from
+    // the position for point lights, outside of which they cast no
+    // shadows.
+    bool castsShadows = true;
+    Vec3f center = Vec3f(0, 0, 0);
+    int shadowWidth = 2048;
+    int shadowHeight = 2048;
+    ShadowMap::Filter shadowFilter = ShadowMap::Filter::PCF;
+};
+
+// Which lights can reach each screen tile, so a fragment only loops over
+// the lights of its tile. Directional lights reach every tile, point
+// lights only the tiles their range's bounding box projects onto.
+class LightTiles
+{
+public:
+    static constexpr int tileSize = 16;
+
+    LightTiles() : LightTiles(0, 0) { }
+    LightTiles(int width, int height);
+
+    // Bins lights by the screen tiles they reach through worldToScreen.
+    void build(const std::vector<Light> &lights, const Matrix4x4 &worldToScreen);
+
+    // Indices into the lights given to build() that reach pixel (x, y),
+    // as [first, last).
+    const int *first(int x, int y) const { return &indices[offsets[tileOf(x, y)]]; }
+    const int *last(int x, int y) const { return &indices[offsets[tileOf(x, y) + 1]]; }
+
+private:
+    int tileOf(int x, int y) const {
+        x = std::min(std::max(x / tileSize, 0), tilesX - 1);
+        y = std::min(std::max(y / tileSize, 0), tilesY - 1);
+        return y*tilesX + x;
+    }
+
+    int tilesX;
+    int tilesY;
+
+    // Per tile, its lights are indices[offsets[tile], offsets[tile + 1]).
+    std::vector<int> offsets;
+    std::vector<int> indices;
+};
+
+// x^power for x in [0, 1] and the whole specular powers PhongShader uses,
+// looked up instead of calling powf() and accurate to a given absolute
+// error.
+//
+// Each power has a row of samples of x^power taken at even steps of
+// t = power*(1 - x), where x^power = (1 - t/power)^power. Its second
+// derivative in t never exceeds 1, so linear interpolation between
+// samples h apart is off by at most h*h/8, and it is below e^-t, so the
+// row can stop at t = ln(1/maxError) and return 0 past it.
+class SpecularTable
+{
+public:
+    static constexpr int minPower = 5;
+    static constexpr int maxPower = 260;
+
+    // maxError 0 leaves the table empty, for exact powf().
+    explicit SpecularTable(float maxError=0.0f);
+
+    bool empty() const { return values.empty(); }
+    float getMaxError() const { return maxError; }
+
+    // x^power, within getMaxError() of powf() for x in [0, 1].
+    float pow(float x, int power) const {
+        if (power < minPower || power > maxPower) {
+            return powf(x, power);
+        }
+        // Written without helper calls, which matter in unoptimised builds.
+        float t = (1.0f - x) * power * samplesPerUnit;
+        if (t >= samplesPerRow - 1) {
+            return 0.0f;
+        }
+        t = t > 0.0f ? t : 0.0f;
+        int i = int(t);
+        const float *sample = values.data() + (power - minPower)*samplesPerRow + i;
+        return sample[0] + (sample[1] - sample[0]) * (t - i);
+    }
+
+private:
+    float maxError;
+    float samplesPerUnit = 0; // per unit of t
+    int samplesPerRow = 0;
+    std::vector<float> values;
+};
+
+#endif // __LIGHTS_H__
@@ -1,196 +1,94 @@
-#include <cmath>
 #include <vector>
-#include <memory>
-#include <algorithm>
-#include <cassert>
+#include <string>
+#include <cstdlib>
 #include <iostream>
 
 #include "tgaimage.h"
 #include "model.h"
-#include "geometry.h"
-#include "gl.h"
-
-const TGAColor white = TGAColor(255, 255, 255, 255);
-const TGAColor black = TGAColor(  0,   0,   0, 255);
-const TGAColor red   = TGAColor(255,   0,   0, 255);
-const TGAColor green = TGAColor(  0, 255,   0, 255);
-const TGAColor blue  = TGAColor(  0,   0, 255, 255);
-
-Model *model;
-
-constexpr int width = 1600, height = 1600, depth = 255;
-
-struct PhongShader : public IShader
+#include "renderer.h"
+#include "server.h"
+#include "scene.h"
+#include "parallel.h"
+#include "bvh.h"
+#include "ambientocclusion.h"
+#include "meshstream.h"
+
+static void usage(const char *program)
 {
-    Matrix2x3 vertexUVs;
-    Matrix3x3 vertexNormals;
-    Matrix3x3 vertexCoords;
-
-    Matrix4x4 M;
-    Matrix4x4 MIT;
-    Vec3f light;
-    Matrix4x4 Mshadow;
-    std::vector<float> shadowBuf;
-
-    virtual Vec3f vertex(int faceIndex, int vertexIndex) {
-        // Fetch vertex data from the model.
-        Vec3f vertex = model->getVertex(faceIndex, vertexIndex);
-        Vec3f normal = model->getVertexNormal(faceIndex, vertexIndex);
-        Vec2f uv = model->getTextureVertex(faceIndex, vertexIndex);
-
-        // Transform the vertex and normal to our perspective.
-        vertex = M * vertex;
-        normal = MIT * normal;
-
-        // Record data needed by the fragment shader.
-        vertexCoords.setCol(vertexIndex, vertex);
-        vertexNormals.setCol(vertexIndex, normal);
-        vertexUVs.setCol(vertexIndex, uv);
-
-        // Return the position on the display where the vertex projects.
-        return viewport * vertex;
-    }
-
-    virtual bool fragment(const Vec3f &barycentricCoords, TGAColor &color) {
-        Vec2f uv = vertexUVs * barycentricCoords;
-        TGAColor textureColor = model->getTextureColor(uv);
-        Vec3f objectSpaceNormal = (vertexNormals * barycentricCoords).normalized();
-        Vec3f tangentSpaceNormal = model->getTangentNormal(uv);
-
-        Vec3f globalCoord = (vertexCoords * barycentricCoords);
-        Vec3f shadowBufCoord = Mshadow * globalCoord;
-        int shadowBufIndex = int(shadowBufCoord.x) + int(shadowBufCoord.y)*width;
-        float zFightingMagicNum = 43.34;
-        bool occluded = shadowBuf[shadowBufIndex] > (shadowBufCoord.z + zFightingMagicNum);
-        float shadow = 0.3f + (occluded ? 0.0f : 0.7f);
-
-        Matrix3x3 A;
-        A.setRow(0, vertexCoords.getCol(1) - vertexCoords.getCol(0));
-        A.setRow(1, vertexCoords.getCol(2) - vertexCoords.getCol(0));
-        A.setRow(2, objectSpaceNormal);
-        Matrix3x3 AI = A.inverse();
-        Vec2f uv0 = vertexUVs.getCol(0);
-        Vec2f uv1 = vertexUVs.getCol(1);
-        Vec2f uv2 = vertexUVs.getCol(2);
-        Vec3f i = (AI * Vec3f(uv1.u-uv0.u, uv2.u-uv0.u, 0));
-        Vec3f j = (AI * Vec3f(uv1.v-uv0.v, uv2.v-uv0.v, 0));
-        Matrix3x3 tangentBasis;
-        tangentBasis.setCol(0, i.normalized());
-        tangentBasis.setCol(1, j.normalized());
-        tangentBasis.setCol(2, objectSpaceNormal);
-        Vec3f normal = (tangentBasis * tangentSpaceNormal).normalized();
-
-        float diffuseIntensity = std::max(normal * light, 0.0f);
-        assert(diffuseIntensity <= 1.0f);
+    std::cerr << "usage: " << program << "\n"
+              << "       " << program << " --scene <file> [--workers <n>]\n"
+              << "       " << program << " --serve <socket> [--workers <n>]\n"
+              << "       " << program << " --bake-ao <model path> [--workers <n>]\n"
+              << "       " << program << " --pack-mesh <model path>\n"
+              << "       " << program << " --unpack-textures <model path>\n"
+              << "       " << program << " --check-simd\n";
+}
 
-        Vec3i specularPower = model->getSpecularPower(uv);
-        Vec3f reflection = (-light + normal*(normal*light)*2).normalized();
-        float magicPowIncr = 5;
-        Vec3f specularIntensities;
-        for (int i = 0; i < 3; i++) {
-            specularPower[i] += magicPowIncr;
-            specularIntensities[i] = powf(std::max(reflection.z, 0.0f), specularPower[i]);
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        std::string mode = argv[1];
+        int workers = workerCount();
+        if (mode == "--check-simd" && argc == 2) {
+            return checkSimd(std::cout) ? 0 : 1;
         }
-
-        for (int i = 0; i < 3; i++) {
-            float intensity =
-                0.2f + shadow * (0.8f*diffuseIntensity + 0.6f*specularIntensities[i]);
-            color[i] = std::min(textureColor[i] * intensity, 255.0f);
+        if (argc == 5 && std::string(argv[3]) == "--workers") {
+            workers = std::atoi(argv[4]);
+        } else if (argc != 3) {
+            usage(argv[0]);
+            return 1;
         }
 
-        // Specify not to discard this fragment.
-        return false;
-    }
-};
-
-struct DepthShader : public IShader
-{
-    Matrix3x3 vertexCoords;
-    Matrix4x4 M;
-
-    virtual Vec3f vertex(int faceIndex, int vertexIndex) {
-        Vec3f vertex = model->getVertex(faceIndex, vertexIndex);
-        vertex = M * vertex;
-        vertexCoords.setCol(vertexIndex, vertex);
-        return vertex;
-    }
-
-    virtual bool fragment(const Vec3f& barycentricCoords, TGAColor &color) {
-        Vec3f p = vertexCoords * barycentricCoords;
-        color = TGAColor(255, 255, 255) * (p.z / depth);
-        return false;
-    }
-};
-
-void drawModel(Model& m, IShader& shader, TGAImage& target, std::vector<float>& zBuffer)
-{
-    model = &m;
-    for (int faceIndex = 0; faceIndex < model->numFaces(); faceIndex++) {
-        std::array<Vec3f, 3> screenCoords;
-        for (int vertexIndex = 0; vertexIndex < 3; vertexIndex++) {
-            screenCoords[vertexIndex] = shader.vertex(faceIndex, vertexIndex);
+        if (mode == "--serve") {
+            return serve(argv[2], workers);
+        } else if (mode == "--scene") {
+            Scene scene;
+            std::string error;
+            if (!loadScene(argv[2], scene, error)) {
+                std::cerr << error << "\n";
+                return 1;
+            }
+            return renderScene(scene, workers) ? 0 : 1;
+        } else if (mode == "--bake-ao") {
+            std::string path = argv[2];
+            if (!Model::available(path)) {
+                std::cerr << "can't load model " << path << "\n";
+                return 1;
+            }
+            Model model(path);
+            Bvh bvh;
+            bvh.buildCached(model, path + ".bvh", 0, workers);
+            AmbientOcclusionSettings settings;
+            settings.threads = workers;
+            TGAImage ao = bakeAmbientOcclusion(model, bvh, settings);
+            if (!ao.write_tga_file((path + "_ao.tga").c_str())) {
+                std::cerr << "can't write " << path << "_ao.tga\n";
+                return 1;
+            }
+            return 0;
+        } else if (mode == "--pack-mesh") {
+            std::string path = argv[2];
+            return packMesh(path + ".obj", path + ".mesh") ? 0 : 1;
+        } else if (mode == "--unpack-textures") {
+            return Model::unpackTextures(argv[2]) ? 0 : 1;
         }
-        drawTriangle(screenCoords, shader, target, zBuffer);
+        usage(argv[0]);
+        return 1;
     }
-}
-
-int main(int argc, char** argv)
-{
-    TGAImage outputImage(width, height, TGAImage::RGB);
-    std::vector<float> zBuf(width * height, std::numeric_limits<float>::lowest());
-    std::vector<float> shadowBuf(width * height, std::numeric_limits<float>::lowest());
-
-    Vec3f lightVec = Vec3f(1, 1, 1).normalized();
-    Vec3f origin(0, 0, 0);
-    Vec3f eye(1, 1, 3);
-    Vec3f up(0, 1, 0);
 
     Model head("obj/african_head");
     Model eye_inner("obj/african_head_eye_inner");
     Model diablo("obj/diablo3_pose");
 
-    /*
-     * First pass where we populate the shadow buffer with depth values at
-     * each point where the light casts.
-     */
-
-    lookAt(lightVec, origin, up); // Put camera at position of light source.
-    view(width/8, height/8, width*3/4, height*3/4);
-    project(0); // Set infinite focal length (orthogonal projection)
-
-    DepthShader depthShader;
-    depthShader.M = viewport * projection * modelview;
-
-    drawModel(head, depthShader, outputImage, shadowBuf);
-    drawModel(eye_inner, depthShader, outputImage, shadowBuf);
-    // drawModel(diablo, depthShader, outputImage, shadowBuf);
-
-    outputImage.flip_vertically();
-    outputImage.write_tga_file("depth.tga");
-    outputImage.clear();
-
-    /*
-     * Second pass where we do our final render using said shadow buffer.
-     */
-
-    lookAt(eye, origin, up);
-    view(width/8, height/8, width*3/4, height*3/4);
-    project(-1.0f / (eye-origin).magnitude());
-
-    PhongShader shader;
-    shader.M = projection * modelview;
-    shader.MIT = (projection * modelview).inverseTranspose();
-    shader.Mshadow = depthShader.M * shader.M.inverse();
-    shader.light = (projection * modelview * lightVec).normalized();
-    shader.shadowBuf = std::move(shadowBuf);
+    std::vector<SceneObject> objects = { &head, &eye_inner /*, &diablo */ };
+    RenderSettings settings;
 
-    drawModel(head, shader, outputImage, zBuf);
-    drawModel(eye_inner, shader, outputImage, zBuf);
-    // drawModel(diablo, shader, outputImage, zBuf);
+    TGAImage outputImage;
+    TGAImage depthImage;
+    render(objects, settings, outputImage, &depthImage);
 
-    outputImage.flip_vertically();
+    depthImage.write_tga_file("depth.tga");
     outputImage.write_tga_file("output.tga");
-    outputImage.clear();
 
     return 0;
 }
@@ -0,0 +1,307 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "meshstream.h"
+
+// Leads a .mesh file. The vertex, texture vertex and normal arrays follow,
+// then the faces as nine indices each (vertex, texture vertex and normal
+// of each corner), all in native byte order.
+struct PackedHeader
+{
+    char magic[4];
+    int32_t reserved;
+    int64_t numVertices;
+    int64_t numTextureVertices;
+    int64_t numNormals;
+    int64_t numFaces;
+    float boundsMin[3];
+    float boundsMax[3];
+};
+static_assert(sizeof(PackedHeader) == 64, "PackedHeader must have no padding");
+
+static const char packedMagic[4] = { 'M', 'S', 'H', '1' };
+
+// Longest .obj line parsed; anything past it is ignored.
+static const size_t maxObjLine = 256;
+
+MeshStream::~MeshStream()
+{
+    close();
+}
+
+void MeshStream::close()
+{
+    if (data) {
+        munmap(const_cast<char *>(data), size);
+    }
+    data = nullptr;
+    size = 0;
+    damageSeen = false;
+    faceCount = 0;
+    objVertices.clear();
+    objTextureVertices.clear();
+    objNormals.clear();
+}
+
+bool MeshStream::open(const std::string &filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    data = static_cast<const char *>(mapping);
+    size = info.st_size;
+
+    packed = size >= sizeof(PackedHeader) && !memcmp(data, packedMagic, sizeof(packedMagic));
+    if (!(packed ? openPacked() : openObj())) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool MeshStream::openPacked()
+{
+    PackedHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.numVertices < 0 || header.numTextureVertices < 0 ||
+        header.numNormals < 0 || header.numFaces < 0) {
+        return false;
+    }
+    // Each array must fit in what is left of the file. Counts are checked
+    // against that before they are multiplied, so a damaged header can't
+    // wrap the sizes round to something that looks like it fits.
+    size_t offset = sizeof(header);
+    auto take = [&](int64_t count, size_t elementSize) -> const char * {
+        if (uint64_t(count) > (size - offset) / elementSize) {
+            return nullptr;
+        }
+        const char *array = data + offset;
+        offset += size_t(count)*elementSize;
+        return array;
+    };
+    const char *vertexArray = take(header.numVertices, sizeof(Vec3f));
+    const char *textureVertexArray = vertexArray ? take(header.numTextureVertices, sizeof(Vec2f)) : nullptr;
+    const char *normalArray = textureVertexArray ? take(header.numNormals, sizeof(Vec3f)) : nullptr;
+    const char *faceArray = normalArray ? take(header.numFaces, 9*sizeof(int32_t)) : nullptr;
+    if (!faceArray) {
+        return false;
+    }
+    vertices = reinterpret_cast<const Vec3f *>(vertexArray);
+    textureVertices = reinterpret_cast<const Vec2f *>(textureVertexArray);
+    normals = reinterpret_cast<const Vec3f *>(normalArray);
+    faces = reinterpret_cast<const int32_t *>(faceArray);
+    offset = faceArray - data;
+
+    // The faces are read front to back; the attributes they index are
+    // wherever the mesh puts them.
+    long page = sysconf(_SC_PAGESIZE);
+    size_t facePage = offset / page * page;
+    madvise(const_cast<char *>(data) + facePage, size - facePage, MADV_SEQUENTIAL);
+
+    numVertices = header.numVertices;
+    numTextureVertices = header.numTextureVertices;
+    numNormals = header.numNormals;
+    faceCount = header.numFaces;
+    boundsMin = Vec3f(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    boundsMax = Vec3f(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    return true;
+}
+
+// Copies the line starting at cursor into line, NUL terminated and cut
+// to fit, and moves cursor to the start of the next one. False at the end
+// of the data.
+static bool nextLine(const char *data, size_t size, size_t &cursor, char (&line)[maxObjLine])
+{
+    if (cursor >= size) {
+        return false;
+    }
+    const char *start = data + cursor;
+    const char *newline = static_cast<const char *>(memchr(start, '\n', size - cursor));
+    size_t length = newline ? newline - start : size - cursor;
+    cursor += length + 1;
+    length = std::min(length, maxObjLine - 1);
+    memcpy(line, start, length);
+    line[length] = '\0';
+    return true;
+}
+
+bool MeshStream::openObj()
+{
+    madvise(const_cast<char *>(data), size, MADV_SEQUENTIAL);
+
+    boundsMin = Vec3f(INFINITY, INFINITY, INFINITY);
+    boundsMax = Vec3f(-INFINITY, -INFINITY, -INFINITY);
+    char line[maxObjLine];
+    size_t cursor = 0;
+    while (nextLine(data, size, cursor, line)) {
+        float x, y, z;
+        if (!strncmp(line, "v ", 2) && sscanf(line + 2, "%f %f %f", &x, &y, &z) == 3) {
+            Vec3f v(x, y, z);
+            objVertices.push_back(v);
+            boundsMin = Vec3f(std::min(boundsMin.x, x), std::min(boundsMin.y, y), std::min(boundsMin.z, z));
+            boundsMax = Vec3f(std::max(boundsMax.x, x), std::max(boundsMax.y, y), std::max(boundsMax.z, z));
+        } else if (!strncmp(line, "vt ", 3) && sscanf(line + 3, "%f %f", &x, &y) == 2) {
+            objTextureVertices.push_back(Vec2f(x, y));
+        } else if (!strncmp(line, "vn ", 3) && sscanf(line + 3, "%f %f %f", &x, &y, &z) == 3) {
+            objNormals.push_back(Vec3f(x, y, z));
+        } else if (!strncmp(line, "f ", 2)) {
+            faceCount++;
+        }
+    }
+    vertices = objVertices.data();
+    textureVertices = objTextureVertices.data();
+    normals = objNormals.data();
+    numVertices = objVertices.size();
+    numTextureVertices = objTextureVertices.size();
+    numNormals = objNormals.size();
+    return numVertices > 0;
+}
+
+bool MeshStream::readFace(MeshCursor &cursor, int face[9]) const
+{
+    if (cursor.damaged) {
+        return false;
+    }
+    if (packed) {
+        if (cursor.position >= size_t(faceCount)) {
+            return false;
+        }
+        memcpy(face, faces + cursor.position*9, 9*sizeof(int32_t));
+        cursor.position++;
+    } else {
+        char line[maxObjLine];
+        bool found = false;
+        while (!found && nextLine(data, size, cursor.position, line)) {
+            if (strncmp(line, "f ", 2)) {
+                continue;
+            }
+            if (sscanf(line + 2, "%d/%d/%d %d/%d/%d %d/%d/%d",
+                       &face[0], &face[1], &face[2], &face[3], &face[4],
+                       &face[5], &face[6], &face[7], &face[8]) != 9) {
+                std::cerr << "unsupported .obj face: " << line << "\n";
+                cursor.damaged = true;
+                damageSeen = true;
+                return false;
+            }
+            // .obj indices start at 1.
+            for (int i = 0; i < 9; i++) {
+                face[i]--;
+            }
+            found = true;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    for (int corner = 0; corner < 3; corner++) {
+        if (face[corner*3] < 0 || face[corner*3] >= numVertices ||
+            face[corner*3 + 1] < 0 || face[corner*3 + 1] >= numTextureVertices ||
+            face[corner*3 + 2] < 0 || face[corner*3 + 2] >= numNormals) {
+            std::cerr << "mesh face index out of range\n";
+            cursor.damaged = true;
+            damageSeen = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MeshStream::read(MeshCursor &cursor, FaceChunk &chunk, int maxFaces) const
+{
+    size_t corners = 3*size_t(maxFaces);
+    if (chunk.vertices.size() < corners) {
+        chunk.vertices.resize(corners);
+        chunk.textureVertices.resize(corners);
+        chunk.normals.resize(corners);
+    }
+    chunk.numFaces = 0;
+    int face[9];
+    while (chunk.numFaces < maxFaces && readFace(cursor, face)) {
+        for (int corner = 0; corner < 3; corner++) {
+            size_t i = 3*size_t(chunk.numFaces) + corner;
+            chunk.vertices[i] = vertices[face[corner*3]];
+            chunk.textureVertices[i] = textureVertices[face[corner*3 + 1]];
+            chunk.normals[i] = normals[face[corner*3 + 2]];
+        }
+        chunk.numFaces++;
+    }
+    return chunk.numFaces > 0;
+}
+
+bool packMesh(const std::string &objFilename, const std::string &meshFilename)
+{
+    MeshStream obj;
+    if (!obj.open(objFilename)) {
+        std::cerr << "can't read " << objFilename << "\n";
+        return false;
+    }
+    std::ofstream out(meshFilename.c_str(), std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open " << meshFilename << "\n";
+        return false;
+    }
+
+    // Leave room for the header, which is written once the faces have been
+    // counted.
+    PackedHeader header;
+    memset(&header, 0, sizeof(header));
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    header.numVertices = obj.numVertices;
+    header.numTextureVertices = obj.numTextureVertices;
+    header.numNormals = obj.numNormals;
+    out.write(reinterpret_cast<const char *>(obj.vertices), obj.numVertices*sizeof(Vec3f));
+    out.write(reinterpret_cast<const char *>(obj.textureVertices),
+              obj.numTextureVertices*sizeof(Vec2f));
+    out.write(reinterpret_cast<const char *>(obj.normals), obj.numNormals*sizeof(Vec3f));
+
+    std::vector<int32_t> batch;
+    MeshCursor cursor;
+    int face[9];
+    bool more = true;
+    while (more) {
+        batch.clear();
+        while (batch.size() < 9*65536 && (more = obj.readFace(cursor, face))) {
+            batch.insert(batch.end(), face, face + 9);
+        }
+        out.write(reinterpret_cast<const char *>(batch.data()), batch.size()*sizeof(int32_t));
+        header.numFaces += batch.size() / 9;
+    }
+    if (header.numFaces != obj.numFaces()) {
+        std::cerr << "can't pack " << objFilename << "\n";
+        return false;
+    }
+
+    memcpy(header.magic, packedMagic, sizeof(packedMagic));
+    for (int i = 0; i < 3; i++) {
+        header.boundsMin[i] = obj.getBoundsMin().raw[i];
+        header.boundsMax[i] = obj.getBoundsMax().raw[i];
+    }
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.close();
+    if (out.fail()) {
+        std::cerr << "can't write " << meshFilename << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+#ifndef __MESHSTREAM_H__
+#define __MESHSTREAM_H__
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+#include "geometry.h"
+
+// A run of consecutive faces read from a MeshStream, with the attributes
+// of each corner copied out three per face, in the same layout Model
+// keeps its levels of detail in.
+struct FaceChunk
+{
+    int numFaces = 0;
+    std::vector<Vec3f> vertices;
+    std::vector<Vec2f> textureVertices;
+    std::vector<Vec3f> normals;
+};
+
+// Where one reader of a MeshStream has got to. Starts at the first face.
+struct MeshCursor
+{
+    size_t position = 0;
+    // The last read stopped at a damaged face rather than the end of the
+    // mesh; reads from this cursor return nothing more.
+    bool damaged = false;
+};
+
+// Read-only access to a mesh too large to load as a Model, mapped into
+// memory and read a chunk of faces at a time, so only the chunks in
+// flight need to be resident and the kernel can drop the rest of the file
+// from memory whenever it likes.
+//
+// It reads either a .mesh file written by packMesh() or a .obj file. A
+// .mesh file is fully out of core. For a .obj file only the faces are
+// streamed: the vertex, texture vertex and normal lists are parsed into
+// memory when it is opened, since faces may refer to any of them.
+//
+// Reads don't change the stream, and each reader keeps its own cursor, so
+// any number of draws may stream the same mesh concurrently.
+class MeshStream
+{
+public:
+    MeshStream() { }
+    ~MeshStream();
+
+    MeshStream(const MeshStream &) = delete;
+    MeshStream &operator =(const MeshStream &) = delete;
+
+    // Maps filename, which is taken as a .mesh file if it starts with
+    // one's header and as a .obj file otherwise. False if it can't be
+    // read or isn't valid.
+    bool open(const std::string &filename);
+
+    bool isOpen() const { return data != nullptr; }
+    int64_t numFaces() const { return faceCount; }
+
+    // Object space axis-aligned bounding box of the vertices.
+    Vec3f getBoundsMin() const { return boundsMin; }
+    Vec3f getBoundsMax() const { return boundsMax; }
+
+    // Reads up to maxFaces faces from cursor into chunk and advances the
+    // cursor past them. False once there are no faces left, or at a
+    // damaged face (see MeshCursor::damaged).
+    bool read(MeshCursor &cursor, FaceChunk &chunk, int maxFaces) const;
+
+    // Reads the next face's vertex, texture vertex and normal indices for
+    // each corner, as Model stores them. False once there are none left,
+    // or if the face is unsupported or indexes past the vertex lists, which
+    // also marks the cursor damaged.
+    bool readFace(MeshCursor &cursor, int face[9]) const;
+
+    // Whether any reader has come across a damaged face, for reporting
+    // once every draw is done; each draw checks its own cursor.
+    bool failed() const { return damageSeen; }
+
+private:
+    friend bool packMesh(const std::string &, const std::string &);
+
+    void close();
+    bool openPacked();
+    bool openObj();
+
+    const char *data = nullptr;
+    size_t size = 0;
+    mutable std::atomic<bool> damageSeen{false};
+    bool packed = false;
+    int64_t faceCount = 0;
+
+    // Packed meshes point into the mapping; .obj files parse into the
+    // vectors.
+    const Vec3f *vertices = nullptr;
+    const Vec2f *textureVertices = nullptr;
+    const Vec3f *normals = nullptr;
+    const int32_t *faces = nullptr;
+    int64_t numVertices = 0;
+    int64_t numTextureVertices = 0;
+    int64_t numNormals = 0;
+    std::vector<Vec3f> objVertices;
+    std::vector<Vec2f> objTextureVertices;
+    std::vector<Vec3f> objNormals;
+
+    Vec3f boundsMin;
+    Vec3f boundsMax;
+};
+
+// Converts a .obj file into a .mesh file for MeshStream. Only the vertex
+// lists are held in memory; faces go straight from one file to the other.
+bool packMesh(const std::string &objFilename, const std::string &meshFilename);
+
+#endif // __MESHSTREAM_H__
@@ -3,14 +3,43 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <sys/stat.h>
 
 #include "model.h"
 #include "tgaimage.h"
+#include "simplify.h"
+#include "vertexcache.h"
 
-Model::Model(std::string path)
+// Levels of detail stop halving before they get smaller than this.
+static const int minLodFaces = 64;
+
+// Leads a .lod cache file, followed by the size and modification time of
+// the .obj it was built from and the face order.
+static const char lodCacheMagic[4] = { 'L', 'O', 'D', '2' };
+
+Model::Model(std::string path, int lodLevels, FaceOrder faceOrder)
+    : faceOrder(faceOrder)
 {
     if (!loadObj(path + ".obj"))
         assert(0);
+    reorderFaces();
+    buildLods(path, lodLevels);
+    loadTextures(path);
+}
+
+Model::Model(std::string path, TexturesOnly)
+    : faceOrder(FaceOrder::File)
+{
+    loadTextures(path);
+}
+
+void Model::loadTextures(const std::string &path)
+{
     if (!loadDiffuseMap(path + "_diffuse.tga"))
         assert(0);
     if (!loadNormalMap(path + "_nm.tga"))
@@ -19,6 +48,36 @@ Model::Model(std::string path)
         assert(0);
     if (!loadSpecularMap(path + "_spec.tga"))
         assert(0);
+    if (std::ifstream(path + "_ao.tga") && !loadAmbientOcclusionMap(path + "_ao.tga"))
+        ambientOcclusionMap = TGAImage();
+}
+
+bool Model::available(const std::string &path)
+{
+    for (const char *suffix : { ".obj", "_diffuse.tga", "_nm.tga", "_nm_tangent.tga", "_spec.tga" }) {
+        std::ifstream in(path + suffix);
+        if (in.fail()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Model::unpackTextures(const std::string &path)
+{
+    for (const char *suffix : { "_diffuse.tga", "_nm.tga", "_nm_tangent.tga", "_spec.tga", "_ao.tga" }) {
+        std::string filename = path + suffix;
+        if (!std::ifstream(filename)) {
+            continue;
+        }
+        TGAImage map;
+        if (!map.read_tga_file(filename.c_str(), TGAImage::BOTTOM_LEFT) ||
+            !map.write_file(filename.c_str(), TGAImage::TGA_RAW, TGAImage::BOTTOM_LEFT)) {
+            std::cerr << "can't unpack " << filename << "\n";
+            return false;
+        }
+    }
+    return true;
 }
 
 bool Model::loadObj(std::string filename)
@@ -68,120 +127,384 @@ bool Model::loadObj(std::string filename)
     return true;
 }
 
+// Reorders values to match indices renumbered by optimizeVertexFetch().
+template <typename T>
+static void permute(std::vector<T> &values, const std::vector<int> &oldIndex)
+{
+    std::vector<T> result;
+    result.reserve(values.size());
+    for (int i : oldIndex) {
+        result.push_back(values[i]);
+    }
+    values.swap(result);
+}
+
+void Model::reorderFaces()
+{
+    if (faceOrder != FaceOrder::VertexCache) {
+        return;
+    }
+    optimizeVertexCache(faces, vertices.size());
+    permute(vertices, optimizeVertexFetch(faces, 0, vertices.size()));
+    permute(textureVertices, optimizeVertexFetch(faces, 1, textureVertices.size()));
+    permute(vertexNormals, optimizeVertexFetch(faces, 2, vertexNormals.size()));
+}
+
+void Model::buildLods(const std::string &path, int levels)
+{
+    boundsMin = boundsMax = vertices.empty() ? Vec3f() : vertices[0];
+    for (const Vec3f &v : vertices) {
+        for (int i = 0; i < 3; i++) {
+            boundsMin.raw[i] = std::min(boundsMin.raw[i], v.raw[i]);
+            boundsMax.raw[i] = std::max(boundsMax.raw[i], v.raw[i]);
+        }
+    }
+
+    lods.clear();
+    flatten(faces);
+
+    std::vector<int> targets;
+    for (int target = faces.size() / 2;
+         (int)targets.size() + 1 < levels && target >= minLodFaces;
+         target /= 2) {
+        targets.push_back(target);
+    }
+    if (targets.empty()) {
+        return;
+    }
+
+    std::vector<std::vector<std::vector<int>>> levelFaces;
+    if (!loadLodCache(path, targets.size(), levelFaces)) {
+        levelFaces = simplifyChain(vertices, textureVertices, faces, targets);
+        if (faceOrder == FaceOrder::VertexCache) {
+            for (std::vector<std::vector<int>> &level : levelFaces) {
+                optimizeVertexCache(level, vertices.size());
+            }
+        }
+        saveLodCache(path, levelFaces);
+    }
+    for (const std::vector<std::vector<int>> &level : levelFaces) {
+        flatten(level);
+    }
+}
+
+// Size and modification time of the .obj, to tell a stale cache apart.
+static bool objStamp(const std::string &path, int64_t stamp[2])
+{
+    struct stat info;
+    if (stat((path + ".obj").c_str(), &info) != 0) {
+        return false;
+    }
+    stamp[0] = info.st_size;
+    stamp[1] = info.st_mtime;
+    return true;
+}
+
+bool Model::loadLodCache(const std::string &path, int levels,
+                         std::vector<std::vector<std::vector<int>>> &result) const
+{
+    std::ifstream in(path + ".lod", std::ios::binary);
+    int64_t expected[2], stamp[2];
+    char magic[4];
+    int32_t order, count;
+    if (!in || !objStamp(path, expected) ||
+        !in.read(magic, sizeof(magic)) ||
+        !in.read((char *)stamp, sizeof(stamp)) ||
+        !in.read((char *)&order, sizeof(order)) ||
+        !in.read((char *)&count, sizeof(count)) ||
+        memcmp(magic, lodCacheMagic, sizeof(magic)) != 0 ||
+        stamp[0] != expected[0] || stamp[1] != expected[1] ||
+        order != (int32_t)faceOrder || count != levels) {
+        return false;
+    }
+
+    result.assign(levels, {});
+    for (std::vector<std::vector<int>> &level : result) {
+        int32_t numFaces;
+        if (!in.read((char *)&numFaces, sizeof(numFaces)) ||
+            numFaces < 0 || numFaces > (int)faces.size()) {
+            return false;
+        }
+        std::vector<int32_t> indices(numFaces * 9);
+        if (!in.read((char *)indices.data(), indices.size() * sizeof(int32_t))) {
+            return false;
+        }
+        level.resize(numFaces);
+        for (int f = 0; f < numFaces; f++) {
+            for (int i = 0; i < 3; i++) {
+                int v = indices[f*9 + i*3];
+                int vt = indices[f*9 + i*3 + 1];
+                int vn = indices[f*9 + i*3 + 2];
+                if (v < 0 || v >= (int)vertices.size() ||
+                    vt < 0 || vt >= (int)textureVertices.size() ||
+                    vn < 0 || vn >= (int)vertexNormals.size()) {
+                    return false;
+                }
+            }
+            level[f].assign(indices.begin() + f*9, indices.begin() + f*9 + 9);
+        }
+    }
+    return true;
+}
+
+void Model::saveLodCache(const std::string &path,
+                         const std::vector<std::vector<std::vector<int>>> &levels) const
+{
+    int64_t stamp[2];
+    if (!objStamp(path, stamp)) {
+        return;
+    }
+    std::ofstream out(path + ".lod", std::ios::binary);
+    int32_t order = (int32_t)faceOrder;
+    int32_t count = levels.size();
+    out.write(lodCacheMagic, sizeof(lodCacheMagic));
+    out.write((const char *)stamp, sizeof(stamp));
+    out.write((const char *)&order, sizeof(order));
+    out.write((const char *)&count, sizeof(count));
+    for (const std::vector<std::vector<int>> &level : levels) {
+        int32_t numFaces = level.size();
+        out.write((const char *)&numFaces, sizeof(numFaces));
+        for (const std::vector<int> &face : level) {
+            for (int index : face) {
+                int32_t value = index;
+                out.write((const char *)&value, sizeof(value));
+            }
+        }
+    }
+    if (!out) {
+        std::cerr << "can't write level of detail cache " << path << ".lod\n";
+    }
+}
+
+void Model::flatten(const std::vector<std::vector<int>> &levelFaces)
+{
+    Corners corners;
+    for (const std::vector<int> &face : levelFaces) {
+        for (int i = 0; i < 3; i++) {
+            assert(face[i*3] >= 0 && face[i*3] < (int)vertices.size());
+            assert(face[i*3 + 1] >= 0 && face[i*3 + 1] < (int)textureVertices.size());
+            assert(face[i*3 + 2] >= 0 && face[i*3 + 2] < (int)vertexNormals.size());
+            corners.vertices.push_back(vertices[face[i*3]]);
+            corners.textureVertices.push_back(textureVertices[face[i*3 + 1]]);
+            corners.normals.push_back(vertexNormals[face[i*3 + 2]]);
+        }
+    }
+    lods.push_back(std::move(corners));
+}
+
 bool Model::loadDiffuseMap(std::string path)
 {
-    return
-        diffuseMap.read_tga_file(path.c_str()) &&
-        diffuseMap.flip_vertically();
+    return diffuseMap.map_tga_file(path.c_str(), TGAImage::BOTTOM_LEFT);
 }
 
+// Normal maps store each component c as the byte (c + 1)/2 * 255. The
+// maps stay bytes, three or four per texel, and are decoded a fetch at a
+// time through this table rather than held as floats.
+static const std::array<float, 256> normalComponents = [] {
+    std::array<float, 256> components;
+    for (int byte = 0; byte < 256; byte++) {
+        components[byte] = (byte / 255.0f) * 2.0f - 1.0f;
+    }
+    return components;
+}();
+
+// raw is a texel's blue, green and red bytes.
+static Vec3f decodeNormal(const unsigned char *raw)
+{
+    return Vec3f(normalComponents[raw[2]],
+                 normalComponents[raw[1]],
+                 normalComponents[raw[0]]);
+}
+
+// What a sampler returns past the edge of a normal map.
+static const Vec3f outsideNormal = decodeNormal(TGAColor().raw);
+
 bool Model::loadNormalMap(std::string path)
 {
-    return
-        normalMap.read_tga_file(path.c_str()) &&
-        normalMap.flip_vertically();
+    if (!normalMap.map_tga_file(path.c_str(), TGAImage::BOTTOM_LEFT)) {
+        return false;
+    }
+    assert(normalMap.get_bytespp() >= 3);
+    return true;
 }
 
 bool Model::loadTangentMap(std::string path)
 {
-    return
-        tangentMap.read_tga_file(path.c_str()) &&
-        tangentMap.flip_vertically();
+    if (!tangentMap.map_tga_file(path.c_str(), TGAImage::BOTTOM_LEFT)) {
+        return false;
+    }
+    assert(tangentMap.get_bytespp() >= 3);
+    return true;
 }
 
 bool Model::loadSpecularMap(std::string path)
 {
-    return
-        specularMap.read_tga_file(path.c_str()) &&
-        specularMap.flip_vertically();
+    if (!specularMap.map_tga_file(path.c_str(), TGAImage::BOTTOM_LEFT)) {
+        return false;
+    }
+    specularPerChannel = specularMap.get_bytespp() == TGAImage::RGB;
+    return true;
 }
 
-int Model::numFaces()
+bool Model::loadAmbientOcclusionMap(std::string path)
 {
-    return faces.size();
+    return ambientOcclusionMap.map_tga_file(path.c_str(), TGAImage::BOTTOM_LEFT);
 }
 
-Vec3f Model::getVertex(int faceIndex, int vertexIndex)
+void Model::compressTextures()
 {
-    assert(faceIndex >= 0 && faceIndex < (int)faces.size());
+    diffuseBlocks = BlockTexture(diffuseMap, BlockTexture::Format::BC1);
+    normalBlocks = BlockTexture(normalMap, BlockTexture::Format::BC1);
+    tangentBlocks = BlockTexture(tangentMap, BlockTexture::Format::BC5);
+    specularBlocks = BlockTexture(specularMap, specularPerChannel ?
+                                  BlockTexture::Format::BC1 : BlockTexture::Format::BC4);
+    diffuseMap = TGAImage();
+    normalMap = TGAImage();
+    tangentMap = TGAImage();
+    specularMap = TGAImage();
+}
+
+size_t Model::textureBytes() const
+{
+    size_t bytes = diffuseBlocks.bytes() + normalBlocks.bytes() +
+                   tangentBlocks.bytes() + specularBlocks.bytes();
+    for (const TGAImage *map : { &diffuseMap, &normalMap, &tangentMap, &specularMap,
+                                 &ambientOcclusionMap }) {
+        bytes += size_t(map->get_width()) * map->get_height() * map->get_bytespp();
+    }
+    return bytes;
+}
+
+int Model::numFaces(int lod) const
+{
+    assert(lod >= 0 && lod < (int)lods.size());
+    return lods[lod].vertices.size() / 3;
+}
+
+Vec3f Model::getVertex(int faceIndex, int vertexIndex, int lod) const
+{
+    assert(faceIndex >= 0 && faceIndex < numFaces(lod));
     assert(vertexIndex >= 0 && vertexIndex < 3);
-    int index = faces[faceIndex][vertexIndex*3];
-    assert(index >= 0 && index < (int)vertices.size());
-    return vertices[index];
+    return lods[lod].vertices[faceIndex*3 + vertexIndex];
 }
 
-Vec2f Model::getTextureVertex(int faceIndex, int vertexIndex)
+Vec2f Model::getTextureVertex(int faceIndex, int vertexIndex, int lod) const
 {
-    assert(faceIndex >= 0 && faceIndex < (int)faces.size());
+    assert(faceIndex >= 0 && faceIndex < numFaces(lod));
     assert(vertexIndex >= 0 && vertexIndex < 3);
-    int index = faces[faceIndex][vertexIndex*3 + 1];
-    assert(index >= 0 && index < (int)textureVertices.size());
-    return textureVertices[index];
+    return lods[lod].textureVertices[faceIndex*3 + vertexIndex];
 }
 
-Vec3f Model::getVertexNormal(int faceIndex, int vertexIndex)
+Vec3f Model::getVertexNormal(int faceIndex, int vertexIndex, int lod) const
 {
-    assert(faceIndex >= 0 && faceIndex < (int)faces.size());
+    assert(faceIndex >= 0 && faceIndex < numFaces(lod));
     assert(vertexIndex >= 0 && vertexIndex < 3);
-    int index = faces[faceIndex][vertexIndex*3 + 2];
-    assert(index >= 0 && index < (int)vertexNormals.size());
-    return vertexNormals[index];
+    return lods[lod].normals[faceIndex*3 + vertexIndex];
+}
+
+float Model::cacheMissRatio() const
+{
+    return averageCacheMissRatio(faces, vertices.size());
+}
+
+int Model::selectLod(float screenArea, float pixelsPerFace) const
+{
+    int lod = 0;
+    while (pixelsPerFace > 0.0f && lod + 1 < numLods() &&
+           screenArea / numFaces(lod + 1) <= pixelsPerFace) {
+        lod++;
+    }
+    return lod;
+}
+
+const unsigned char *Model::texelAt(const TGAImage &map, Vec2f uv)
+{
+    int x = uv.u * map.get_width();
+    int y = uv.v * map.get_height();
+    if (x < 0 || y < 0 || x >= map.get_width() || y >= map.get_height()) {
+        return nullptr;
+    }
+    return map.buffer() + (size_t(y) * map.get_width() + x) * map.get_bytespp();
 }
 
-TGAColor Model::getTextureColor(Vec2f uv)
+TGAColor Model::getTextureColor(Vec2f uv) const
 {
     assert(uv.u >= 0.0 && uv.u <= 1.0);
     assert(uv.v >= 0.0 && uv.v <= 1.0);
 
+    if (!diffuseBlocks.empty()) {
+        return diffuseBlocks.get(int(uv.u * diffuseBlocks.getWidth()),
+                                 int(uv.v * diffuseBlocks.getHeight()));
+    }
     Vec2i texel(uv.u * diffuseMap.get_width(),
                 uv.v * diffuseMap.get_height());
 
     return diffuseMap.get(texel.x, texel.y);
 }
 
-Vec3f Model::getTextureNormal(Vec2f uv)
+Vec3f Model::getTextureNormal(Vec2f uv) const
 {
     assert(uv.u >= 0.0 && uv.u <= 1.0);
     assert(uv.v >= 0.0 && uv.v <= 1.0);
 
-    Vec2i texel(uv.u * normalMap.get_width(),
-                uv.v * normalMap.get_height());
-    TGAColor normalColor = normalMap.get(texel.u, texel.y);
-    Vec3f vertexNormal((normalColor.r / 255.0f) * 2.0f - 1.0f,
-                       (normalColor.g / 255.0f) * 2.0f - 1.0f,
-                       (normalColor.b / 255.0f) * 2.0f - 1.0f);
-
-    return vertexNormal;
+    if (!normalBlocks.empty()) {
+        return decodeNormal(normalBlocks.get(int(uv.u * normalBlocks.getWidth()),
+                                             int(uv.v * normalBlocks.getHeight())).raw);
+    }
+    const unsigned char *texel = texelAt(normalMap, uv);
+    return texel ? decodeNormal(texel) : outsideNormal;
 }
 
-Vec3f Model::getTangentNormal(Vec2f uv)
+Vec3f Model::getTangentNormal(Vec2f uv) const
 {
     assert(uv.u >= 0.0 && uv.u <= 1.0);
     assert(uv.v >= 0.0 && uv.v <= 1.0);
 
-    Vec2i texel(uv.u * tangentMap.get_width(),
-                uv.v * tangentMap.get_height());
-    TGAColor tangentColor = tangentMap.get(texel.u, texel.y);
-    Vec3f tangentNormal((tangentColor.r / 255.0f) * 2.0f - 1.0f,
-                        (tangentColor.g / 255.0f) * 2.0f - 1.0f,
-                        (tangentColor.b / 255.0f) * 2.0f - 1.0f);
-
-    return tangentNormal;
+    if (!tangentBlocks.empty()) {
+        // Only x and y are stored; tangent space normals point out of the
+        // surface, so z is the positive root.
+        TGAColor tangentColor = tangentBlocks.get(int(uv.u * tangentBlocks.getWidth()),
+                                                  int(uv.v * tangentBlocks.getHeight()));
+        float x = (tangentColor.r / 255.0f) * 2.0f - 1.0f;
+        float y = (tangentColor.g / 255.0f) * 2.0f - 1.0f;
+        return Vec3f(x, y, std::sqrt(std::max(1.0f - x*x - y*y, 0.0f)));
+    }
+    const unsigned char *texel = texelAt(tangentMap, uv);
+    return texel ? decodeNormal(texel) : outsideNormal;
 }
 
-Vec3i Model::getSpecularPower(Vec2f uv)
+Vec3i Model::getSpecularPower(Vec2f uv) const
 {
     assert(uv.u >= 0.0 && uv.u <= 1.0);
     assert(uv.v >= 0.0 && uv.v <= 1.0);
 
-    Vec2i texel(uv.u * specularMap.get_width(),
-                uv.v * specularMap.get_height());
+    if (!specularBlocks.empty()) {
+        TGAColor channels = specularBlocks.get(int(uv.u * specularBlocks.getWidth()),
+                                               int(uv.v * specularBlocks.getHeight()));
+        if (channels.bytespp == 3) {
+            return Vec3i(channels.raw[0], channels.raw[1], channels.raw[2]);
+        } else {
+            return Vec3i(channels.raw[0], channels.raw[0], channels.raw[0]);
+        }
+    }
+    const unsigned char *texel = texelAt(specularMap, uv);
+    if (!texel) {
+        return Vec3i(0, 0, 0);
+    }
+    int channel = specularPerChannel ? 1 : 0;
+    return Vec3i(texel[0], texel[channel], texel[2*channel]);
+}
 
-    TGAColor channels = specularMap.get(texel.x, texel.y);
+float Model::getAmbientOcclusion(Vec2f uv) const
+{
+    assert(uv.u >= 0.0 && uv.u <= 1.0);
+    assert(uv.v >= 0.0 && uv.v <= 1.0);
 
-    if (channels.bytespp == 3) {
-        return Vec3i(channels.raw[0], channels.raw[1], channels.raw[2]);
-    } else {
-        return Vec3i(channels.raw[0], channels.raw[0], channels.raw[0]);
+    if (!ambientOcclusionMap.get_width()) {
+        return 1.0f;
     }
+    Vec2i texel(std::min(int(uv.u * ambientOcclusionMap.get_width()), ambientOcclusionMap.get_width() - 1),
+                std::min(int(uv.v * ambientOcclusionMap.get_height()), ambientOcclusionMap.get_height() - 1));
+
+    return ambientOcclusionMap.get(texel.x, texel.y).raw[0] / 255.0f;
 }
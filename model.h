@@ -6,39 +6,133 @@
 
 #include "geometry.h"
 #include "tgaimage.h"
+#include "blocktexture.h"
 
 class Model
 {
 public:
-    Model(std::string path);
+    // The order faces are drawn in: as the .obj lists them, or reordered
+    // for vertex cache reuse and locality (see vertexcache.h), with the
+    // vertex, texture vertex and normal arrays renumbered to match.
+    enum class FaceOrder { File, VertexCache };
 
-    int numFaces();
-    std::vector<int> getFace(int index);
-    Vec3f getVertex(int faceIndex, int vertexIndex);
-    Vec2f getTextureVertex(int faceIndex, int vertexIndex);
-    Vec3f getVertexNormal(int faceIndex, int vertexIndex);
+    // Loads path.obj and its texture maps, and builds lodLevels levels of
+    // detail (counting the full mesh as the first), each with about half
+    // the faces of the one before. Simplified levels are cached in
+    // path.lod and only rebuilt when the .obj changes.
+    Model(std::string path, int lodLevels = 4,
+          FaceOrder faceOrder = FaceOrder::VertexCache);
+
+    // Loads only path's texture maps, leaving the mesh empty, for meshes
+    // drawn from a MeshStream instead (see drawStream()).
+    struct TexturesOnly { };
+    Model(std::string path, TexturesOnly);
+
+    // Whether every file the constructor would load for path exists.
+    static bool available(const std::string &path);
+
+    // Rewrites path's texture maps as uncompressed, bottom-left origin
+    // TGA files, which models then map rather than read, sharing them
+    // through the page cache (see TGAImage::map_tga_file()).
+    static bool unpackTextures(const std::string &path);
+
+    // Models are read-only once loaded, so one can be shared between any
+    // number of concurrent renders.
+    // Level 0 is the full mesh, higher levels are coarser.
+    int numLods() const { return lods.size(); }
+    int numFaces(int lod = 0) const;
+    std::vector<int> getFace(int index) const;
+    Vec3f getVertex(int faceIndex, int vertexIndex, int lod = 0) const;
+    Vec2f getTextureVertex(int faceIndex, int vertexIndex, int lod = 0) const;
+    Vec3f getVertexNormal(int faceIndex, int vertexIndex, int lod = 0) const;
+
+    // Average vertex cache miss ratio of the full mesh in draw order.
+    float cacheMissRatio() const;
+
+    // The coarsest level whose faces would each still cover no more than
+    // pixelsPerFace of screenArea, the projected size of the model in
+    // pixels.
+    int selectLod(float screenArea, float pixelsPerFace) const;
+
+    // Object space axis-aligned bounding box of the vertices.
+    Vec3f getBoundsMin() const { return boundsMin; }
+    Vec3f getBoundsMax() const { return boundsMax; }
 
     TGAImage diffuseMap;
     TGAImage normalMap;
     TGAImage tangentMap;
     TGAImage specularMap;
+    TGAImage ambientOcclusionMap; // optional, empty unless path_ao.tga exists
+
+    // Swaps the diffuse, normal and specular maps for block-compressed
+    // copies (see BlockTexture), which the samplers below then decode a
+    // texel at a time: BC1 for colour and
+    // object space normals, BC5 for tangent space normals, BC4 for single
+    // channel specular maps. Part of loading, so call it before sharing
+    // the model.
+    void compressTextures();
 
-    TGAColor getTextureColor(Vec2f uv);
-    Vec3f getTextureNormal(Vec2f uv);
-    Vec3f getTangentNormal(Vec2f uv);
-    Vec3i getSpecularPower(Vec2f uv);
+    // Memory the texture maps take, compressed or not.
+    size_t textureBytes() const;
+
+    TGAColor getTextureColor(Vec2f uv) const;
+    Vec3f getTextureNormal(Vec2f uv) const;
+    Vec3f getTangentNormal(Vec2f uv) const;
+    Vec3i getSpecularPower(Vec2f uv) const;
+
+    // Baked ambient occlusion at uv, from 0 (fully occluded) to 1. Always
+    // 1 when the model has no occlusion map.
+    float getAmbientOcclusion(Vec2f uv) const;
 
 private:
+    void loadTextures(const std::string &path);
     bool loadObj(std::string filename);
     bool loadDiffuseMap(std::string filename);
     bool loadNormalMap(std::string filename);
     bool loadTangentMap(std::string filename);
     bool loadSpecularMap(std::string filename);
+    bool loadAmbientOcclusionMap(std::string filename);
+    void reorderFaces();
+    void buildLods(const std::string &path, int levels);
+    bool loadLodCache(const std::string &filename, int levels,
+                      std::vector<std::vector<std::vector<int>>> &result) const;
+    void saveLodCache(const std::string &filename,
+                      const std::vector<std::vector<std::vector<int>>> &levels) const;
+    void flatten(const std::vector<std::vector<int>> &levelFaces);
+
+    FaceOrder faceOrder;
 
     std::vector<std::vector<int>> faces;
     std::vector<Vec3f> vertices;
     std::vector<Vec2f> textureVertices;
     std::vector<Vec3f> vertexNormals;
+
+    // Per-corner copies of the attributes, three per face in face order, so
+    // the vertex fetches of every draw (and every instance) are one
+    // sequential load instead of a walk through faces' index lists.
+    struct Corners
+    {
+        std::vector<Vec3f> vertices;
+        std::vector<Vec2f> textureVertices;
+        std::vector<Vec3f> normals;
+    };
+    std::vector<Corners> lods;
+
+    Vec3f boundsMin;
+    Vec3f boundsMax;
+
+    // Three channel specular maps hold an exponent per colour channel;
+    // the others only use their first.
+    bool specularPerChannel = false;
+
+    // The bytes of map's texel at uv, or null past its edges.
+    static const unsigned char *texelAt(const TGAImage &map, Vec2f uv);
+
+    // Empty unless compressTextures() was called.
+    BlockTexture diffuseBlocks;
+    BlockTexture normalBlocks;
+    BlockTexture tangentBlocks;
+    BlockTexture specularBlocks;
 };
 
 #endif // __MODEL_H__
@@ -0,0 +1,110 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Number of worker threads to split work across.
+inline int workerCount()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n ? int(n) : 1;
+}
+
+// Calls fn(i) for every i in [begin, end), handing each thread one
+// contiguous chunk of the range. Runs inline when there's only one chunk.
+template <typename F>
+void parallelFor(int begin, int end, F fn, int threads=workerCount())
+{
+    int count = end - begin;
+    threads = std::max(1, std::min(threads, count));
+    if (threads == 1) {
+        for (int i = begin; i < end; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    int chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        int chunkBegin = begin + t*chunk;
+        int chunkEnd = std::min(chunkBegin + chunk, end);
+        workers.emplace_back([=, &fn]() {
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                fn(i);
+            }
+        });
+    }
+    for (int i = begin; i < std::min(begin + chunk, end); i++) {
+        fn(i);
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+// A fixed set of worker threads running submitted tasks in FIFO order.
+// Destroying the pool finishes the queued tasks and joins the workers.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads=workerCount()) {
+        for (int i = 0; i < std::max(threads, 1); i++) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator =(const ThreadPool &) = delete;
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        ready.notify_one();
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+};
+
+#endif // __PARALLEL_H__
@@ -0,0 +1,285 @@
+#include <vector>
+#include <algorithm>
+
+#include "renderer.h"
+#include "shaders.h"
+#include "gl.h"
+
+// Draws objects, which must be sorted by model, as one instanced draw per
+// model. Streamed objects are drawn one at a time.
+static void drawObjects(RenderContext &ctx,
+                        const std::vector<SceneObject> &objects,
+                        IShader &shader,
+                        DepthPass pass,
+                        int threads)
+{
+    std::vector<Matrix4x4> instances;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects[i].stream) {
+            drawStream(ctx, *objects[i].stream, *objects[i].model, shader,
+                       objects[i].transform, pass, threads);
+            continue;
+        }
+        instances.push_back(objects[i].transform);
+        if (i + 1 == objects.size() || objects[i + 1].model != objects[i].model ||
+            objects[i + 1].stream) {
+            drawModelInstanced(ctx, *objects[i].model, shader, instances, pass, threads);
+            instances.clear();
+        }
+    }
+}
+
+static std::vector<SceneObject> sortedByModel(const std::vector<SceneObject> &objects)
+{
+    std::vector<SceneObject> sorted(objects);
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const SceneObject &a, const SceneObject &b) { return a.model < b.model; });
+    return sorted;
+}
+
+std::vector<Light> RenderSettings::activeLights() const
+{
+    if (!lights.empty()) {
+        return lights;
+    }
+    Light single;
+    single.direction = light;
+    single.center = center;
+    single.shadowWidth = shadowWidth;
+    single.shadowHeight = shadowHeight;
+    single.shadowFilter = shadowFilter;
+    return { single };
+}
+
+Matrix4x4 renderShadowPass(const std::vector<SceneObject> &objects,
+                           const RenderSettings &settings,
+                           const Light &light,
+                           ShadowMap &shadowMap,
+                           TGAImage *depthImage)
+{
+    int width = shadowMap.getWidth();
+    int height = shadowMap.getHeight();
+    TGAImage scratch;
+    if (!depthImage) {
+        depthImage = &scratch;
+    }
+    *depthImage = TGAImage(width, height, TGAImage::RGB);
+
+    RenderContext ctx;
+    ctx.image = depthImage;
+    ctx.zBuffer = &shadowMap.depthBuffer();
+    ctx.lodPixelsPerFace = settings.lodPixelsPerFace;
+    ctx.rasterization = settings.rasterization;
+
+    if (light.type == Light::Type::Directional) {
+        // Put the camera at the position of the light source, with an
+        // infinite focal length (orthogonal projection).
+        lookAt(ctx, light.direction.normalized(), light.center, settings.up);
+        view(ctx, width/8, height/8, width*3/4, height*3/4);
+        project(ctx, 0);
+    } else {
+        lookAt(ctx, light.position, light.center, settings.up);
+        view(ctx, width/8, height/8, width*3/4, height*3/4);
+        project(ctx, -1.0f / (light.position - light.center).magnitude());
+    }
+
+    DepthShader depthShader(ctx);
+
+    shadowMap.clear();
+    drawObjects(ctx, sortedByModel(objects), depthShader, DepthPass::Combined, settings.threads);
+    shadowMap.prepare();
+
+    depthImage->flip_vertically();
+    return ctx.viewport * ctx.projection * ctx.modelview;
+}
+
+std::vector<LightShadow> renderShadowMaps(const std::vector<SceneObject> &objects,
+                                          const RenderSettings &settings,
+                                          const std::vector<Light> &lights,
+                                          TGAImage *depthImage)
+{
+    std::vector<int> shadowed;
+    for (int l = 0; l < (int)lights.size(); l++) {
+        if (lights[l].castsShadows) {
+            shadowed.push_back(l);
+        }
+    }
+
+    // The maps render side by side, sharing the threads between them.
+    std::vector<LightShadow> shadows(lights.size());
+    RenderSettings passSettings = settings;
+    passSettings.threads = std::max(1, settings.threads / std::max<int>(1, shadowed.size()));
+    parallelFor(0, shadowed.size(), [&](int i) {
+        const Light &light = lights[shadowed[i]];
+        std::shared_ptr<ShadowMap> map(new ShadowMap(light.shadowWidth, light.shadowHeight,
+                                                     settings.shadowFormat, settings.depthLayout));
+        map->filter = light.shadowFilter;
+        shadows[shadowed[i]].worldToShadow =
+            renderShadowPass(objects, passSettings, light, *map, i == 0 ? depthImage : nullptr);
+        shadows[shadowed[i]].map = map;
+    }, settings.threads);
+    return shadows;
+}
+
+// Shading happens in the eye's projected space, which doesn't depend on the
+// object, so the lights and the routes back to their shadow maps are set
+// up once per view.
+static void setupShading(const RenderContext &ctx,
+                         const std::vector<Light> &lights,
+                         const std::vector<LightShadow> &shadows,
+                         const SpecularTable &specular,
+                         PhongShader &shader)
+{
+    shader.specular = specular.empty() ? nullptr : &specular;
+    Matrix4x4 worldToView = ctx.projection * ctx.modelview;
+    shader.viewToWorld = ctx.modelviewInverse * ctx.projectionInverse;
+    for (size_t l = 0; l < lights.size(); l++) {
+        const Light &light = lights[l];
+        ShadedLight shaded;
+        shaded.type = light.type;
+        shaded.direction = (worldToView * light.direction.normalized()).normalized();
+        shaded.position = worldToView * light.position;
+        shaded.worldPosition = light.position;
+        shaded.range = light.range;
+        shaded.color = light.color;
+        shaded.shadowMap = shadows[l].map.get();
+        shaded.toShadow = shadows[l].worldToShadow * shader.viewToWorld;
+        shader.lights.push_back(shaded);
+    }
+}
+
+void renderMainPass(const std::vector<SceneObject> &objects,
+                    const RenderSettings &settings,
+                    const std::vector<Light> &lights,
+                    const std::vector<LightShadow> &shadows,
+                    TGAImage &image,
+                    DepthBuffer *depth)
+{
+    assert(lights.size() == shadows.size());
+    int width = settings.width;
+    int height = settings.height;
+    image = TGAImage(width, height, TGAImage::RGB);
+    MultisampleTarget msaaTarget(width, height, settings.msaaSamples,
+                                 settings.zBufFormat, settings.depthLayout);
+
+    RenderContext ctx;
+    ctx.msaaTarget = &msaaTarget;
+    ctx.lodPixelsPerFace = settings.lodPixelsPerFace;
+    ctx.rasterization = settings.rasterization;
+
+    lookAt(ctx, settings.eye, settings.center, settings.up);
+    view(ctx, width/8, height/8, width*3/4, height*3/4);
+    project(ctx, -1.0f / (settings.eye - settings.center).magnitude());
+
+    LightTiles tiles(width, height);
+    tiles.build(lights, ctx.viewport * ctx.projection * ctx.modelview);
+
+    SpecularTable specular(settings.specularError);
+    PhongShader shader(ctx);
+    shader.lightTiles = &tiles;
+    setupShading(ctx, lights, shadows, specular, shader);
+
+    std::vector<SceneObject> sorted = sortedByModel(objects);
+    if (settings.depthPrepass) {
+        drawObjects(ctx, sorted, shader, DepthPass::DepthOnly, settings.threads);
+    }
+    DepthPass shadePass = settings.depthPrepass ? DepthPass::ShadeVisible : DepthPass::Combined;
+    drawObjects(ctx, sorted, shader, shadePass, settings.threads);
+    msaaTarget.resolve(image);
+
+    if (depth) {
+        const DepthBuffer &samples = msaaTarget.depthBuffer();
+        *depth = DepthBuffer(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                depth->set(x, y, samples.get(x*settings.msaaSamples, y));
+            }
+        }
+    }
+
+    image.flip_vertically();
+}
+
+bool renderMainPassBanded(const std::vector<SceneObject> &objects,
+                          const RenderSettings &settings,
+                          const std::vector<Light> &lights,
+                          const std::vector<LightShadow> &shadows,
+                          int bandHeight,
+                          TGAWriter &out)
+{
+    assert(lights.size() == shadows.size());
+    int width = settings.width;
+    int height = settings.height;
+    bandHeight = std::max(1, std::min(bandHeight, height));
+
+    RenderContext ctx;
+    ctx.lodPixelsPerFace = settings.lodPixelsPerFace;
+    ctx.rasterization = settings.rasterization;
+
+    lookAt(ctx, settings.eye, settings.center, settings.up);
+    view(ctx, width/8, height/8, width*3/4, height*3/4);
+    project(ctx, -1.0f / (settings.eye - settings.center).magnitude());
+
+    // Every band needs the same bins, so sort the faces into them once,
+    // against the whole frame. Streamed meshes can't be binned without
+    // holding their faces, so each band reads them again instead.
+    std::vector<SceneObject> sorted = sortedByModel(objects);
+    std::vector<FaceBins> bins(sorted.size());
+    parallelFor(0, sorted.size(), [&](int i) {
+        if (!sorted[i].stream) {
+            bins[i] = binFaces(ctx, *sorted[i].model, sorted[i].transform, height, bandHeight);
+        }
+    }, settings.threads);
+
+    SpecularTable specular(settings.specularError);
+    PhongShader shader(ctx);
+    setupShading(ctx, lights, shadows, specular, shader);
+
+    DepthPass shadePass = settings.depthPrepass ? DepthPass::ShadeVisible : DepthPass::Combined;
+    for (int band = 0, y0 = 0; y0 < height; band++, y0 += bandHeight) {
+        int rows = std::min(bandHeight, height - y0);
+        MultisampleTarget msaaTarget(width, rows, settings.msaaSamples,
+                                     settings.zBufFormat, settings.depthLayout);
+        ctx.msaaTarget = &msaaTarget;
+        // The band's target holds rows [y0, y0 + rows) of the frame.
+        view(ctx, width/8, height/8 - y0, width*3/4, height*3/4);
+
+        LightTiles tiles(width, rows);
+        tiles.build(lights, ctx.viewport * ctx.projection * ctx.modelview);
+        shader.lightTiles = &tiles;
+
+        for (DepthPass pass : { DepthPass::DepthOnly, shadePass }) {
+            if (pass == DepthPass::DepthOnly && !settings.depthPrepass) {
+                continue;
+            }
+            for (size_t i = 0; i < sorted.size(); i++) {
+                const SceneObject &object = sorted[i];
+                if (object.stream) {
+                    drawStream(ctx, *object.stream, *object.model, shader, object.transform,
+                               pass, settings.threads);
+                } else {
+                    ctx.lod = bins[i].lod;
+                    drawModelFaces(ctx, *object.model, shader, object.transform,
+                                   bins[i].bands[band], pass, settings.threads);
+                }
+            }
+        }
+
+        TGAImage image(width, rows, TGAImage::RGB);
+        msaaTarget.resolve(image);
+        if (!out.write(image)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void render(const std::vector<SceneObject> &objects,
+            const RenderSettings &settings,
+            TGAImage &image,
+            TGAImage *depthImage)
+{
+    std::vector<Light> lights = settings.activeLights();
+    std::vector<LightShadow> shadows = renderShadowMaps(objects, settings, lights, depthImage);
+    renderMainPass(objects, settings, lights, shadows, image);
+}
@@ -0,0 +1,150 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <vector>
+#include <memory>
+
+#include "tgaimage.h"
+#include "model.h"
+#include "geometry.h"
+#include "depthbuffer.h"
+#include "shadowmap.h"
+#include "parallel.h"
+#include "lights.h"
+#include "gl.h"
+
+// Everything that describes one shadowed Phong render of a set of models.
+struct RenderSettings
+{
+    int width = 1600;
+    int height = 1600;
+    int shadowWidth = 2048;
+    int shadowHeight = 2048;
+
+    // Depth storage for the main and shadow passes, unquantized floats row
+    // after row by default. Unorm16 is plenty for the shadow map given its
+    // bias, and tiling keeps the random-access depth tests of both passes
+    // within fewer cache lines, at the cost of slightly different images.
+    DepthBuffer::Format zBufFormat = DepthBuffer::Format::Float32;
+    DepthBuffer::Format shadowFormat = DepthBuffer::Format::Float32;
+    DepthBuffer::Layout depthLayout = DepthBuffer::Layout::Linear;
+    ShadowMap::Filter shadowFilter = ShadowMap::Filter::PCF;
+
+    // Samples per pixel for the main pass (1, 2, 4 or 8). Above 1, edges
+    // are antialiased while PhongShader still only runs once per pixel.
+    int msaaSamples = 1;
+
+    // How triangles are turned into pixels, in every pass. FixedPoint gives
+    // each pixel on an edge between two triangles to exactly one of them.
+    Rasterization rasterization = Rasterization::Float;
+
+    // Lay down the final depth of the main pass before shading, so the
+    // expensive PhongShader only runs on the pixels that end up visible.
+    // Off by default: each fragment is shaded as it passes the depth test.
+    bool depthPrepass = false;
+
+    // Objects are drawn at the coarsest level of detail that leaves at most
+    // this many pixels of their projected bounds per face; 0, the default,
+    // draws every object at full detail.
+    float lodPixelsPerFace = 0.0f;
+
+    // Largest error allowed in the specular highlights, which then come
+    // from a SpecularTable instead of powf(); 0 keeps them exact.
+    float specularError = 0.0f;
+
+    // Threads each pass is split across, in horizontal bands.
+    int threads = workerCount();
+
+    Vec3f eye = Vec3f(1, 1, 3);
+    Vec3f center = Vec3f(0, 0, 0);
+    Vec3f up = Vec3f(0, 1, 0);
+    Vec3f light = Vec3f(1, 1, 1); // direction towards the (directional) light
+
+    // The lights of the scene. When empty, there is one directional light
+    // along `light`, aimed at center, with the shadow map settings above.
+    std::vector<Light> lights;
+
+    std::vector<Light> activeLights() const;
+};
+
+// One model placed in the world. Several objects may share a model.
+struct SceneObject
+{
+    const Model *model;
+    Matrix4x4 transform; // object to world
+
+    // When set, the object's faces are streamed from here with
+    // drawStream(), and model only supplies its textures.
+    const MeshStream *stream = nullptr;
+
+    SceneObject(const Model *model, const Matrix4x4 &transform=Matrix4x4::identity(),
+                const MeshStream *stream=nullptr)
+        : model(model), transform(transform), stream(stream) { }
+};
+
+// A light's shadow map and the transform from world space into its screen
+// space. map is null for lights that cast no shadows. Shared, so several
+// views of a scene can use the same maps.
+struct LightShadow
+{
+    std::shared_ptr<const ShadowMap> map;
+    Matrix4x4 worldToShadow = Matrix4x4::identity();
+};
+
+// Renders the objects' depth from the light into shadowMap, and returns
+// the transform from world space into shadow map screen space. If
+// depthImage is given it receives a greyscale view of the depth. The
+// result depends only on the objects, the light and the depth settings,
+// so it can be shared by every view of the same scene under that light.
+Matrix4x4 renderShadowPass(const std::vector<SceneObject> &objects,
+                           const RenderSettings &settings,
+                           const Light &light,
+                           ShadowMap &shadowMap,
+                           TGAImage *depthImage=nullptr);
+
+// First pass: the shadow maps of all the lights, one per element, rendered
+// side by side with settings.threads shared between them. depthImage, if
+// given, receives the depth view of the first shadowed light.
+std::vector<LightShadow> renderShadowMaps(const std::vector<SceneObject> &objects,
+                                          const RenderSettings &settings,
+                                          const std::vector<Light> &lights,
+                                          TGAImage *depthImage=nullptr);
+
+// Second pass: renders the objects from the eye into image, lit by the
+// lights and shadowed by the matching maps from renderShadowMaps(). Each
+// fragment only visits the lights that can reach its screen tile. Draws
+// are sorted by model so each mesh and its textures are walked in one go,
+// and objects sharing a model are drawn as instances of it. depth, if
+// given, receives the depth of each pixel's first sample.
+void renderMainPass(const std::vector<SceneObject> &objects,
+                    const RenderSettings &settings,
+                    const std::vector<Light> &lights,
+                    const std::vector<LightShadow> &shadows,
+                    TGAImage &image,
+                    DepthBuffer *depth=nullptr);
+
+// The second pass for frames too large to hold, rendered a band of
+// bandHeight rows at a time: only one band's colour and depth samples exist
+// at once, and each is written to out, which must be open at the size in
+// settings, as soon as it is resolved. Faces are binned by the bands they
+// overlap up front, so each band only draws its own. The image matches
+// renderMainPass()'s exactly with Rasterization::FixedPoint; with Float,
+// moving a band's rows to its origin can round a few edge pixels the
+// other way. False if out couldn't be written.
+bool renderMainPassBanded(const std::vector<SceneObject> &objects,
+                          const RenderSettings &settings,
+                          const std::vector<Light> &lights,
+                          const std::vector<LightShadow> &shadows,
+                          int bandHeight,
+                          TGAWriter &out);
+
+// Both passes, with settings.activeLights(). image (and depthImage, if
+// given) are reallocated to the sizes in settings and come out with a
+// top-left origin, ready to write. Each call has its own state, so renders
+// may run concurrently, sharing the models.
+void render(const std::vector<SceneObject> &objects,
+            const RenderSettings &settings,
+            TGAImage &image,
+            TGAImage *depthImage=nullptr);
+
+#endif // __RENDERER_H__
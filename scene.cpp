@@ -0,0 +1,501 @@
+#include <map>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "scene.h"
+#include "model.h"
+#include "meshstream.h"
+#include "gl.h"
+#include "renderer.h"
+#include "parallel.h"
+
+static bool readVec3(std::istringstream &iss, Vec3f &v)
+{
+    return bool(iss >> v.x >> v.y >> v.z);
+}
+
+static bool readSize(std::istringstream &iss, int &width, int &height)
+{
+    return (iss >> width >> height) &&
+           width > 0 && height > 0 && width <= 32767 && height <= 32767;
+}
+
+static bool parseModel(std::istringstream &iss, SceneModel &model, std::string &error)
+{
+    if (!(iss >> model.name >> model.path)) {
+        error = "expected model <name> <path>";
+        return false;
+    }
+    std::string op;
+    while (iss >> op) {
+        Matrix4x4 step;
+        if (op == "translate") {
+            Vec3f offset;
+            if (!readVec3(iss, offset)) {
+                error = "expected translate x y z";
+                return false;
+            }
+            step = translate(offset.x, offset.y, offset.z);
+        } else if (op == "scale") {
+            float x, y, z;
+            if (!(iss >> x)) {
+                error = "expected scale s or scale x y z";
+                return false;
+            }
+            // Uniform unless two more factors follow.
+            std::streampos afterX = iss.tellg();
+            if (iss >> y >> z) {
+                step = scale(x, y, z);
+            } else {
+                iss.clear();
+                iss.seekg(afterX);
+                step = scale(x, x, x);
+            }
+        } else if (op == "rotate") {
+            Vec3f axis;
+            float degrees;
+            if (!readVec3(iss, axis) || !(iss >> degrees) || axis.magnitude() == 0.0f) {
+                error = "expected rotate x y z degrees";
+                return false;
+            }
+            step = rotate(axis, degrees);
+        } else if (op == "stream") {
+            model.stream = true;
+            continue;
+        } else {
+            error = "unknown model transform " + op;
+            return false;
+        }
+        model.transform = step * model.transform;
+    }
+    return true;
+}
+
+static bool parseFilter(const std::string &name, ShadowMap::Filter &filter)
+{
+    if (name == "point") {
+        filter = ShadowMap::Filter::Point;
+    } else if (name == "pcf") {
+        filter = ShadowMap::Filter::PCF;
+    } else if (name == "variance") {
+        filter = ShadowMap::Filter::Variance;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseDepthFormat(const std::string &name, DepthBuffer::Format &format)
+{
+    if (name == "float32") {
+        format = DepthBuffer::Format::Float32;
+    } else if (name == "unorm24") {
+        format = DepthBuffer::Format::Unorm24;
+    } else if (name == "unorm16") {
+        format = DepthBuffer::Format::Unorm16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseRasterization(const std::string &name, Rasterization &rasterization)
+{
+    if (name == "float") {
+        rasterization = Rasterization::Float;
+    } else if (name == "fixed") {
+        rasterization = Rasterization::FixedPoint;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseLight(std::istringstream &iss, SceneLight &scene, std::string &error)
+{
+    Light &light = scene.light;
+    iss >> scene.name;
+    // Directional unless the type is given.
+    std::streampos afterName = iss.tellg();
+    std::string type;
+    if (iss >> type && type == "point") {
+        light.type = Light::Type::Point;
+    } else {
+        iss.clear();
+        iss.seekg(afterName);
+    }
+    Vec3f &xyz = light.type == Light::Type::Point ? light.position : light.direction;
+    if (scene.name.empty() || !readVec3(iss, xyz) ||
+        (light.type == Light::Type::Directional && xyz.magnitude() == 0.0f)) {
+        error = "expected light <name> [point] <x y z>";
+        return false;
+    }
+    std::string key;
+    while (iss >> key) {
+        std::string filter;
+        bool ok = true;
+        if (key == "center") {
+            ok = readVec3(iss, light.center);
+        } else if (key == "shadow") {
+            ok = readSize(iss, light.shadowWidth, light.shadowHeight);
+        } else if (key == "noshadow") {
+            light.castsShadows = false;
+        } else if (key == "filter") {
+            ok = (iss >> filter) && parseFilter(filter, light.shadowFilter);
+        } else if (key == "color") {
+            ok = readVec3(iss, light.color);
+        } else if (key == "range") {
+            ok = (iss >> light.range) && light.range > 0.0f;
+        } else if (key == "depth") {
+            ok = bool(iss >> scene.depthOutput);
+        } else {
+            error = "unknown light property " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value for light " + key;
+            return false;
+        }
+    }
+    if (light.type == Light::Type::Point && light.castsShadows &&
+        (light.position - light.center).magnitude() == 0.0f) {
+        error = "a shadowed point light can't sit on its center";
+        return false;
+    }
+    if (!scene.depthOutput.empty() && !light.castsShadows) {
+        error = "a light without shadows has no depth to write";
+        return false;
+    }
+    return true;
+}
+
+static bool parseCamera(std::istringstream &iss, SceneCamera &camera, std::string &error)
+{
+    if (!(iss >> camera.name >> camera.output)) {
+        error = "expected camera <name> <output.tga>";
+        return false;
+    }
+    std::string key;
+    while (iss >> key) {
+        bool ok = true;
+        if (key == "eye") {
+            ok = readVec3(iss, camera.eye);
+        } else if (key == "center") {
+            ok = readVec3(iss, camera.center);
+        } else if (key == "up") {
+            ok = readVec3(iss, camera.up);
+        } else if (key == "size") {
+            ok = readSize(iss, camera.width, camera.height);
+        } else if (key == "msaa") {
+            ok = (iss >> camera.msaaSamples) &&
+                 (camera.msaaSamples == 1 || camera.msaaSamples == 2 ||
+                  camera.msaaSamples == 4 || camera.msaaSamples == 8);
+        } else if (key == "raster") {
+            std::string raster;
+            ok = bool(iss >> raster) && parseRasterization(raster, camera.rasterization);
+        } else if (key == "prepass") {
+            camera.depthPrepass = true;
+        } else if (key == "lod") {
+            ok = (iss >> camera.lodPixelsPerFace) && camera.lodPixelsPerFace >= 0.0f;
+        } else if (key == "band") {
+            ok = (iss >> camera.bandHeight) && camera.bandHeight > 0;
+        } else if (key == "specular") {
+            std::string value;
+            ok = bool(iss >> value);
+            if (ok && value == "exact") {
+                camera.specularError = 0.0f;
+            } else if (ok) {
+                std::istringstream number(value);
+                ok = (number >> camera.specularError) && camera.specularError > 0.0f;
+            }
+        } else if (key == "format") {
+            std::string format;
+            ok = bool(iss >> format);
+            if (format == "tga") {
+                camera.format = TGAImage::TGA_RLE;
+            } else if (format == "tga-raw") {
+                camera.format = TGAImage::TGA_RAW;
+            } else if (format == "ppm") {
+                camera.format = TGAImage::PPM;
+            } else {
+                ok = false;
+            }
+        } else if (key == "depth") {
+            ok = bool(iss >> camera.depthOutput);
+        } else if (key == "light") {
+            std::string light;
+            ok = bool(iss >> light);
+            camera.lights.push_back(light);
+        } else {
+            error = "unknown camera property " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value for camera " + key;
+            return false;
+        }
+    }
+    if (camera.bandHeight > 0 && (camera.format == TGAImage::PPM || !camera.depthOutput.empty())) {
+        error = "a banded camera only writes tga";
+        return false;
+    }
+    return true;
+}
+
+bool loadScene(const std::string &filename, Scene &scene, std::string &error)
+{
+    std::ifstream in(filename.c_str());
+    if (in.fail()) {
+        error = "can't open " + filename;
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        std::istringstream iss(line);
+        std::string statement;
+        if (!(iss >> statement)) {
+            continue;
+        }
+        bool ok;
+        std::string message;
+        if (statement == "model") {
+            scene.models.emplace_back();
+            ok = parseModel(iss, scene.models.back(), message);
+        } else if (statement == "light") {
+            scene.lights.emplace_back();
+            ok = parseLight(iss, scene.lights.back(), message);
+        } else if (statement == "camera") {
+            scene.cameras.emplace_back();
+            ok = parseCamera(iss, scene.cameras.back(), message);
+        } else if (statement == "faceorder") {
+            std::string order;
+            iss >> order;
+            ok = order == "file" || order == "vertexcache";
+            message = "expected faceorder file|vertexcache";
+            scene.faceOrder = order == "file" ? Model::FaceOrder::File
+                                              : Model::FaceOrder::VertexCache;
+        } else if (statement == "textures") {
+            std::string storage;
+            iss >> storage;
+            ok = storage == "raw" || storage == "compressed";
+            message = "expected textures raw|compressed";
+            scene.compressTextures = storage == "compressed";
+        } else if (statement == "depthformat") {
+            std::string main, shadow;
+            ok = (iss >> main >> shadow) && parseDepthFormat(main, scene.zBufFormat) &&
+                 parseDepthFormat(shadow, scene.shadowFormat);
+            message = "expected depthformat <main> <shadow>, each float32|unorm24|unorm16";
+        } else if (statement == "depthlayout") {
+            std::string layout;
+            iss >> layout;
+            ok = layout == "linear" || layout == "tiled";
+            message = "expected depthlayout linear|tiled";
+            scene.depthLayout = layout == "tiled" ? DepthBuffer::Layout::Tiled
+                                                  : DepthBuffer::Layout::Linear;
+        } else {
+            ok = false;
+            message = "unknown statement " + statement;
+        }
+        if (!ok) {
+            error = filename + ":" + std::to_string(lineNumber) + ": " + message;
+            return false;
+        }
+    }
+
+    if (scene.models.empty() || scene.lights.empty() || scene.cameras.empty()) {
+        error = filename + ": needs at least one model, light and camera";
+        return false;
+    }
+    for (SceneCamera &camera : scene.cameras) {
+        if (camera.lights.empty()) {
+            for (const SceneLight &light : scene.lights) {
+                camera.lights.push_back(light.name);
+            }
+        }
+        for (const std::string &name : camera.lights) {
+            bool found = false;
+            for (const SceneLight &light : scene.lights) {
+                found = found || light.name == name;
+            }
+            if (!found) {
+                error = filename + ": camera " + camera.name + " uses unknown light " + name;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static double millisSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+bool renderScene(const Scene &scene, int workers)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Load each distinct asset once, however many models use it. Streamed
+    // ones only load their textures, and map their mesh.
+    std::map<std::string, std::unique_ptr<Model>> assets;
+    std::map<std::string, std::unique_ptr<Model>> streamTextures;
+    std::map<std::string, std::unique_ptr<MeshStream>> streams;
+    for (const SceneModel &model : scene.models) {
+        if (model.stream ? streams.count(model.path) : assets.count(model.path)) {
+            continue;
+        }
+        if (!Model::available(model.path)) {
+            std::cerr << "can't load model " << model.path << "\n";
+            return false;
+        }
+        Model *loaded;
+        if (!model.stream) {
+            loaded = new Model(model.path, 4, scene.faceOrder);
+            assets[model.path].reset(loaded);
+        } else {
+            std::unique_ptr<MeshStream> stream(new MeshStream());
+            if (!stream->open(model.path + ".mesh") && !stream->open(model.path + ".obj")) {
+                std::cerr << "can't stream model " << model.path << "\n";
+                return false;
+            }
+            streams[model.path] = std::move(stream);
+            loaded = new Model(model.path, Model::TexturesOnly());
+            streamTextures[model.path].reset(loaded);
+        }
+        if (scene.compressTextures) {
+            loaded->compressTextures();
+        }
+    }
+    std::vector<SceneObject> objects;
+    for (const SceneModel &model : scene.models) {
+        if (model.stream) {
+            objects.emplace_back(streamTextures[model.path].get(), model.transform,
+                                 streams[model.path].get());
+        } else {
+            objects.emplace_back(assets[model.path].get(), model.transform);
+        }
+    }
+    std::cerr << "loaded " << assets.size() + streams.size() << " assets in "
+              << millisSince(start) << "ms\n";
+    for (const auto &asset : assets) {
+        std::cerr << "  " << asset.first << ": " << asset.second->numFaces() << " faces, "
+                  << "vertex cache miss ratio " << asset.second->cacheMissRatio() << ", "
+                  << asset.second->textureBytes() / 1024 << "KB of textures\n";
+    }
+    for (const auto &stream : streams) {
+        std::cerr << "  " << stream.first << ": " << stream.second->numFaces()
+                  << " faces, streamed, "
+                  << streamTextures[stream.first]->textureBytes() / 1024 << "KB of textures\n";
+    }
+
+    // Only the lights some camera uses get a shadow pass, and each gets
+    // exactly one, shared by all its cameras.
+    std::vector<Light> lights;
+    std::vector<std::string> names;
+    for (const SceneLight &light : scene.lights) {
+        for (const SceneCamera &camera : scene.cameras) {
+            if (std::find(camera.lights.begin(), camera.lights.end(), light.name) != camera.lights.end()) {
+                lights.push_back(light.light);
+                names.push_back(light.name);
+                break;
+            }
+        }
+    }
+    RenderSettings shadowSettings;
+    shadowSettings.threads = workers;
+    shadowSettings.shadowFormat = scene.shadowFormat;
+    shadowSettings.depthLayout = scene.depthLayout;
+    std::vector<LightShadow> shadows = renderShadowMaps(objects, shadowSettings, lights);
+    int shadowed = std::count_if(shadows.begin(), shadows.end(),
+                                 [](const LightShadow &shadow) { return bool(shadow.map); });
+    std::cerr << "rendered " << shadowed << " shadow maps at " << millisSince(start) << "ms\n";
+    bool ok = true;
+    for (const SceneLight &light : scene.lights) {
+        size_t l = std::find(names.begin(), names.end(), light.name) - names.begin();
+        if (light.depthOutput.empty()) {
+            continue;
+        }
+        if (l == names.size()) {
+            std::cerr << "light " << light.name << " has no shadow map to write, as no camera uses it\n";
+            ok = false;
+        } else if (!shadows[l].map->depthBuffer().writePfm(light.depthOutput.c_str())) {
+            ok = false;
+        }
+    }
+
+    // Passes run side by side share the workers between them.
+    int passThreads = std::max(1, workers / std::max<int>(1, scene.cameras.size()));
+    std::vector<char> written(scene.cameras.size(), 0);
+    parallelFor(0, scene.cameras.size(), [&](int c) {
+        const SceneCamera &camera = scene.cameras[c];
+        std::vector<Light> cameraLights;
+        std::vector<LightShadow> cameraShadows;
+        for (const std::string &name : camera.lights) {
+            size_t l = std::find(names.begin(), names.end(), name) - names.begin();
+            cameraLights.push_back(lights[l]);
+            cameraShadows.push_back(shadows[l]);
+        }
+
+        RenderSettings settings;
+        settings.threads = passThreads;
+        settings.width = camera.width;
+        settings.height = camera.height;
+        settings.msaaSamples = camera.msaaSamples;
+        settings.zBufFormat = scene.zBufFormat;
+        settings.depthLayout = scene.depthLayout;
+        settings.rasterization = camera.rasterization;
+        settings.depthPrepass = camera.depthPrepass;
+        settings.lodPixelsPerFace = camera.lodPixelsPerFace;
+        settings.specularError = camera.specularError;
+        settings.eye = camera.eye;
+        settings.center = camera.center;
+        settings.up = camera.up;
+
+        if (camera.bandHeight > 0) {
+            TGAWriter out;
+            written[c] = out.open(camera.output.c_str(), camera.width, camera.height, TGAImage::RGB,
+                                  camera.format == TGAImage::TGA_RLE) &&
+                         renderMainPassBanded(objects, settings, cameraLights, cameraShadows,
+                                              camera.bandHeight, out) &&
+                         out.close();
+            return;
+        }
+        TGAImage image;
+        DepthBuffer depth(0, 0);
+        bool dumpDepth = !camera.depthOutput.empty();
+        renderMainPass(objects, settings, cameraLights, cameraShadows, image,
+                       dumpDepth ? &depth : nullptr);
+        written[c] = image.write_file(camera.output.c_str(), camera.format) &&
+                     (!dumpDepth || depth.writePfm(camera.depthOutput.c_str()));
+    }, workers);
+    std::cerr << "rendered " << scene.cameras.size() << " cameras at " << millisSince(start) << "ms\n";
+
+    for (size_t c = 0; c < written.size(); c++) {
+        if (!written[c]) {
+            std::cerr << "can't write " << scene.cameras[c].output << "\n";
+            ok = false;
+        }
+    }
+    // A damaged streamed mesh was only partly drawn, in every camera.
+    for (const auto &stream : streams) {
+        if (stream.second->failed()) {
+            std::cerr << "streamed model " << stream.first << " is damaged\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,114 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <string>
+#include <vector>
+
+#include "tgaimage.h"
+#include "geometry.h"
+#include "shadowmap.h"
+#include "model.h"
+#include "lights.h"
+#include "gl.h"
+#include "depthbuffer.h"
+
+// A batch of renders described in a text file, one statement per line and
+// '#' starting a comment:
+//
+//   model  <name> <path> [translate x y z] [scale s | scale x y z]
+//                        [rotate x y z degrees] ... [stream]
+//   light  <name> [point] <x y z> [center x y z] [shadow W H | noshadow]
+//                         [filter point|pcf|variance] [color r g b]
+//                         [range r] [depth file.pfm]
+//   camera <name> <output.tga> [eye x y z] [center x y z] [up x y z]
+//                              [size W H] [msaa n] [raster float|fixed]
+//                              [prepass] [lod pixels] [band rows]
+//                              [specular exact|error]
+//                              [format tga|tga-raw|ppm] [depth file.pfm]
+//                              [light name] ...
+//   faceorder   file|vertexcache
+//   textures    raw|compressed
+//   depthformat float32|unorm24|unorm16 float32|unorm24|unorm16
+//   depthlayout linear|tiled
+//
+// Model transforms apply in the order written. A light's x y z is its
+// direction, or its position for a point light. Every camera sees every
+// model, lit by the lights it names or, if it names none, by all of them.
+// A camera's msaa sets its samples per pixel (default 1), and raster its
+// Rasterization (default float). prepass lays down a camera's depth before
+// shading (see RenderSettings::depthPrepass), and lod draws each model at
+// the coarsest level of detail leaving it that many pixels per face (see
+// RenderSettings::lodPixelsPerFace; the default, 0, is full detail). A
+// camera with a band renders and writes its image that many rows at a time
+// (see renderMainPassBanded()), for images too large to hold. specular
+// with an error looks its highlights up in a SpecularTable accurate to
+// that error rather than computing them exactly, the default. format picks
+// the camera's TGAImage::FileFormat (default tga, run-length coded), and
+// depth on a camera or a shadowed light also writes its depth buffer as a
+// PFM file; banded cameras take neither. faceorder picks how every model's
+// faces are ordered (see Model::FaceOrder) and defaults to vertexcache. A
+// stream model is drawn out of core from <path>.mesh, or <path>.obj if
+// there is no .mesh, with drawStream(); it has no levels of detail and
+// keeps its faces in file order. textures compressed keeps every model's
+// maps block-compressed (see Model::compressTextures()); the default is
+// raw. depthformat picks the depth storage of the cameras and of the
+// shadow maps, and depthlayout that of both (see RenderSettings); the
+// defaults are float32 and linear.
+struct SceneModel
+{
+    std::string name;
+    std::string path;
+    Matrix4x4 transform = Matrix4x4::identity();
+    bool stream = false;
+};
+
+struct SceneLight
+{
+    std::string name;
+    Light light;
+    std::string depthOutput; // empty for none
+};
+
+struct SceneCamera
+{
+    std::string name;
+    std::string output;
+    Vec3f eye = Vec3f(1, 1, 3);
+    Vec3f center = Vec3f(0, 0, 0);
+    Vec3f up = Vec3f(0, 1, 0);
+    int width = 1600;
+    int height = 1600;
+    int msaaSamples = 1;
+    Rasterization rasterization = Rasterization::Float;
+    bool depthPrepass = false;
+    float lodPixelsPerFace = 0.0f;
+    int bandHeight = 0; // 0 renders the whole image at once
+    float specularError = 0.0f; // 0 for exact highlights
+    TGAImage::FileFormat format = TGAImage::TGA_RLE;
+    std::string depthOutput; // empty for none
+    std::vector<std::string> lights;
+};
+
+struct Scene
+{
+    std::vector<SceneModel> models;
+    std::vector<SceneLight> lights;
+    std::vector<SceneCamera> cameras;
+    Model::FaceOrder faceOrder = Model::FaceOrder::VertexCache;
+    bool compressTextures = false;
+    DepthBuffer::Format zBufFormat = DepthBuffer::Format::Float32;
+    DepthBuffer::Format shadowFormat = DepthBuffer::Format::Float32;
+    DepthBuffer::Layout depthLayout = DepthBuffer::Layout::Linear;
+};
+
+// Parses a scene file. On failure returns false and describes the problem,
+// with its line number, in error.
+bool loadScene(const std::string &filename, Scene &scene, std::string &error);
+
+// Renders every camera of the scene and writes its output file. Each model
+// is loaded once, each light's shadow map is rendered once and shared by
+// all the cameras using it, and independent passes run on `workers`
+// threads. Returns false if anything failed to load or write.
+bool renderScene(const Scene &scene, int workers);
+
+#endif // __SCENE_H__
@@ -0,0 +1,401 @@
+#include <map>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <exception>
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+
+#include "server.h"
+#include "model.h"
+#include "renderer.h"
+#include "parallel.h"
+
+// Loaded models, shared by every job. The first job to ask for a model
+// loads it; concurrent jobs asking for the same one wait on that load.
+class ModelCache
+{
+public:
+    std::shared_ptr<const Model> get(const std::string &path) {
+        std::promise<std::shared_ptr<const Model>> promise;
+        std::shared_future<std::shared_ptr<const Model>> future;
+        bool loader = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = models.find(path);
+            if (found == models.end()) {
+                future = promise.get_future().share();
+                models[path] = future;
+                loader = true;
+            } else {
+                future = found->second;
+            }
+        }
+        if (loader) {
+            std::shared_ptr<const Model> model;
+            try {
+                if (Model::available(path)) {
+                    model = std::make_shared<Model>(path);
+                }
+                promise.set_value(model);
+            } catch (...) {
+                // Jobs waiting on this load get the same exception.
+                promise.set_exception(std::current_exception());
+            }
+            if (!model) {
+                // Don't cache the failure, the files may show up later.
+                std::lock_guard<std::mutex> lock(mutex);
+                models.erase(path);
+            }
+        }
+        return future.get();
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_future<std::shared_ptr<const Model>>> models;
+};
+
+// Most depth and colour samples a job may ask for, in the image (pixels
+// times msaa) or the shadow map, so no one job can exhaust the daemon's
+// memory: 64M samples take 512MB.
+static const int64_t maxJobSamples = int64_t(64) << 20;
+
+// Longest job line accepted; a client sending more without a newline is
+// cut off.
+static const size_t maxJobLine = 64 * 1024;
+
+struct RenderJob
+{
+    std::vector<std::string> models;
+    RenderSettings settings;
+    TGAImage::FileFormat format = TGAImage::TGA_RLE;
+};
+
+static bool parseVec3(const std::string &text, Vec3f &v)
+{
+    char comma1, comma2;
+    std::istringstream iss(text);
+    return (iss >> v.x >> comma1 >> v.y >> comma2 >> v.z) && comma1 == ',' && comma2 == ',';
+}
+
+static bool parseSize(const std::string &text, int &width, int &height)
+{
+    char x;
+    std::istringstream iss(text);
+    return (iss >> width >> x >> height) && x == 'x' &&
+           width > 0 && height > 0 && width <= 32767 && height <= 32767;
+}
+
+static bool parseDepthFormat(const std::string &name, DepthBuffer::Format &format)
+{
+    if (name == "float32") {
+        format = DepthBuffer::Format::Float32;
+    } else if (name == "unorm24") {
+        format = DepthBuffer::Format::Unorm24;
+    } else if (name == "unorm16") {
+        format = DepthBuffer::Format::Unorm16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseJob(const std::string &line, RenderJob &job, std::string &error)
+{
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq);
+        std::string value = token.substr(eq + 1);
+        RenderSettings &s = job.settings;
+        bool ok = true;
+        if (key == "models") {
+            std::istringstream paths(value);
+            std::string path;
+            while (std::getline(paths, path, ',')) {
+                if (!path.empty()) {
+                    job.models.push_back(path);
+                }
+            }
+        } else if (key == "eye") {
+            ok = parseVec3(value, s.eye);
+        } else if (key == "center") {
+            ok = parseVec3(value, s.center);
+        } else if (key == "up") {
+            ok = parseVec3(value, s.up);
+        } else if (key == "light") {
+            ok = parseVec3(value, s.light);
+        } else if (key == "size") {
+            ok = parseSize(value, s.width, s.height);
+        } else if (key == "shadow") {
+            ok = parseSize(value, s.shadowWidth, s.shadowHeight);
+        } else if (key == "msaa") {
+            s.msaaSamples = atoi(value.c_str());
+            ok = s.msaaSamples == 1 || s.msaaSamples == 2 ||
+                 s.msaaSamples == 4 || s.msaaSamples == 8;
+        } else if (key == "raster") {
+            if (value == "float") {
+                s.rasterization = Rasterization::Float;
+            } else if (value == "fixed") {
+                s.rasterization = Rasterization::FixedPoint;
+            } else {
+                ok = false;
+            }
+        } else if (key == "depthformat") {
+            size_t comma = value.find(',');
+            ok = comma != std::string::npos &&
+                 parseDepthFormat(value.substr(0, comma), s.zBufFormat) &&
+                 parseDepthFormat(value.substr(comma + 1), s.shadowFormat);
+        } else if (key == "depthlayout") {
+            ok = value == "linear" || value == "tiled";
+            s.depthLayout = value == "tiled" ? DepthBuffer::Layout::Tiled
+                                             : DepthBuffer::Layout::Linear;
+        } else if (key == "lod") {
+            std::istringstream number(value);
+            ok = (number >> s.lodPixelsPerFace) && number.eof() && s.lodPixelsPerFace >= 0.0f;
+        } else if (key == "prepass") {
+            ok = value == "on" || value == "off";
+            s.depthPrepass = value == "on";
+        } else if (key == "filter") {
+            if (value == "point") {
+                s.shadowFilter = ShadowMap::Filter::Point;
+            } else if (value == "pcf") {
+                s.shadowFilter = ShadowMap::Filter::PCF;
+            } else if (value == "variance") {
+                s.shadowFilter = ShadowMap::Filter::Variance;
+            } else {
+                ok = false;
+            }
+        } else if (key == "format") {
+            if (value == "tga") {
+                job.format = TGAImage::TGA_RLE;
+            } else if (value == "tga-raw") {
+                job.format = TGAImage::TGA_RAW;
+            } else if (value == "ppm") {
+                job.format = TGAImage::PPM;
+            } else {
+                ok = false;
+            }
+        } else {
+            error = "unknown key " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value for " + key + ": " + value;
+            return false;
+        }
+    }
+    if (job.models.empty()) {
+        error = "no models given";
+        return false;
+    }
+    const RenderSettings &s = job.settings;
+    if (int64_t(s.width) * s.height * s.msaaSamples > maxJobSamples ||
+        int64_t(s.shadowWidth) * s.shadowHeight > maxJobSamples) {
+        error = "job too large";
+        return false;
+    }
+    return true;
+}
+
+static bool sendAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool sendLine(int fd, const std::string &line)
+{
+    std::string text = line + "\n";
+    return sendAll(fd, text.data(), text.size());
+}
+
+static double millisSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Renders one job and answers it. Returns false if the client went away.
+static bool renderJob(int fd, const std::string &line, ModelCache &cache, int threads)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    RenderJob job;
+    std::string error;
+    if (!parseJob(line, job, error)) {
+        return sendLine(fd, "ERR " + error);
+    }
+    job.settings.threads = threads;
+
+    // Hold the shared pointers for the duration of the render.
+    std::vector<std::shared_ptr<const Model>> held;
+    std::vector<SceneObject> objects;
+    for (const std::string &path : job.models) {
+        std::shared_ptr<const Model> model = cache.get(path);
+        if (!model) {
+            return sendLine(fd, "ERR can't load model " + path);
+        }
+        held.push_back(model);
+        objects.push_back(model.get());
+    }
+    double loadMs = millisSince(start);
+
+    TGAImage image;
+    render(objects, job.settings, image);
+    double renderMs = millisSince(start) - loadMs;
+
+    std::vector<unsigned char> payload;
+    image.encode(payload, job.format);
+    double totalMs = millisSince(start);
+    double encodeMs = totalMs - loadMs - renderMs;
+
+    std::ostringstream header;
+    header.setf(std::ios::fixed);
+    header.precision(1);
+    header << "OK " << payload.size()
+           << " load=" << loadMs << " render=" << renderMs
+           << " encode=" << encodeMs << " total=" << totalMs;
+    std::cerr << "job: " << line << " -> " << header.str() << "\n";
+    return sendLine(fd, header.str()) && sendAll(fd, reinterpret_cast<const char *>(payload.data()), payload.size());
+}
+
+// A job that fails, say by running out of memory, is answered with ERR
+// rather than taking the whole daemon down.
+static bool runJob(int fd, const std::string &line, ModelCache &cache, int threads)
+{
+    try {
+        return renderJob(fd, line, cache, threads);
+    } catch (const std::exception &e) {
+        std::cerr << "job: " << line << " -> " << e.what() << "\n";
+        return sendLine(fd, std::string("ERR ") + e.what());
+    }
+}
+
+static void handleConnection(int fd, ModelCache &cache, int threads)
+{
+    std::string pending;
+    char buffer[4096];
+    for (;;) {
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty() && !runJob(fd, line, cache, threads)) {
+                close(fd);
+                return;
+            }
+        }
+        if (pending.size() > maxJobLine) {
+            sendLine(fd, "ERR line too long");
+            break;
+        }
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        pending.append(buffer, received);
+    }
+    close(fd);
+}
+
+// Removes a socket left at path by an earlier run. Anything else there is
+// left alone, so a mistyped path can't destroy a file; false if so.
+static bool removeStaleSocket(const std::string &path)
+{
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0) {
+        return errno == ENOENT;
+    }
+    if (!S_ISSOCK(info.st_mode)) {
+        std::cerr << path << " exists and isn't a socket\n";
+        return false;
+    }
+    unlink(path.c_str());
+    return true;
+}
+
+int serve(const std::string &socketPath, int workers)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "socket path too long: " << socketPath << "\n";
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "can't create socket: " << strerror(errno) << "\n";
+        return 1;
+    }
+    if (!removeStaleSocket(socketPath)) {
+        close(listener);
+        return 1;
+    }
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, 64) < 0) {
+        std::cerr << "can't listen on " << socketPath << ": " << strerror(errno) << "\n";
+        close(listener);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::cerr << "serving on " << socketPath << " with " << workers << " workers\n";
+
+    // Each connection is served by one worker; jobs on a connection run in
+    // order, jobs on different connections run concurrently. Each job's
+    // passes get an even share of the cores, so a full pool doesn't start
+    // more threads than there are cores.
+    ModelCache cache;
+    ThreadPool pool(workers);
+    int jobThreads = std::max(1, workerCount() / std::max(1, workers));
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        pool.submit([fd, &cache, jobThreads]() { handleConnection(fd, cache, jobThreads); });
+    }
+    close(listener);
+    removeStaleSocket(socketPath);
+    return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+
+// Render daemon listening on a Unix domain socket. Models and their
+// textures are loaded on first use and kept in memory for later jobs, so a
+// job only pays for rendering and encoding.
+//
+// A client sends one job per line, any number of lines per connection:
+//
+//   models=obj/african_head,obj/african_head_eye_inner eye=1,1,3 size=800x800
+//
+// Recognised keys, all optional except models:
+//   models  comma-separated asset paths, as passed to Model's constructor
+//   eye, center, up, light   x,y,z vectors (see RenderSettings)
+//   size, shadow             WxH of the image and of the shadow map
+//   msaa                     samples per pixel: 1 (the default), 2, 4 or 8
+//   raster                   rasterization: float or fixed
+//   depthformat              main,shadow depth storage, each float32 (the
+//                            default), unorm24 or unorm16
+//   depthlayout              linear (the default) or tiled
+//   lod                      pixels per face to pick levels of detail by,
+//                            0 (the default) for full detail
+//   prepass                  on or off (the default): lay down depth before
+//                            shading (see RenderSettings::depthPrepass)
+//   filter                   shadow filter: point, pcf or variance
+//   format                   payload encoding: tga (run-length coded, the
+//                            default), tga-raw or ppm
+//
+// Each job is answered with a single header line followed by the payload:
+//
+//   OK <bytes> load=<ms> render=<ms> encode=<ms> total=<ms>\n<bytes of image>
+//   ERR <message>\n
+//
+// Job lines are at most 64KB; a longer one is answered with "ERR line too
+// long" and its connection closed. Jobs whose image (pixels times msaa) or
+// shadow map needs more than 64M samples are refused, as is any job that
+// fails while rendering.
+//
+// Timings run from the moment the job line arrived.
+int serve(const std::string &socketPath, int workers);
+
+#endif // __SERVER_H__
@@ -0,0 +1,239 @@
+#ifndef __SHADERS_H__
+#define __SHADERS_H__
+
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+#include "tgaimage.h"
+#include "model.h"
+#include "geometry.h"
+#include "gl.h"
+#include "shadowmap.h"
+#include "lights.h"
+
+// Shaders read the bound model and transforms from the context they were
+// created for, so each concurrent render needs its own set.
+
+// A light as PhongShader sees it, in its shading space.
+struct ShadedLight
+{
+    Light::Type type;
+    Vec3f direction;     // towards a directional light
+    Vec3f position;      // of a point light
+    Vec3f worldPosition; // of a point light, for its falloff
+    float range;
+    Vec3f color;
+    const ShadowMap *shadowMap; // null if the light casts no shadows
+    Matrix4x4 toShadow;         // shading space to shadow map screen space
+};
+
+struct PhongShader : public IShader
+{
+    const RenderContext *ctx;
+
+    Matrix2x3 vertexUVs;
+    Matrix3x3 vertexNormals;
+    Matrix3x3 vertexCoords;
+    Vec3f vertexInvW; // 1/w of each corner before the perspective divide
+
+    // Per-triangle setup (see setupTriangle()). UVs and normals are linear
+    // in the eye's space rather than on screen, so they are interpolated
+    // as attribute/w and divided by the interpolated 1/w per fragment.
+    Matrix2x3 uvsOverW;
+    Matrix3x3 normalsOverW;
+    Vec3f faceNormal;
+    Vec3f faceTangent, faceBitangent; // along increasing u and v, in the face
+
+    Matrix4x4 M;
+    Matrix4x4 MIT;
+    Matrix4x4 viewToWorld;
+    std::vector<ShadedLight> lights;
+    const LightTiles *lightTiles;
+    const SpecularTable *specular = nullptr; // null for exact powf()
+
+    PhongShader(const RenderContext &ctx) : ctx(&ctx) { }
+
+    virtual std::unique_ptr<IShader> clone(const RenderContext &other) const {
+        PhongShader *copy = new PhongShader(*this);
+        copy->ctx = &other;
+        return std::unique_ptr<IShader>(copy);
+    }
+
+    virtual void setTransform(const Matrix4x4 &objectToWorld) {
+        M = ctx->projection * ctx->modelview * objectToWorld;
+        MIT = M.inverseTranspose();
+    }
+
+    virtual Vec3f vertex(int faceIndex, int vertexIndex) {
+        // Fetch vertex data from the model or streamed chunk.
+        Vec3f vertex = ctx->getVertex(faceIndex, vertexIndex);
+        Vec3f normal = ctx->getVertexNormal(faceIndex, vertexIndex);
+        Vec2f uv = ctx->getTextureVertex(faceIndex, vertexIndex);
+
+        // Transform the vertex and normal to our perspective.
+        Vec4f clip = M * Vec4f(vertex, 1);
+        float invW = 1.0f / clip.d;
+        vertex = Vec3f(clip.a, clip.b, clip.c) * invW;
+        normal = MIT * normal;
+
+        // Record data needed by the fragment shader.
+        vertexCoords.setCol(vertexIndex, vertex);
+        vertexNormals.setCol(vertexIndex, normal);
+        vertexUVs.setCol(vertexIndex, uv);
+        vertexInvW[vertexIndex] = invW;
+
+        // Return the position on the display where the vertex projects.
+        return ctx->viewport * vertex;
+    }
+
+    virtual void setupTriangle() {
+        for (int v = 0; v < 3; v++) {
+            uvsOverW.setCol(v, vertexUVs.getCol(v) * vertexInvW[v]);
+            normalsOverW.setCol(v, vertexNormals.getCol(v) * vertexInvW[v]);
+        }
+
+        // The tangent and bitangent solve e1.t = du1, e2.t = du2 (and the
+        // same for v) within the face. fragment() needs them perpendicular
+        // to the interpolated normal instead, which only means sliding them
+        // along the face normal.
+        Vec3f e1 = vertexCoords.getCol(1) - vertexCoords.getCol(0);
+        Vec3f e2 = vertexCoords.getCol(2) - vertexCoords.getCol(0);
+        faceNormal = e1 ^ e2;
+        Matrix3x3 A;
+        A.setRow(0, e1);
+        A.setRow(1, e2);
+        A.setRow(2, faceNormal);
+        Matrix3x3 AI = A.inverse();
+        Vec2f uv0 = vertexUVs.getCol(0);
+        Vec2f uv1 = vertexUVs.getCol(1);
+        Vec2f uv2 = vertexUVs.getCol(2);
+        faceTangent = AI * Vec3f(uv1.u-uv0.u, uv2.u-uv0.u, 0);
+        faceBitangent = AI * Vec3f(uv1.v-uv0.v, uv2.v-uv0.v, 0);
+    }
+
+    virtual bool fragment(const Vec3f &barycentricCoords, TGAColor &color) {
+        // Screen-space barycentrics interpolate the projected position
+        // directly; the other attributes need the perspective divide.
+        float invW = vertexInvW * barycentricCoords;
+        Vec2f uv = (uvsOverW * barycentricCoords) * (1.0f / invW);
+        TGAColor textureColor = ctx->model->getTextureColor(uv);
+        // (Normalizing makes the divide by invW unnecessary here.)
+        Vec3f objectSpaceNormal = (normalsOverW * barycentricCoords).normalized();
+        Vec3f tangentSpaceNormal = ctx->model->getTangentNormal(uv);
+
+        Vec3f globalCoord = (vertexCoords * barycentricCoords);
+
+        float slide = 1.0f / (objectSpaceNormal * faceNormal);
+        Vec3f i = faceTangent - faceNormal * ((objectSpaceNormal * faceTangent) * slide);
+        Vec3f j = faceBitangent - faceNormal * ((objectSpaceNormal * faceBitangent) * slide);
+        Matrix3x3 tangentBasis;
+        tangentBasis.setCol(0, i.normalized());
+        tangentBasis.setCol(1, j.normalized());
+        tangentBasis.setCol(2, objectSpaceNormal);
+        Vec3f normal = (tangentBasis * tangentSpaceNormal).normalized();
+
+        Vec3i specularPower = ctx->model->getSpecularPower(uv);
+        float magicPowIncr = 5;
+        for (int i = 0; i < 3; i++) {
+            specularPower[i] += magicPowIncr;
+        }
+
+        // Only the lights that can reach this pixel's tile.
+        Vec3f lighting;
+        Vec3f screenCoord = ctx->viewport * globalCoord;
+        Vec3f worldCoord;
+        bool haveWorldCoord = false;
+        const int *last = lightTiles->last(int(screenCoord.x), int(screenCoord.y));
+        for (const int *l = lightTiles->first(int(screenCoord.x), int(screenCoord.y)); l != last; l++) {
+            const ShadedLight &light = lights[*l];
+            Vec3f towardsLight = light.direction;
+            float attenuation = 1.0f;
+            if (light.type == Light::Type::Point) {
+                if (!haveWorldCoord) {
+                    worldCoord = viewToWorld * globalCoord;
+                    haveWorldCoord = true;
+                }
+                float distance = (light.worldPosition - worldCoord).magnitude();
+                if (distance >= light.range) {
+                    continue;
+                }
+                float falloff = 1.0f - distance / light.range;
+                attenuation = falloff * falloff;
+                towardsLight = (light.position - globalCoord).normalized();
+            }
+
+            float shadow = 1.0f;
+            if (light.shadowMap) {
+                shadow = 0.3f + 0.7f*light.shadowMap->visibility(light.toShadow * globalCoord);
+            }
+
+            // Both are unit length, but rounding can still carry their dot
+            // product just past 1.
+            float diffuseIntensity = std::min(std::max(normal * towardsLight, 0.0f), 1.0f);
+
+            Vec3f reflection = (-towardsLight + normal*(normal*towardsLight)*2).normalized();
+            float highlight = std::max(reflection.z, 0.0f);
+            // Channel i of the colours is blue, green, red. Most specular
+            // maps give every channel the same power, so only work out
+            // the ones that differ.
+            Vec3f specularIntensity;
+            for (int i = 0; i < 3; i++) {
+                if (i > 0 && specularPower[i] == specularPower[i - 1]) {
+                    specularIntensity[i] = specularIntensity[i - 1];
+                } else if (specular) {
+                    specularIntensity[i] = specular->pow(highlight, specularPower[i]);
+                } else {
+                    specularIntensity[i] = powf(highlight, specularPower[i]);
+                }
+                lighting[i] += shadow * (0.8f*diffuseIntensity + 0.6f*specularIntensity[i]) *
+                               light.color.raw[2 - i] * attenuation;
+            }
+        }
+
+        float ambient = 0.2f * ctx->model->getAmbientOcclusion(uv);
+        for (int i = 0; i < 3; i++) {
+            float intensity = ambient + lighting[i];
+            color[i] = std::min(textureColor[i] * intensity, 255.0f);
+        }
+
+        // Specify not to discard this fragment.
+        return false;
+    }
+};
+
+struct DepthShader : public IShader
+{
+    const RenderContext *ctx;
+    Matrix3x3 vertexCoords;
+    Matrix4x4 M;
+
+    DepthShader(const RenderContext &ctx) : ctx(&ctx) { }
+
+    virtual std::unique_ptr<IShader> clone(const RenderContext &other) const {
+        DepthShader *copy = new DepthShader(*this);
+        copy->ctx = &other;
+        return std::unique_ptr<IShader>(copy);
+    }
+
+    virtual void setTransform(const Matrix4x4 &objectToWorld) {
+        M = ctx->viewport * ctx->projection * ctx->modelview * objectToWorld;
+    }
+
+    virtual Vec3f vertex(int faceIndex, int vertexIndex) {
+        Vec3f vertex = ctx->getVertex(faceIndex, vertexIndex);
+        vertex = M * vertex;
+        vertexCoords.setCol(vertexIndex, vertex);
+        return vertex;
+    }
+
+    virtual bool fragment(const Vec3f& barycentricCoords, TGAColor &color) {
+        Vec3f p = vertexCoords * barycentricCoords;
+        color = TGAColor(255, 255, 255) * (p.z / depthRange);
+        return false;
+    }
+};
+
+#endif // __SHADERS_H__
@@ -0,0 +1,113 @@
+#include <vector>
+#include <algorithm>
+
+#include "shadowmap.h"
+
+ShadowMap::ShadowMap(int width, int height,
+                     DepthBuffer::Format format,
+                     DepthBuffer::Layout layout)
+    : width(width), height(height), depth(width, height, format, layout)
+{
+}
+
+void ShadowMap::clear()
+{
+    depth.clear();
+    sumDepth.clear();
+    sumDepthSq.clear();
+}
+
+void ShadowMap::prepare()
+{
+    if (filter != Filter::Variance) {
+        return;
+    }
+
+    int stride = width + 1;
+    sumDepth.assign(stride*(height + 1), 0.0);
+    sumDepthSq.assign(stride*(height + 1), 0.0);
+    for (int y = 0; y < height; y++) {
+        double rowSum = 0.0;
+        double rowSumSq = 0.0;
+        for (int x = 0; x < width; x++) {
+            // Texels nothing was drawn to sit at the far end of the range.
+            double z = std::max(depth.get(x, y), 0.0f);
+            rowSum += z;
+            rowSumSq += z*z;
+            int i = (y + 1)*stride + x + 1;
+            sumDepth[i] = sumDepth[i - stride] + rowSum;
+            sumDepthSq[i] = sumDepthSq[i - stride] + rowSumSq;
+        }
+    }
+}
+
+float ShadowMap::visibility(const Vec3f &p) const
+{
+    int x = int(p.x);
+    int y = int(p.y);
+    if (x < 0 || y < 0 || x >= width || y >= height) {
+        return 1.0f;
+    }
+    float z = p.z + bias;
+    switch (filter) {
+    case Filter::PCF:
+        return pcfVisibility(x, y, z);
+    case Filter::Variance:
+        return varianceVisibility(x, y, z);
+    case Filter::Point:
+    default:
+        return pointVisibility(x, y, z);
+    }
+}
+
+float ShadowMap::pointVisibility(int x, int y, float z) const
+{
+    return depth.get(x, y) > z ? 0.0f : 1.0f;
+}
+
+float ShadowMap::pcfVisibility(int x, int y, float z) const
+{
+    int minX = std::max(x - radius, 0);
+    int maxX = std::min(x + radius, width - 1);
+    int minY = std::max(y - radius, 0);
+    int maxY = std::min(y + radius, height - 1);
+
+    // Walk the window row by row, which stays within one tile row for
+    // tiled buffers and one contiguous run for linear ones.
+    int lit = 0;
+    for (int row = minY; row <= maxY; row++) {
+        for (int col = minX; col <= maxX; col++) {
+            lit += depth.get(col, row) <= z;
+        }
+    }
+    return float(lit) / ((maxX - minX + 1)*(maxY - minY + 1));
+}
+
+float ShadowMap::varianceVisibility(int x, int y, float z) const
+{
+    assert(!sumDepth.empty()); // prepare() must run before lookups
+
+    int minX = std::max(x - radius, 0);
+    int maxX = std::min(x + radius, width - 1) + 1;
+    int minY = std::max(y - radius, 0);
+    int maxY = std::min(y + radius, height - 1) + 1;
+    int stride = width + 1;
+    auto boxSum = [&](const std::vector<double> &table) {
+        return table[maxY*stride + maxX] - table[minY*stride + maxX]
+             - table[maxY*stride + minX] + table[minY*stride + minX];
+    };
+
+    double count = (maxX - minX)*(maxY - minY);
+    double mean = boxSum(sumDepth) / count;
+    double meanSq = boxSum(sumDepthSq) / count;
+    if (mean <= z) {
+        return 1.0f;
+    }
+
+    // Occluders sit at larger depths, so the receiver is (partially) in
+    // shadow when it lies below the mean. Chebyshev's inequality bounds the
+    // fraction of the window that doesn't occlude it.
+    double variance = std::max(meanSq - mean*mean, double(minVariance));
+    double d = mean - z;
+    return float(variance / (variance + d*d));
+}
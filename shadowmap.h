@@ -0,0 +1,62 @@
+#ifndef __SHADOWMAP_H__
+#define __SHADOWMAP_H__
+
+#include <vector>
+
+#include "geometry.h"
+#include "depthbuffer.h"
+
+// Depth buffer rendered from a light's point of view, plus whatever lookup
+// structure the chosen filter needs. The map has its own resolution, so it
+// is rendered with its own viewport rather than the output image's.
+class ShadowMap
+{
+public:
+    enum class Filter {
+        Point,    // single depth comparison
+        PCF,      // percentage of (2r+1)^2 depth comparisons that pass
+        Variance, // Chebyshev bound from box-filtered depth moments, O(1)
+    };
+
+    ShadowMap(int width, int height,
+              DepthBuffer::Format format=DepthBuffer::Format::Float32,
+              DepthBuffer::Layout layout=DepthBuffer::Layout::Linear);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // The depth pass renders straight into this buffer.
+    DepthBuffer &depthBuffer() { return depth; }
+    const DepthBuffer &depthBuffer() const { return depth; }
+    void clear();
+
+    // Builds the summed-area tables used by Filter::Variance. Call once the
+    // depth pass has finished and before any lookups.
+    void prepare();
+
+    // Fraction of light reaching p, in [0, 1]. p is in shadow map screen
+    // space, i.e. after the depth pass's viewport transform.
+    float visibility(const Vec3f &p) const;
+
+    Filter filter = Filter::PCF;
+    int radius = 1;           // filter half-width in texels
+    float bias = 43.34f;      // fights z-fighting/acne, in depth units
+    float minVariance = 1.0f; // keeps variance filtering stable on flat areas
+
+private:
+    float pointVisibility(int x, int y, float z) const;
+    float pcfVisibility(int x, int y, float z) const;
+    float varianceVisibility(int x, int y, float z) const;
+
+    int width;
+    int height;
+    DepthBuffer depth;
+
+    // Summed-area tables of depth and depth squared, (width+1)*(height+1)
+    // with a zero first row and column. Doubles, as float sums of squared
+    // depths lose all precision over a full map.
+    std::vector<double> sumDepth;
+    std::vector<double> sumDepthSq;
+};
+
+#endif // __SHADOWMAP_H__
@@ -0,0 +1,344 @@
+#include <map>
+#include <queue>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "simplify.h"
+
+namespace {
+
+// Symmetric 4x4 error quadric, upper triangle only.
+struct Quadric
+{
+    double a[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    void addPlane(double nx, double ny, double nz, double d, double weight) {
+        double p[4] = { nx, ny, nz, d };
+        int k = 0;
+        for (int i = 0; i < 4; i++) {
+            for (int j = i; j < 4; j++) {
+                a[k++] += weight * p[i] * p[j];
+            }
+        }
+    }
+
+    Quadric &operator +=(const Quadric &q) {
+        for (int i = 0; i < 10; i++) {
+            a[i] += q.a[i];
+        }
+        return *this;
+    }
+
+    double error(const Vec3f &v) const {
+        double x = v.x, y = v.y, z = v.z;
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+             + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+             + a[7]*z*z + 2*a[8]*z
+             + a[9];
+    }
+};
+
+// Collapse `from` onto `to`, valid while neither vertex has changed since.
+struct Candidate
+{
+    double cost;
+    int from, to;
+    unsigned fromVersion, toVersion;
+
+    bool operator <(const Candidate &c) const { return cost > c.cost; }
+};
+
+// Extra weight of the planes pinning boundary and seam edges in place.
+constexpr double edgePenalty = 1000.0;
+
+class Simplifier
+{
+public:
+    Simplifier(const std::vector<Vec3f> &vertices,
+               const std::vector<Vec2f> &textureVertices,
+               const std::vector<FaceIndices> &faces)
+        : vertices(vertices), textureVertices(textureVertices), faces(faces),
+          deleted(faces.size(), false), liveFaces(faces.size()),
+          quadrics(vertices.size()), versions(vertices.size(), 0),
+          dead(vertices.size(), false), vertexFaces(vertices.size())
+    {
+        for (int f = 0; f < (int)faces.size(); f++) {
+            for (int c = 0; c < 3; c++) {
+                vertexFaces[position(f, c)].push_back(f);
+            }
+        }
+        buildQuadrics();
+        for (int v = 0; v < (int)vertices.size(); v++) {
+            pushEdges(v);
+        }
+    }
+
+    int faceCount() const { return liveFaces; }
+
+    // Collapses edges until at most target faces remain or nothing more
+    // can be collapsed.
+    void reduceTo(int target) {
+        while (liveFaces > target && !heap.empty()) {
+            Candidate c = heap.top();
+            heap.pop();
+            if (dead[c.from] || dead[c.to] ||
+                versions[c.from] != c.fromVersion || versions[c.to] != c.toVersion) {
+                continue;
+            }
+            if (canCollapse(c.from, c.to)) {
+                collapse(c.from, c.to);
+            }
+        }
+    }
+
+    std::vector<FaceIndices> liveFaceList() const {
+        std::vector<FaceIndices> result;
+        result.reserve(liveFaces);
+        for (int f = 0; f < (int)faces.size(); f++) {
+            if (!deleted[f]) {
+                result.push_back(faces[f]);
+            }
+        }
+        return result;
+    }
+
+private:
+    int position(int f, int corner) const { return faces[f][corner*3]; }
+    int texture(int f, int corner) const { return faces[f][corner*3 + 1]; }
+
+    int cornerOf(int f, int v) const {
+        for (int c = 0; c < 3; c++) {
+            if (position(f, c) == v) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    Vec3f faceNormal(int f, int moved, const Vec3f &movedTo) const {
+        Vec3f p[3];
+        for (int c = 0; c < 3; c++) {
+            int v = position(f, c);
+            p[c] = v == moved ? movedTo : vertices[v];
+        }
+        return (p[1] - p[0]) ^ (p[2] - p[0]);
+    }
+
+    // Twice the signed area of the face in texture space, with the texture
+    // vertex of one corner swapped for another.
+    float textureArea(int f, int corner, int movedTo) const {
+        Vec2f t[3];
+        for (int c = 0; c < 3; c++) {
+            t[c] = textureVertices[c == corner ? movedTo : texture(f, c)];
+        }
+        Vec2f a = t[1] - t[0];
+        Vec2f b = t[2] - t[0];
+        return a.x*b.y - a.y*b.x;
+    }
+
+    // Texture and normal indices the corners of `from` take on when it
+    // collapses onto `to`, as joined by the faces along the edge.
+    void attributeMaps(int from, int to, std::map<int, int> &textureMap,
+                       std::map<int, int> &normalMap) const {
+        for (int f : vertexFaces[from]) {
+            int cTo = deleted[f] ? -1 : cornerOf(f, to);
+            if (cTo < 0) {
+                continue;
+            }
+            int cFrom = cornerOf(f, from);
+            textureMap[faces[f][cFrom*3 + 1]] = faces[f][cTo*3 + 1];
+            normalMap[faces[f][cFrom*3 + 2]] = faces[f][cTo*3 + 2];
+        }
+    }
+
+    void buildQuadrics() {
+        // Count how often each undirected edge occurs, and with which
+        // texture coordinates, to find boundaries and seams.
+        std::map<std::pair<int, int>, std::vector<std::pair<int, int>>> edges;
+        for (int f = 0; f < (int)faces.size(); f++) {
+            Vec3f n = faceNormal(f, -1, Vec3f());
+            double area = n.magnitude();
+            if (area == 0.0) {
+                continue;
+            }
+            Vec3f unit = n * float(1.0 / area);
+            const Vec3f &p0 = vertices[position(f, 0)];
+            double d = -(unit * p0);
+            for (int c = 0; c < 3; c++) {
+                quadrics[position(f, c)].addPlane(unit.x, unit.y, unit.z, d, area);
+                int a = position(f, c);
+                int b = position(f, (c + 1) % 3);
+                int ta = texture(f, c);
+                int tb = texture(f, (c + 1) % 3);
+                if (a > b) {
+                    std::swap(a, b);
+                    std::swap(ta, tb);
+                }
+                edges[{ a, b }].push_back({ ta, tb });
+            }
+        }
+
+        // Pin boundary and seam edges with planes through the edge,
+        // perpendicular to the adjacent faces.
+        for (int f = 0; f < (int)faces.size(); f++) {
+            Vec3f n = faceNormal(f, -1, Vec3f());
+            if (n.magnitude() == 0.0f) {
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                int a = position(f, c);
+                int b = position(f, (c + 1) % 3);
+                const std::vector<std::pair<int, int>> &uses = edges[{ std::min(a, b), std::max(a, b) }];
+                bool seam = uses.size() != 2 || uses[0] != uses[1];
+                if (!seam) {
+                    continue;
+                }
+                Vec3f edge = vertices[b] - vertices[a];
+                Vec3f side = edge ^ n;
+                if (side.magnitude() == 0.0f) {
+                    continue;
+                }
+                side = side.normalized();
+                double d = -(side * vertices[a]);
+                quadrics[a].addPlane(side.x, side.y, side.z, d, edgePenalty * (edge * edge));
+                quadrics[b].addPlane(side.x, side.y, side.z, d, edgePenalty * (edge * edge));
+            }
+        }
+    }
+
+    std::vector<int> neighbours(int v) const {
+        std::vector<int> result;
+        for (int f : vertexFaces[v]) {
+            if (deleted[f]) {
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                int w = position(f, c);
+                if (w != v) {
+                    result.push_back(w);
+                }
+            }
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    void pushEdges(int v) {
+        for (int w : neighbours(v)) {
+            Quadric q = quadrics[v];
+            q += quadrics[w];
+            heap.push({ q.error(vertices[w]), v, w, versions[v], versions[w] });
+            heap.push({ q.error(vertices[v]), w, v, versions[w], versions[v] });
+        }
+    }
+
+    bool canCollapse(int from, int to) const {
+        // More than two shared neighbours would pinch the surface into a
+        // non-manifold fin.
+        std::vector<int> a = neighbours(from);
+        std::vector<int> b = neighbours(to);
+        std::vector<int> common;
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(common));
+        if (common.size() > 2) {
+            return false;
+        }
+
+        // The faces that survive mustn't flip or collapse to nothing, in
+        // space or in texture space; the shaders build a tangent basis
+        // from the texture coordinates.
+        std::map<int, int> textureMap;
+        std::map<int, int> normalMap;
+        attributeMaps(from, to, textureMap, normalMap);
+        for (int f : vertexFaces[from]) {
+            if (deleted[f] || cornerOf(f, to) >= 0) {
+                continue;
+            }
+            Vec3f before = faceNormal(f, -1, Vec3f());
+            Vec3f after = faceNormal(f, from, vertices[to]);
+            if (after.magnitude() <= 1e-12f || before * after <= 0.0f) {
+                return false;
+            }
+            int c = cornerOf(f, from);
+            auto t = textureMap.find(texture(f, c));
+            if (t != textureMap.end()) {
+                float areaBefore = textureArea(f, c, texture(f, c));
+                float areaAfter = textureArea(f, c, t->second);
+                if (std::abs(areaAfter) <= 1e-9f || (areaBefore > 0.0f) != (areaAfter > 0.0f)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void collapse(int from, int to) {
+        // Faces along the edge disappear. Where they join texture and
+        // normal indices of the two ends, remember the mapping so the
+        // surviving corners of `from` pick up `to`'s attributes.
+        std::map<int, int> textureMap;
+        std::map<int, int> normalMap;
+        attributeMaps(from, to, textureMap, normalMap);
+        for (int f : vertexFaces[from]) {
+            if (!deleted[f] && cornerOf(f, to) >= 0) {
+                deleted[f] = true;
+                liveFaces--;
+            }
+        }
+
+        for (int f : vertexFaces[from]) {
+            if (deleted[f]) {
+                continue;
+            }
+            int c = cornerOf(f, from);
+            faces[f][c*3] = to;
+            auto t = textureMap.find(faces[f][c*3 + 1]);
+            if (t != textureMap.end()) {
+                faces[f][c*3 + 1] = t->second;
+            }
+            auto n = normalMap.find(faces[f][c*3 + 2]);
+            if (n != normalMap.end()) {
+                faces[f][c*3 + 2] = n->second;
+            }
+            vertexFaces[to].push_back(f);
+        }
+        vertexFaces[from].clear();
+
+        quadrics[to] += quadrics[from];
+        dead[from] = true;
+        versions[from]++;
+        versions[to]++;
+        pushEdges(to);
+    }
+
+    const std::vector<Vec3f> &vertices;
+    const std::vector<Vec2f> &textureVertices;
+    std::vector<FaceIndices> faces;
+    std::vector<bool> deleted;
+    int liveFaces;
+
+    std::vector<Quadric> quadrics;
+    std::vector<unsigned> versions;
+    std::vector<bool> dead;
+    std::vector<std::vector<int>> vertexFaces;
+    std::priority_queue<Candidate> heap;
+};
+
+} // namespace
+
+std::vector<std::vector<FaceIndices>> simplifyChain(const std::vector<Vec3f> &vertices,
+                                                    const std::vector<Vec2f> &textureVertices,
+                                                    const std::vector<FaceIndices> &faces,
+                                                    const std::vector<int> &faceTargets)
+{
+    Simplifier simplifier(vertices, textureVertices, faces);
+    std::vector<std::vector<FaceIndices>> levels;
+    for (int target : faceTargets) {
+        simplifier.reduceTo(target);
+        levels.push_back(simplifier.liveFaceList());
+    }
+    return levels;
+}
@@ -0,0 +1,27 @@
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include <vector>
+
+#include "geometry.h"
+
+// A face as Model stores it: vertex, texture vertex and normal index for
+// each of its three corners.
+using FaceIndices = std::vector<int>;
+
+// Builds successively coarser versions of a triangle mesh by quadric error
+// edge collapse (Garland & Heckbert). Each vertex collapses onto one of its
+// neighbours, so every level still indexes the original vertex, texture
+// vertex and normal arrays. Open boundaries and texture seams are weighted
+// to stay put, and collapses that would flip a face, in space or in texture
+// space, are refused.
+//
+// Returns one face list per entry of faceTargets (which should decrease),
+// each with at most that many faces unless the mesh can't be reduced that
+// far, in which case it is as small as it gets.
+std::vector<std::vector<FaceIndices>> simplifyChain(const std::vector<Vec3f> &vertices,
+                                                    const std::vector<Vec2f> &textureVertices,
+                                                    const std::vector<FaceIndices> &faces,
+                                                    const std::vector<int> &faceTargets);
+
+#endif // __SIMPLIFY_H__
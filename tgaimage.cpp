@@ -1,14 +1,31 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "tgaimage.h"
+#include "parallel.h"
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) { }
+TGAImage::TGAImage()
+    : data(NULL), width(0), height(0), bytespp(0),
+      mapping(NULL), mapping_size(0), mapping_writable(false) { }
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp)
+TGAImage::TGAImage(int w, int h, int bpp)
+    : data(NULL), width(w), height(h), bytespp(bpp),
+      mapping(NULL), mapping_size(0), mapping_writable(false)
 {
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
@@ -16,6 +33,7 @@ TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), byt
 }
 
 TGAImage::TGAImage(const TGAImage &img)
+    : mapping(NULL), mapping_size(0), mapping_writable(false)
 {
     width = img.width;
     height = img.height;
@@ -27,13 +45,45 @@ TGAImage::TGAImage(const TGAImage &img)
 
 TGAImage::~TGAImage()
 {
-    if (data) delete [] data;
+    release();
+}
+
+void TGAImage::release()
+{
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    } else if (data) {
+        delete [] data;
+    }
+    data = NULL;
+    mapping = NULL;
+    mapping_size = 0;
+    mapping_writable = false;
+}
+
+// A mapped image's first change turns its mapping copy-on-write: the
+// kernel gives it private copies of the pages it goes on to write and
+// leaves the rest shared.
+void TGAImage::make_writable()
+{
+    if (!mapping || mapping_writable) {
+        return;
+    }
+    if (mprotect(mapping, mapping_size, PROT_READ | PROT_WRITE) == 0) {
+        mapping_writable = true;
+        return;
+    }
+    unsigned long nbytes = width*height*bytespp;
+    unsigned char *copy = new unsigned char[nbytes];
+    memcpy(copy, data, nbytes);
+    release();
+    data = copy;
 }
 
 TGAImage & TGAImage::operator =(const TGAImage &img)
 {
     if (this != &img) {
-        if (data) delete [] data;
+        release();
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
@@ -44,10 +94,9 @@ TGAImage & TGAImage::operator =(const TGAImage &img)
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char *filename)
+bool TGAImage::read_tga_file(const char *filename, Origin origin)
 {
-    if (data) delete [] data;
-    data = NULL;
+    release();
     std::ifstream in;
     in.open (filename, std::ios::binary);
     if (!in.is_open()) {
@@ -92,7 +141,7 @@ bool TGAImage::read_tga_file(const char *filename)
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20)) {
+    if (!(header.imagedescriptor & 0x20) != (origin == BOTTOM_LEFT)) {
         flip_vertically();
     }
     if (header.imagedescriptor & 0x10) {
@@ -103,6 +152,57 @@ bool TGAImage::read_tga_file(const char *filename)
     return true;
 }
 
+bool TGAImage::map_tga_file(const char *filename, Origin origin)
+{
+    release();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    struct stat info;
+    void *file = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(TGA_Header)) {
+        file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (file == MAP_FAILED) {
+        return read_tga_file(filename, origin);
+    }
+
+    TGA_Header header;
+    memcpy(&header, file, sizeof(header));
+    int w = header.width;
+    int h = header.height;
+    int bpp = header.bitsperpixel>>3;
+    // The pixels follow the image ID and any colour map.
+    size_t offset = sizeof(header) + (unsigned char)header.idlength;
+    if (header.colormaptype) {
+        offset += header.colormaplength * (((unsigned char)header.colormapdepth + 7)>>3);
+    }
+    if ((2!=header.datatypecode && 3!=header.datatypecode) || w <= 0 || h <= 0 ||
+        (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA) ||
+        offset + size_t(w)*h*bpp > size_t(info.st_size)) {
+        munmap(file, info.st_size);
+        return read_tga_file(filename, origin);
+    }
+    madvise(file, info.st_size, MADV_WILLNEED);
+    mapping = file;
+    mapping_size = info.st_size;
+    data = (unsigned char *)file + offset;
+    width = w;
+    height = h;
+    bytespp = bpp;
+    if (!(header.imagedescriptor & 0x20) != (origin == BOTTOM_LEFT)) {
+        flip_vertically();
+    }
+    if (header.imagedescriptor & 0x10) {
+        flip_horizontally();
+    }
+    std::cerr << width << "x" << height << "/" << bytespp*8 << " mapped\n";
+    return true;
+}
+
 bool TGAImage::load_rle_data(std::ifstream &in)
 {
     unsigned long pixelcount = width*height;
@@ -155,11 +255,6 @@ bool TGAImage::load_rle_data(std::ifstream &in)
 
 bool TGAImage::write_tga_file(const char *filename, bool rle)
 {
-    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
-    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
-    unsigned char footer[18] =
-        { 'T','R','U','E','V','I','S','I','O','N',
-          '-','X','F','I','L','E','.','\0' };
     std::ofstream out;
     out.open (filename, std::ios::binary);
     if (!out.is_open()) {
@@ -167,58 +262,244 @@ bool TGAImage::write_tga_file(const char *filename, bool rle)
         out.close();
         return false;
     }
+    bool ok = write_tga(out, rle);
+    out.close();
+    return ok;
+}
+
+static TGA_Header make_tga_header(int width, int height, int bytespp, bool rle, bool top_left)
+{
     TGA_Header header;
     memset((void *)&header, 0, sizeof(header));
     header.bitsperpixel = bytespp<<3;
     header.width  = width;
     header.height = height;
-    header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.datatypecode = (bytespp==TGAImage::GRAYSCALE?(rle?11:3):(rle?10:2));
+    header.imagedescriptor = top_left ? 0x20 : 0;
+    return header;
+}
+
+// The developer and extension area references (none), then the signature.
+static const unsigned char tga_footer[26] =
+    { 0, 0, 0, 0, 0, 0, 0, 0,
+      'T','R','U','E','V','I','S','I','O','N',
+      '-','X','F','I','L','E','.','\0' };
+
+static bool write_tga_header(std::ostream &out, int width, int height, int bytespp,
+                             bool rle, bool top_left)
+{
+    TGA_Header header = make_tga_header(width, height, bytespp, rle, top_left);
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
-        out.close();
         std::cerr << "can't dump the tga file\n";
         return false;
     }
+    return true;
+}
+
+static bool write_tga_footer(std::ostream &out)
+{
+    out.write((char *)tga_footer, sizeof(tga_footer));
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
+    return true;
+}
+
+bool TGAImage::write_tga(std::ostream &out, bool rle)
+{
+    if (!write_tga_header(out, width, height, bytespp, rle, true)) {
+        return false;
+    }
+    if (!write_tga_pixels(out, rle)) {
+        return false;
+    }
+    return write_tga_footer(out);
+}
+
+bool TGAImage::write_tga_pixels(std::ostream &out, bool rle) const
+{
     if (!rle) {
         out.write((char *)data, width*height*bytespp);
         if (!out.good()) {
             std::cerr << "can't unload raw data\n";
-            out.close();
             return false;
         }
     } else {
         if (!unload_rle_data(out)) {
-            out.close();
             std::cerr << "can't unload rle data\n";
             return false;
         }
     }
-    out.write((char *)developer_area_ref, sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
+    return true;
+}
+
+bool TGAImage::encode(std::vector<unsigned char> &bytes, FileFormat format, Origin origin) const
+{
+    bytes.clear();
+    if (!data) {
         return false;
     }
-    out.write((char *)extension_area_ref, sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
+    size_t nbytes = size_t(width)*height*bytespp;
+    if (format == TGA_RLE) {
+        std::ostringstream out;
+        if (!write_tga_header(out, width, height, bytespp, true, origin==TOP_LEFT) ||
+            !write_tga_pixels(out, true) || !write_tga_footer(out)) {
+            return false;
+        }
+        std::string encoded = out.str();
+        bytes.assign(encoded.begin(), encoded.end());
+    } else if (format == TGA_RAW) {
+        TGA_Header header = make_tga_header(width, height, bytespp, false, origin==TOP_LEFT);
+        bytes.reserve(sizeof(header) + nbytes + sizeof(tga_footer));
+        bytes.insert(bytes.end(), (unsigned char *)&header, (unsigned char *)(&header + 1));
+        bytes.insert(bytes.end(), data, data + nbytes);
+        bytes.insert(bytes.end(), tga_footer, tga_footer + sizeof(tga_footer));
+    } else {
+        // Rows top to bottom, and red, green, blue.
+        bool grey = bytespp==GRAYSCALE;
+        char header[64];
+        int length = snprintf(header, sizeof(header), "%s\n%d %d\n255\n",
+                              grey ? "P5" : "P6", width, height);
+        int channels = grey ? 1 : 3;
+        bytes.resize(length + size_t(width)*height*channels);
+        memcpy(bytes.data(), header, length);
+        unsigned char *out = bytes.data() + length;
+        for (int y = 0; y < height; y++) {
+            int row = origin==TOP_LEFT ? y : height-1-y;
+            const unsigned char *in = data + size_t(row)*width*bytespp;
+            for (int x = 0; x < width; x++, in += bytespp) {
+                if (grey) {
+                    *out++ = in[0];
+                } else {
+                    *out++ = in[2];
+                    *out++ = in[1];
+                    *out++ = in[0];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Writes parts to filename with writev(), again for whatever a short
+// write leaves over.
+static bool write_parts(const char *filename, struct iovec *parts, int count)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        std::cerr << "can't open file " << filename << "\n";
         return false;
     }
-    out.write((char *)footer, sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
+    bool ok = true;
+    while (ok && count > 0) {
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = written > 0;
+        while (ok && count > 0 && size_t(written) >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (ok && count > 0) {
+            parts->iov_base = (char *)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    ok = ::close(fd) == 0 && ok;
+    if (!ok) {
+        std::cerr << "can't write file " << filename << "\n";
+    }
+    return ok;
+}
+
+bool TGAImage::write_file(const char *filename, FileFormat format, Origin origin) const
+{
+    if (!data) {
+        return false;
+    }
+    if (format == TGA_RAW) {
+        TGA_Header header = make_tga_header(width, height, bytespp, false, origin==TOP_LEFT);
+        struct iovec parts[3] = {
+            { &header, sizeof(header) },
+            { data, size_t(width)*height*bytespp },
+            { (void *)tga_footer, sizeof(tga_footer) },
+        };
+        return write_parts(filename, parts, 3);
+    }
+    if (format == TGA_RLE) {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        return write_tga_header(out, width, height, bytespp, true, origin==TOP_LEFT) &&
+               write_tga_pixels(out, true) && write_tga_footer(out);
+    }
+    std::vector<unsigned char> bytes;
+    if (!encode(bytes, format, origin)) {
+        return false;
+    }
+    struct iovec part = { bytes.data(), bytes.size() };
+    return write_parts(filename, &part, 1);
+}
+
+TGAWriter::~TGAWriter()
+{
+    if (out.is_open()) {
+        close();
+    }
+}
+
+bool TGAWriter::open(const char *filename, int w, int h, int bpp, bool compress)
+{
+    out.open(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    width = w;
+    height = h;
+    bytespp = bpp;
+    rle = compress;
+    rows_written = 0;
+    if (!write_tga_header(out, width, height, bytespp, rle, false)) {
         out.close();
         return false;
     }
-    out.close();
     return true;
 }
 
+bool TGAWriter::write(const TGAImage &band)
+{
+    if (!out.is_open() || band.get_width() != width || band.get_bytespp() != bytespp ||
+        rows_written + band.get_height() > height) {
+        std::cerr << "band doesn't fit the tga file\n";
+        return false;
+    }
+    if (!band.write_tga_pixels(out, rle)) {
+        return false;
+    }
+    rows_written += band.get_height();
+    return true;
+}
+
+bool TGAWriter::close()
+{
+    bool ok = out.is_open() && rows_written == height && write_tga_footer(out);
+    if (rows_written != height) {
+        std::cerr << "tga file closed with " << rows_written << " of " << height << " rows\n";
+    }
+    out.close();
+    return ok && !out.fail();
+}
+
 // TODO: It is not necessary to break a raw chunk for two equal pixels (for
 // the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out)
+bool TGAImage::unload_rle_data(std::ostream &out) const
 {
     const unsigned char max_chunk_length = 128;
     unsigned long npixels = width*height;
@@ -261,7 +542,7 @@ bool TGAImage::unload_rle_data(std::ofstream &out)
     return true;
 }
 
-TGAColor TGAImage::get(int x, int y)
+TGAColor TGAImage::get(int x, int y) const
 {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return TGAColor();
@@ -274,21 +555,22 @@ bool TGAImage::set(int x, int y, TGAColor c)
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
+    make_writable();
     memcpy(data+(x+y*width)*bytespp, c.raw, bytespp);
     return true;
 }
 
-int TGAImage::get_bytespp()
+int TGAImage::get_bytespp() const
 {
     return bytespp;
 }
 
-int TGAImage::get_width()
+int TGAImage::get_width() const
 {
     return width;
 }
 
-int TGAImage::get_height()
+int TGAImage::get_height() const
 {
     return height;
 }
@@ -311,6 +593,7 @@ bool TGAImage::flip_horizontally()
 bool TGAImage::flip_vertically()
 {
     if (!data) return false;
+    make_writable();
     unsigned long bytes_per_line = width*bytespp;
     unsigned char *line = new unsigned char[bytes_per_line];
     int half = height>>1;
@@ -326,18 +609,33 @@ bool TGAImage::flip_vertically()
 }
 
 unsigned char *TGAImage::buffer()
+{
+    make_writable();
+    return data;
+}
+
+const unsigned char *TGAImage::buffer() const
 {
     return data;
 }
 
 void TGAImage::clear()
 {
+    make_writable();
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool TGAImage::scale(int w, int h)
+bool TGAImage::scale(int w, int h, Filter filter)
 {
     if (w<=0 || h<=0 || !data) return false;
+    if (w==width && h==height) return true;
+    if (filter==NEAREST) return scale_nearest(w, h);
+    if (filter==BOX && width%w==0 && height%h==0) return scale_box_integer(w, h);
+    return scale_filtered(w, h, filter);
+}
+
+bool TGAImage::scale_nearest(int w, int h)
+{
     unsigned char *tdata = new unsigned char[w*h*bytespp];
     int nscanline = 0;
     int oscanline = 0;
@@ -366,7 +664,190 @@ bool TGAImage::scale(int w, int h)
             nscanline += nlinebytes;
         }
     }
-    delete [] data;
+    release();
+    data = tdata;
+    width = w;
+    height = h;
+    return true;
+}
+
+// Integer-factor box downsampling, scale()'s fast path for BOX only: every
+// output pixel is the plain average of a kx*ky block, summed in integers.
+bool TGAImage::scale_box_integer(int w, int h)
+{
+    int kx = width/w;
+    int ky = height/h;
+    unsigned int area = kx*ky;
+    unsigned char *tdata = new unsigned char[w*h*bytespp];
+    parallelFor(0, h, [&](int j) {
+        std::vector<unsigned int> sums(w*bytespp, 0);
+        for (int y=j*ky; y<(j+1)*ky; y++) {
+            const unsigned char *src = data+y*width*bytespp;
+            unsigned int *sum = sums.data();
+            for (int i=0; i<w; i++, sum+=bytespp) {
+                for (int x=0; x<kx; x++, src+=bytespp) {
+                    for (int t=0; t<bytespp; t++) sum[t] += src[t];
+                }
+            }
+        }
+        unsigned char *dst = tdata+j*w*bytespp;
+        for (int i=0; i<w*bytespp; i++) {
+            dst[i] = (sums[i]+area/2)/area;
+        }
+    });
+    release();
+    data = tdata;
+    width = w;
+    height = h;
+    return true;
+}
+
+static float filter_support(TGAImage::Filter filter)
+{
+    switch (filter) {
+    case TGAImage::BOX:      return 0.5f;
+    case TGAImage::BILINEAR: return 1.0f;
+    case TGAImage::LANCZOS:  return 3.0f;
+    default:                 return 0.5f;
+    }
+}
+
+static float filter_weight(TGAImage::Filter filter, float x)
+{
+    x = fabsf(x);
+    switch (filter) {
+    case TGAImage::BOX:
+        return x<=0.5f ? 1.0f : 0.0f;
+    case TGAImage::BILINEAR:
+        return x<1.0f ? 1.0f-x : 0.0f;
+    case TGAImage::LANCZOS: {
+        if (x<1e-6f) return 1.0f;
+        if (x>=3.0f) return 0.0f;
+        float px = (float)M_PI*x;
+        return 3.0f*sinf(px)*sinf(px/3.0f)/(px*px);
+    }
+    default:
+        return 0.0f;
+    }
+}
+
+// The source pixels contributing to one destination pixel along one axis,
+// and their normalized weights.
+struct Contribution
+{
+    int first;
+    std::vector<float> weights;
+};
+
+static std::vector<Contribution> contributions(int src, int dst, TGAImage::Filter filter)
+{
+    float ratio = (float)dst/src;
+    // When shrinking, stretch the kernel over the source to antialias.
+    float stretch = ratio<1.0f ? 1.0f/ratio : 1.0f;
+    float support = filter_support(filter)*stretch;
+    std::vector<Contribution> result(dst);
+    for (int i=0; i<dst; i++) {
+        float center = (i+0.5f)/ratio;
+        int first = std::max(0, (int)floorf(center-support));
+        int last = std::min(src-1, (int)ceilf(center+support));
+        Contribution &c = result[i];
+        c.first = first;
+        float total = 0.0f;
+        for (int j=first; j<=last; j++) {
+            float weight = filter_weight(filter, (j+0.5f-center)/stretch);
+            c.weights.push_back(weight);
+            total += weight;
+        }
+        if (total==0.0f) {
+            // The kernel fell between samples; fall back to the nearest one.
+            c.weights.assign(c.weights.size(), 0.0f);
+            c.weights[std::min((int)center, last)-first] = 1.0f;
+            total = 1.0f;
+        }
+        for (size_t j=0; j<c.weights.size(); j++) c.weights[j] /= total;
+        // Trim zero weights at the ends, they cost a multiply-add each.
+        while (c.weights.size()>1 && c.weights.back()==0.0f) c.weights.pop_back();
+        while (c.weights.size()>1 && c.weights.front()==0.0f) {
+            c.weights.erase(c.weights.begin());
+            c.first++;
+        }
+    }
+    return result;
+}
+
+// Weighted sum of n consecutive four-channel float pixels.
+static inline void accumulate_pixels(const float *src, const float *weights, int n, float *out)
+{
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for (int k=0; k<n; k++, src+=4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(weights[k])));
+    }
+    _mm_storeu_ps(out, acc);
+#else
+    float acc[4] = {0, 0, 0, 0};
+    for (int k=0; k<n; k++, src+=4) {
+        for (int t=0; t<4; t++) acc[t] += src[t]*weights[k];
+    }
+    for (int t=0; t<4; t++) out[t] = acc[t];
+#endif
+}
+
+// acc += weight*src over a row of n floats (n a multiple of 4).
+static inline void accumulate_row(const float *src, float weight, int n, float *acc)
+{
+#ifdef __SSE2__
+    __m128 w = _mm_set1_ps(weight);
+    for (int i=0; i<n; i+=4) {
+        _mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), _mm_mul_ps(_mm_loadu_ps(src+i), w)));
+    }
+#else
+    for (int i=0; i<n; i++) acc[i] += src[i]*weight;
+#endif
+}
+
+// Separable resampling: a horizontal pass into four-channel float rows,
+// then a vertical pass back to bytes. Both passes split rows across
+// threads; the horizontal one filters all four channels of a pixel in one
+// SIMD register, the vertical one blends whole rows four floats at a time.
+bool TGAImage::scale_filtered(int w, int h, Filter filter)
+{
+    std::vector<Contribution> xcontrib = contributions(width, w, filter);
+    std::vector<Contribution> ycontrib = contributions(height, h, filter);
+
+    std::vector<float> tmp(w*height*4);
+    parallelFor(0, height, [&](int j) {
+        std::vector<float> row(width*4, 0.0f);
+        const unsigned char *src = data+j*width*bytespp;
+        for (int x=0; x<width; x++) {
+            for (int t=0; t<bytespp; t++) row[x*4+t] = src[x*bytespp+t];
+        }
+        float *dst = &tmp[j*w*4];
+        for (int i=0; i<w; i++) {
+            const Contribution &c = xcontrib[i];
+            accumulate_pixels(&row[c.first*4], c.weights.data(), c.weights.size(), dst+i*4);
+        }
+    });
+
+    unsigned char *tdata = new unsigned char[w*h*bytespp];
+    parallelFor(0, h, [&](int j) {
+        // Sum whole source rows so memory is walked contiguously.
+        const Contribution &c = ycontrib[j];
+        std::vector<float> row(w*4, 0.0f);
+        for (size_t k=0; k<c.weights.size(); k++) {
+            accumulate_row(&tmp[(c.first+k)*w*4], c.weights[k], w*4, row.data());
+        }
+        unsigned char *dst = tdata+j*w*bytespp;
+        for (int i=0; i<w; i++) {
+            for (int t=0; t<bytespp; t++) {
+                // Lanczos lobes can overshoot the byte range.
+                float v = row[i*4+t]+0.5f;
+                dst[i*bytespp+t] = v<0.0f ? 0 : (v>255.0f ? 255 : (unsigned char)v);
+            }
+        }
+    });
+
+    release();
     data = tdata;
     width = w;
     height = h;
@@ -2,6 +2,7 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <vector>
 
 #pragma pack(push,1)
 struct TGA_Header
@@ -77,30 +78,115 @@ protected:
     int height;
     int bytespp;
 
+    // The file mapping data points into, if map_tga_file() mapped it.
+    void *mapping;
+    size_t mapping_size;
+    bool mapping_writable;
+
+    void release();
+    void make_writable();
     bool load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool unload_rle_data(std::ostream &out) const;
+    bool write_tga_pixels(std::ostream &out, bool rle) const;
+
+    friend class TGAWriter;
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
 
+    // Resampling filters for scale(). NEAREST is the original Bresenham
+    // resampler; the others are separable, threaded across rows and
+    // antialias properly when shrinking. Only BOX has a fast path, for
+    // shrinking by whole factors in both directions; BILINEAR and LANCZOS
+    // take the general resampler at every ratio.
+    enum Filter {
+        NEAREST, BOX, BILINEAR, LANCZOS
+    };
+
+    // Which row of the image y = 0 is when reading and writing files:
+    // the top, as usual, or the bottom, as textures addressed by v want.
+    enum Origin {
+        TOP_LEFT, BOTTOM_LEFT
+    };
+
+    // Whole-file encodings for encode() and write_file(). TGA_RLE is what
+    // write_tga_file() writes by default. TGA_RAW skips run-length coding,
+    // which takes most of the encode time on noisy renders and saves
+    // little on them. PPM is binary PPM (P6, or P5 for greyscale images),
+    // with any alpha dropped.
+    enum FileFormat {
+        TGA_RLE, TGA_RAW, PPM
+    };
+
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
-    bool read_tga_file(const char *filename);
+    bool read_tga_file(const char *filename, Origin origin=TOP_LEFT);
+    // Like read_tga_file(), but an uncompressed file (types 2 and 3) is
+    // mapped rather than read, and its pixels are used in place: they
+    // stay in the page cache, shared with every process mapping the
+    // file. The mapping is read-only until something changes the image
+    // (set(), a flip, buffer(), ...), which then gets private copies of
+    // only the pages it writes. Ask for the origin the file is stored in,
+    // so it needn't be flipped, to keep every page shared. Other files
+    // are read with read_tga_file().
+    bool map_tga_file(const char *filename, Origin origin=TOP_LEFT);
+    bool is_mapped() const { return mapping != NULL; }
     bool write_tga_file(const char *filename, bool rle=true);
+    bool write_tga(std::ostream &out, bool rle=true);
+    // Encodes the image as a whole file into bytes, to hand on without
+    // going through the filesystem.
+    bool encode(std::vector<unsigned char> &bytes, FileFormat format=TGA_RLE,
+                Origin origin=TOP_LEFT) const;
+    // Writes the image as a whole file. TGA_RAW goes out in a single
+    // writev() straight from the pixels, PPM in a single write() once
+    // encoded.
+    bool write_file(const char *filename, FileFormat format, Origin origin=TOP_LEFT) const;
     bool flip_horizontally();
     bool flip_vertically();
-    bool scale(int w, int h);
-    TGAColor get(int x, int y);
+    bool scale(int w, int h, Filter filter=NEAREST);
+    TGAColor get(int x, int y) const;
     bool set(int x, int y, TGAColor c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
-    int get_width();
-    int get_height();
-    int get_bytespp();
+    int get_width() const;
+    int get_height() const;
+    int get_bytespp() const;
     unsigned char *buffer();
+    const unsigned char *buffer() const;
     void clear();
+
+protected:
+    bool scale_nearest(int w, int h);
+    bool scale_box_integer(int w, int h);
+    bool scale_filtered(int w, int h, Filter filter);
+};
+
+// Writes a tga file a band of rows at a time, for images too large to hold
+// in memory at once. The file has a bottom-left origin, so bands go in
+// from the bottom of the image up, each with its rows in TGAImage order
+// (y = 0 first); RLE packets never cross from one band into the next.
+class TGAWriter
+{
+public:
+    TGAWriter() { }
+    ~TGAWriter();
+
+    bool open(const char *filename, int width, int height, int bpp, bool rle=true);
+    // Appends band, which must be as wide as the image and of its format.
+    bool write(const TGAImage &band);
+    // Finishes the file. False if it couldn't be written or not every row
+    // was.
+    bool close();
+
+private:
+    std::ofstream out;
+    int width = 0;
+    int height = 0;
+    int bytespp = 0;
+    bool rle = true;
+    int rows_written = 0;
 };
 
 #endif //__IMAGE_H__
@@ -0,0 +1,194 @@
+#include <cmath>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include "vertexcache.h"
+
+// Forsyth's vertex score: recently used vertices score high (the last
+// triangle's three a little lower, so strips don't stall), and vertices
+// with few faces left get a boost so they are finished off rather than
+// left behind as isolated triangles.
+static float vertexScore(int cachePosition, int remainingFaces)
+{
+    if (remainingFaces == 0) {
+        return -1.0f;
+    }
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            score = 0.75f;
+        } else {
+            float t = 1.0f - float(cachePosition - 3) / (vertexCacheSize - 3);
+            score = std::pow(t, 1.5f);
+        }
+    }
+    return score + 2.0f / std::sqrt(float(remainingFaces));
+}
+
+// Whether a corner's vertex already appeared earlier in a degenerate face.
+static bool repeatedCorner(const FaceIndices &face, int corner)
+{
+    for (int c = 0; c < corner; c++) {
+        if (face[c*3] == face[corner*3]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void optimizeVertexCache(std::vector<FaceIndices> &faces, int numVertices)
+{
+    int numFaces = faces.size();
+
+    // Faces around each vertex, packed. The first remaining[v] entries of
+    // a vertex's range are the faces still to be emitted.
+    std::vector<int> remaining(numVertices, 0);
+    for (const FaceIndices &face : faces) {
+        for (int c = 0; c < 3; c++) {
+            if (!repeatedCorner(face, c)) {
+                remaining[face[c*3]]++;
+            }
+        }
+    }
+    std::vector<int> offsets(numVertices + 1, 0);
+    for (int v = 0; v < numVertices; v++) {
+        offsets[v + 1] = offsets[v] + remaining[v];
+    }
+    std::vector<int> vertexFaces(offsets[numVertices]);
+    std::vector<int> filled(offsets.begin(), offsets.end() - 1);
+    for (int f = 0; f < numFaces; f++) {
+        for (int c = 0; c < 3; c++) {
+            if (!repeatedCorner(faces[f], c)) {
+                vertexFaces[filled[faces[f][c*3]]++] = f;
+            }
+        }
+    }
+
+    std::vector<int> cachePosition(numVertices, -1);
+    std::vector<float> score(numVertices);
+    for (int v = 0; v < numVertices; v++) {
+        score[v] = vertexScore(-1, remaining[v]);
+    }
+    std::vector<float> faceScore(numFaces);
+    for (int f = 0; f < numFaces; f++) {
+        faceScore[f] = score[faces[f][0]] + score[faces[f][3]] + score[faces[f][6]];
+    }
+
+    std::vector<char> emitted(numFaces, 0);
+    std::vector<FaceIndices> ordered;
+    ordered.reserve(numFaces);
+    std::vector<int> cache;
+    std::vector<int> touched;
+    int best = -1;
+    while ((int)ordered.size() < numFaces) {
+        if (best < 0) {
+            // Nothing left around the cache: start afresh from the best
+            // face anywhere.
+            float bestScore = -1e30f;
+            for (int f = 0; f < numFaces; f++) {
+                if (!emitted[f] && faceScore[f] > bestScore) {
+                    bestScore = faceScore[f];
+                    best = f;
+                }
+            }
+        }
+
+        emitted[best] = 1;
+        ordered.push_back(faces[best]);
+        touched.assign(cache.begin(), cache.end());
+        std::vector<int> newCache;
+        for (int c = 0; c < 3; c++) {
+            int v = faces[best][c*3];
+            if (repeatedCorner(faces[best], c)) {
+                continue;
+            }
+            int *first = &vertexFaces[offsets[v]];
+            int *last = first + remaining[v];
+            std::iter_swap(std::find(first, last, best), last - 1);
+            remaining[v]--;
+            newCache.push_back(v);
+            touched.push_back(v);
+        }
+        for (int v : cache) {
+            if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+                newCache.push_back(v);
+            }
+        }
+        for (int i = 0; i < (int)newCache.size(); i++) {
+            int v = newCache[i];
+            cachePosition[v] = i < vertexCacheSize ? i : -1;
+            score[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+        if ((int)newCache.size() > vertexCacheSize) {
+            newCache.resize(vertexCacheSize);
+        }
+        cache.swap(newCache);
+
+        // Rescore the faces whose vertices moved, and carry on from the
+        // best of them.
+        best = -1;
+        float bestScore = -1e30f;
+        for (int v : touched) {
+            for (int i = offsets[v]; i < offsets[v] + remaining[v]; i++) {
+                int f = vertexFaces[i];
+                faceScore[f] = score[faces[f][0]] + score[faces[f][3]] + score[faces[f][6]];
+                if (faceScore[f] > bestScore) {
+                    bestScore = faceScore[f];
+                    best = f;
+                }
+            }
+        }
+    }
+    faces.swap(ordered);
+}
+
+float averageCacheMissRatio(const std::vector<FaceIndices> &faces, int numVertices)
+{
+    if (faces.empty()) {
+        return 0.0f;
+    }
+    std::vector<char> cached(numVertices, 0);
+    std::deque<int> fifo;
+    int misses = 0;
+    for (const FaceIndices &face : faces) {
+        for (int c = 0; c < 3; c++) {
+            int v = face[c*3];
+            if (cached[v]) {
+                continue;
+            }
+            misses++;
+            cached[v] = 1;
+            fifo.push_back(v);
+            if ((int)fifo.size() > vertexCacheSize) {
+                cached[fifo.front()] = 0;
+                fifo.pop_front();
+            }
+        }
+    }
+    return float(misses) / faces.size();
+}
+
+std::vector<int> optimizeVertexFetch(std::vector<FaceIndices> &faces, int attribute, int count)
+{
+    std::vector<int> newIndex(count, -1);
+    std::vector<int> oldIndex;
+    oldIndex.reserve(count);
+    for (FaceIndices &face : faces) {
+        for (int c = 0; c < 3; c++) {
+            int &index = face[c*3 + attribute];
+            if (newIndex[index] < 0) {
+                newIndex[index] = oldIndex.size();
+                oldIndex.push_back(index);
+            }
+            index = newIndex[index];
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (newIndex[i] < 0) {
+            newIndex[i] = oldIndex.size();
+            oldIndex.push_back(i);
+        }
+    }
+    return oldIndex;
+}
@@ -0,0 +1,29 @@
+#ifndef __VERTEXCACHE_H__
+#define __VERTEXCACHE_H__
+
+#include <vector>
+
+#include "simplify.h"
+
+// Size of the post-transform vertex cache the optimizer and the miss ratio
+// assume; what most GPUs of the last decade behave like.
+constexpr int vertexCacheSize = 32;
+
+// Reorders faces so that faces sharing vertices are drawn close together
+// (Forsyth's linear-speed vertex cache optimisation), keyed on the vertex
+// indices. This also keeps consecutive triangles close on screen and in
+// texture space.
+void optimizeVertexCache(std::vector<FaceIndices> &faces, int numVertices);
+
+// Average cache miss ratio: vertices transformed per face through a FIFO
+// cache of vertexCacheSize. 3 is no reuse at all; about 0.5-0.7 is as good
+// as a typical closed mesh gets.
+float averageCacheMissRatio(const std::vector<FaceIndices> &faces, int numVertices);
+
+// Renumbers one attribute of the faces (0 vertex, 1 texture vertex, 2
+// normal) in order of first use, so walking the faces walks that array
+// forwards. Returns the old index of each new one, for permuting the array
+// itself; entries no face uses go last.
+std::vector<int> optimizeVertexFetch(std::vector<FaceIndices> &faces, int attribute, int count);
+
+#endif // __VERTEXCACHE_H__